@@ -0,0 +1,314 @@
+/*
+Copyright (C) 2022 Franco Sauvisky
+bench.c is part of oclsim
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "oclsim.h"
+#include "ising.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#define BENCH_FLIPS (1<<24) // Metropolis attempts per timed repetition
+#define BENCH_LAUNCHES 1000
+#define BENCH_XFER_BYTES (256<<20) // read per timed repetition
+#define BENCH_TEMP 2.27
+
+int bench_plat = 0, bench_dev = 0;
+
+static int warmup_n = 1, repeat_n = 5, json = 0, records_n = 0;
+static FILE *out;
+
+static int
+cmp_double(const void *a, const void *b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x>y)-(x<y);
+}
+
+void
+bench_run(char *bench, char *engine, long size, long local, char *unit,
+          bench_fn fn, void *ctx)
+{
+  double rate[repeat_n], mean = 0.0, var = 0.0;
+
+  for(int r = 0; r < warmup_n; r++) fn(ctx);
+  for(int r = 0; r < repeat_n; r++)
+  {
+    rate[r] = fn(ctx);
+    mean += rate[r]/repeat_n;
+  }
+  for(int r = 0; r < repeat_n; r++) var += pow(rate[r]-mean, 2);
+  qsort(rate, repeat_n, sizeof(double), cmp_double);
+
+  double median = (repeat_n%2) ? rate[repeat_n/2] : (rate[repeat_n/2-1]+rate[repeat_n/2])/2;
+  double stddev = (repeat_n>1) ? sqrt(var/(repeat_n-1)) : 0.0;
+
+  if(json)
+  {
+    fprintf(out, "%s{\"bench\":\"%s\",\"engine\":\"%s\",\"size\":%ld,\"local\":%ld,"
+      "\"unit\":\"%s\",\"repeat\":%d,\"mean\":%e,\"median\":%e,\"min\":%e,\"max\":%e,"
+      "\"stddev\":%e}", records_n ? ",\n" : "[\n", bench, engine, size, local, unit,
+      repeat_n, mean, median, rate[0], rate[repeat_n-1], stddev);
+  }
+  else
+  {
+    if(records_n==0) fprintf(out, "bench,engine,size,local,unit,repeat,mean,median,min,max,stddev\n");
+    fprintf(out, "%s,%s,%ld,%ld,%s,%d,%e,%e,%e,%e,%e\n", bench, engine, size, local, unit,
+      repeat_n, mean, median, rate[0], rate[repeat_n-1], stddev);
+  }
+  fflush(out);
+  records_n++;
+  fprintf(stderr, "%-8s %-16s %5ld %4ld %e %s\n", bench, engine, size, local, median, unit);
+}
+
+// Ising update kernels: one launch is steps checkerboard half-sweeps, each one
+// a Metropolis attempt on half of the sites
+struct ising_engine
+{
+  char *kernel;
+  cls_mode mode;
+  int steps;
+};
+
+static struct ising_engine engines[] =
+{
+  {MAIN_K_NAME, CLS_MODE_PINGPONG, 1},
+  {"update_tiled_k", CLS_MODE_PINGPONG, TBLOCK},
+  {"update_rb_k", CLS_MODE_INPLACE, 1},
+};
+
+struct ising_ctx
+{
+  oclSys sys;
+  oclSched sched;
+  size_t veclen;
+  size_t launches;
+  int steps;
+  size_t xfer_s;
+  void *host;
+};
+
+static oclSys
+ising_sys(cls_mode mode, char *kernel, int size, int width, size_t local_s)
+{
+  size_t veclen = (size_t)size*size;
+  struct init_arg_s init_arg = {.rseed = 1234};
+  struct main_arg_s main_arg;
+  dims_i dims = {.dim=2, .global={size,size,0}, .local={width,width,0}};
+
+  for(int i = 0; i < PROB_L; i++)
+  {
+    main_arg.probs[i] = (cl_ulong)CL_UINT_MAX * PROB_MAX * MIN(1.0, exp(-4.0*(i-PROB_Z)/BENCH_TEMP));
+  }
+
+  oclSys sys = cls_new_sys(bench_plat, bench_dev);
+  cls_set_mode(sys, mode);
+  cls_define(sys, "SIZEX", size);
+  cls_define(sys, "SIZEY", size);
+  cls_define(sys, "LOCAL_2D_WIDTH", width);
+  cls_load_sys_from_file(sys, "./ising.cl", ISING_STATE_S(veclen));
+  cls_set_main_kernel(sys, kernel);
+  cls_set_init_arg(sys, &init_arg, sizeof(init_arg), dims);
+  cls_set_main_arg(sys, &main_arg, sizeof(main_arg), local_s, dims);
+  cls_run_init(sys);
+  cls_finish(sys);
+  return sys;
+}
+
+static double
+ising_rep(void *ctx)
+{
+  struct ising_ctx *c = ctx;
+  double start = bench_now();
+  cls_run_update_n(c->sys, c->launches);
+  cls_finish(c->sys);
+  return (double)c->launches*c->steps*c->veclen/2/(bench_now() - start);
+}
+
+static void
+bench_ising(void)
+{
+  int sizes[] = {64, 128, 256, 512, 1024}, widths[] = {4, 8, 16};
+
+  for(size_t e = 0; e < sizeof(engines)/sizeof(engines[0]); e++)
+  {
+    for(size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++)
+    {
+      for(size_t w = 0; w < sizeof(widths)/sizeof(widths[0]); w++)
+      {
+        struct ising_engine *eng = &engines[e];
+        int tile_w = widths[w] + 2*TBLOCK;
+        size_t local_s = (eng->steps>1) ? tile_w*tile_w*sizeof(state_t) : 1;
+        struct ising_ctx c = {.veclen = (size_t)sizes[s]*sizes[s], .steps = eng->steps};
+
+        c.launches = MAX(8, BENCH_FLIPS/(c.veclen/2)/eng->steps);
+        c.sys = ising_sys(eng->mode, eng->kernel, sizes[s], widths[w], local_s);
+        bench_run("ising", eng->kernel, sizes[s], widths[w]*widths[w], "flips/s", ising_rep, &c);
+        cls_release_sys(c.sys);
+      }
+    }
+  }
+}
+
+// Launch overhead: single work-group lattice, so the time is mostly the
+// enqueue and dispatch of each cls_run_update
+static double
+launch_enqueue_rep(void *ctx)
+{
+  struct ising_ctx *c = ctx;
+  double start = bench_now();
+  cls_run_update_n(c->sys, c->launches);
+  double end = bench_now();
+  cls_finish(c->sys);
+  return (end - start)*1e6/c->launches;
+}
+
+static double
+launch_total_rep(void *ctx)
+{
+  struct ising_ctx *c = ctx;
+  double start = bench_now();
+  for(size_t l = 0; l < c->launches; l++) cls_run_update(c->sys);
+  cls_finish(c->sys);
+  return (bench_now() - start)*1e6/c->launches;
+}
+
+static double
+launch_sched_rep(void *ctx)
+{
+  struct ising_ctx *c = ctx;
+  double start = bench_now();
+  cls_run_sched(c->sched, 1);
+  cls_finish(c->sys);
+  return (bench_now() - start)*1e6/c->launches;
+}
+
+static void
+bench_launch(void)
+{
+  struct ising_ctx c = {.launches = BENCH_LAUNCHES};
+
+  c.sys = ising_sys(CLS_MODE_PINGPONG, MAIN_K_NAME, 16, 16, 1);
+  c.sched = cls_new_sched(c.sys);
+  cls_sched_add(c.sched, CLS_STEP_UPDATE, c.launches);
+
+  bench_run("launch", "enqueue", 16, 256, "us/launch", launch_enqueue_rep, &c);
+  bench_run("launch", "update", 16, 256, "us/launch", launch_total_rep, &c);
+  bench_run("launch", "sched", 16, 256, "us/launch", launch_sched_rep, &c);
+
+  cls_release_sched(c.sched);
+  cls_release_sys(c.sys);
+}
+
+// Measurement readback: the output buffer is read as it is, no kernels run
+static double
+xfer_sync_rep(void *ctx)
+{
+  struct ising_ctx *c = ctx;
+  double start = bench_now();
+  for(size_t l = 0; l < c->launches; l++) cls_get_meas(c->sys, c->host);
+  return (double)c->launches*c->xfer_s/1e6/(bench_now() - start);
+}
+
+static double
+xfer_async_rep(void *ctx)
+{
+  struct ising_ctx *c = ctx;
+  int prev = -1;
+  double start = bench_now();
+  for(size_t l = 0; l < c->launches; l++)
+  {
+    int slot = cls_get_meas_async(c->sys, NULL, NULL);
+    if(prev>=0) {cls_wait_meas(c->sys, prev); cls_release_meas(c->sys, prev);}
+    prev = slot;
+  }
+  cls_wait_meas(c->sys, prev);
+  cls_release_meas(c->sys, prev);
+  return (double)c->launches*c->xfer_s/1e6/(bench_now() - start);
+}
+
+static void
+bench_xfer(void)
+{
+  size_t sizes[] = {4<<10, 64<<10, 1<<20, 16<<20, 64<<20};
+  struct meas_arg_s meas_arg = {.idiv = CL_INT_MAX, .ioffset = 0};
+  struct ising_ctx c = {0};
+
+  c.sys = ising_sys(CLS_MODE_PINGPONG, MAIN_K_NAME, 16, 16, 1);
+  for(size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++)
+  {
+    c.xfer_s = sizes[s];
+    c.launches = MAX(4, BENCH_XFER_BYTES/c.xfer_s);
+    c.host = malloc(c.xfer_s);
+    cls_set_meas_arg(c.sys, &meas_arg, sizeof(meas_arg), sizeof(state_t)*LOCAL_1D_LENGTH,
+      c.xfer_s, ISING_DIMS_1D_N(256));
+
+    bench_run("xfer", "get_meas", c.xfer_s, 0, "MB/s", xfer_sync_rep, &c);
+    bench_run("xfer", "get_meas_async", c.xfer_s, 0, "MB/s", xfer_async_rep, &c);
+    free(c.host);
+  }
+  cls_release_sys(c.sys);
+}
+
+void
+usage(char *name)
+{
+  fprintf(stderr, "Usage: %s [-p platform] [-d device] [-w warmup] [-r repeat] [-j] [-o file]"
+    " [ising|mandel|launch|xfer]...\n", name);
+  exit(1);
+}
+
+// Runs the selected benchmarks (all by default), one record per configuration
+// as CSV or, with -j, a JSON array
+void
+main(int argc, char **argv)
+{
+  int opt;
+  out = stdout;
+
+  while((opt = getopt(argc, argv, "p:d:w:r:jo:"))!=-1)
+  {
+    switch(opt)
+    {
+      case 'p': bench_plat = atoi(optarg); break;
+      case 'd': bench_dev = atoi(optarg); break;
+      case 'w': warmup_n = atoi(optarg); break;
+      case 'r': repeat_n = atoi(optarg); break;
+      case 'j': json = 1; break;
+      case 'o':
+        if((out = fopen(optarg, "w"))==NULL) {perror(optarg); exit(1);}
+        break;
+      default: usage(argv[0]);
+    }
+  }
+  if((warmup_n<0)||(repeat_n<1)) usage(argv[0]);
+
+  struct {char *name; void (*fn)(void);} benches[] =
+  {
+    {"ising", bench_ising}, {"mandel", bench_mandel}, {"launch", bench_launch}, {"xfer", bench_xfer}
+  };
+  for(size_t b = 0; b < sizeof(benches)/sizeof(benches[0]); b++)
+  {
+    int run = optind==argc;
+    for(int a = optind; a < argc; a++) run |= !strcmp(argv[a], benches[b].name);
+    if(run) benches[b].fn();
+  }
+
+  if(json) fprintf(out, "%s]\n", records_n ? "\n" : "[");
+  if(out!=stdout) fclose(out);
+}
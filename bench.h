@@ -0,0 +1,43 @@
+/*
+Copyright (C) 2022 Franco Sauvisky
+bench.h is part of oclsim
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef BENCH_HEADER
+#define BENCH_HEADER
+
+#include <time.h>
+
+// One timed repetition of a benchmark, returns its rate in the record's unit.
+// Setup belongs outside, so only the work being measured is timed.
+typedef double (*bench_fn)(void *ctx);
+
+// Runs fn for the warmup and then the timed repetitions, and writes one record
+// (mean, median, min, max, stddev of the rates) to the output
+void bench_run(char *bench, char *engine, long size, long local, char *unit,
+               bench_fn fn, void *ctx);
+
+// Platform and device under test, from -p/-d
+extern int bench_plat, bench_dev;
+
+void bench_mandel(void); // benchmandel.c, has its own mandel.h definitions
+
+static inline double
+bench_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec*1e-9;
+}
+
+#endif
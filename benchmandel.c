@@ -0,0 +1,98 @@
+/*
+Copyright (C) 2022 Franco Sauvisky
+benchmandel.c is part of oclsim
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "oclsim.h"
+#include "mandel.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_ITER 500 // shorter than ITER, so a render takes about a second
+
+// A whole render per repetition. Rates count the iterations each pixel really
+// needed (its lastc), so engines that skip escaped pixels are compared fairly.
+struct mandel_ctx
+{
+  oclSys sys;
+  size_t launches;
+  struct output_s *out;
+};
+
+static double
+mandel_rep(void *ctx)
+{
+  struct mandel_ctx *c = ctx;
+  double iters = 0.0;
+
+  double start = bench_now();
+  cls_run_init(c->sys);
+  cls_run_update_n(c->sys, c->launches);
+  cls_run_meas(c->sys);
+  cls_get_meas(c->sys, c->out);
+  double end = bench_now();
+
+  for(size_t p = 0; p < VECLEN*VECLEN; p++) iters += c->out->lastc[p];
+  return iters/(end - start);
+}
+
+void
+bench_mandel(void)
+{
+  int widths[] = {4, 8, 16}, lengths[] = {16, 64, 256};
+  struct init_arg_s init_arg = {.z0={.x=X0, .y=Y0}, .dz={.x=DX, .y=DY}};
+  struct main_arg_s main_arg;
+  struct wl_main_arg_s wl_arg = {.z0={.x=X0, .y=Y0}, .dz={.x=DX, .y=DY},
+                                 .iter_max=BENCH_ITER, .chunk=CHUNK};
+  struct meas_arg_s meas_arg;
+  struct mandel_ctx c = {.out = malloc(sizeof(struct output_s))};
+
+  for(int w = 0; w < 3; w++) // mandel.cl, one launch per iteration
+  {
+    dims_i dims_2d = {.dim=2, .global=GLOBAL_2D_RANGE, .local={widths[w],widths[w],0}};
+    dims_i dims_1d = {.dim=1, .global=GLOBAL_1D_RANGE, .local={widths[w]*widths[w],0,0}};
+
+    c.sys = cls_new_sys(bench_plat, bench_dev);
+    c.launches = BENCH_ITER;
+    cls_load_sys_from_file(c.sys, "./mandel.cl", sizeof(struct state_s));
+    cls_add_buffer(c.sys, "z0_b", CLS_BUF_STATIC, sizeof(state_t)*VECLEN*VECLEN, NULL);
+    cls_set_init_arg(c.sys, &init_arg, sizeof(init_arg), dims_2d);
+    cls_set_main_arg(c.sys, &main_arg, sizeof(main_arg), 1, dims_2d);
+    cls_set_meas_arg(c.sys, &meas_arg, sizeof(meas_arg), 1, sizeof(struct output_s), dims_1d);
+
+    bench_run("mandel", "mandel", VECLEN, widths[w]*widths[w], "pixel-iters/s", mandel_rep, &c);
+    cls_release_sys(c.sys);
+  }
+
+  for(int l = 0; l < 3; l++) // mandelwl.cl, CHUNK iterations per launch
+  {
+    dims_i dims_2d = {.dim=2, .global=GLOBAL_2D_RANGE, .local=LOCAL_2D_RANGE};
+    dims_i dims_1d = {.dim=1, .global=GLOBAL_1D_RANGE, .local={lengths[l],0,0}};
+
+    c.sys = cls_new_sys(bench_plat, bench_dev);
+    c.launches = (BENCH_ITER+CHUNK-1)/CHUNK;
+    cls_load_sys_from_file(c.sys, "./mandelwl.cl", sizeof(struct wl_state_s));
+    cls_add_buffer(c.sys, "abs_b", CLS_BUF_SCRATCH, sizeof(float_t)*VECLEN*VECLEN, NULL);
+    cls_add_buffer(c.sys, "lastc_b", CLS_BUF_SCRATCH, sizeof(int_t)*VECLEN*VECLEN, NULL);
+    cls_set_init_arg(c.sys, &init_arg, sizeof(init_arg), dims_2d);
+    cls_set_main_arg(c.sys, &wl_arg, sizeof(wl_arg), 2*sizeof(int_t), dims_1d);
+    cls_set_meas_arg(c.sys, &meas_arg, sizeof(meas_arg), 1, sizeof(struct output_s), dims_1d);
+
+    bench_run("mandel", "mandelwl", VECLEN, lengths[l], "pixel-iters/s", mandel_rep, &c);
+    cls_release_sys(c.sys);
+  }
+
+  free(c.out);
+}
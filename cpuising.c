@@ -0,0 +1,369 @@
+/*
+Copyright (C) 2022 Franco Sauvisky
+cpuising.c is part of oclsim
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "cpuising.h"
+#include "philox.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define CHKERROR(c,m) if(c){fprintf(stderr, "%s\n", m); exit(1);}
+
+// A half-sweep updates the lattice in place: active sites only read inactive
+// neighbours, which nobody writes during it, so rows can go to any thread
+struct cpu_ising
+{
+  int sizex, sizey, threads, simd;
+  state_t *state;
+  int_t counter;
+  rand_st rseed;
+  uint_t probs[PROB_L];
+  struct init_arg_s init_arg;
+  struct meas_arg_s meas_arg;
+  char *output;
+  size_t output_s;
+};
+
+cpuSys
+cpu_new_sys(int sizex, int sizey, int threads)
+{
+  cpuSys sys = (cpuSys)calloc(1,sizeof(struct cpu_ising));
+  size_t veclen = (size_t)sizex*sizey;
+
+  sys->sizex = sizex;
+  sys->sizey = sizey;
+#ifdef _OPENMP
+  sys->threads = (threads>0) ? threads : omp_get_max_threads();
+#else
+  sys->threads = 1;
+#endif
+  sys->simd = 1;
+  sys->state = (state_t*)malloc(sizeof(state_t)*veclen);
+  sys->output_s = ISING_OUTPUT_S(veclen);
+  sys->output = (char*)calloc(1,sys->output_s);
+  CHKERROR((sys->state==NULL)||(sys->output==NULL), "Couldn't allocate CPU lattice");
+  return sys;
+}
+
+void
+cpu_set_simd(cpuSys sys, int simd)
+{
+  sys->simd = simd;
+}
+
+static int
+cpu_use_avx2(cpuSys sys)
+{
+  return sys->simd&&(sys->sizey%16==0)&&__builtin_cpu_supports("avx2");
+}
+
+const char*
+cpu_engine(cpuSys sys)
+{
+  return cpu_use_avx2(sys) ? "avx2" : "scalar";
+}
+
+void
+cpu_set_init_arg(cpuSys sys, struct init_arg_s *arg)
+{
+  sys->init_arg = *arg;
+}
+
+void
+cpu_set_main_arg(cpuSys sys, struct main_arg_s *arg)
+{
+  memcpy(sys->probs, arg->probs, sizeof(sys->probs));
+}
+
+void
+cpu_set_meas_arg(cpuSys sys, struct meas_arg_s *arg)
+{
+  sys->meas_arg = *arg;
+  memset(sys->output, 0, sys->output_s);
+}
+
+void
+cpu_run_init(cpuSys sys)
+{
+  size_t veclen = (size_t)sys->sizex*sys->sizey;
+  rand_st rseed = sys->init_arg.rseed;
+
+  #pragma omp parallel for num_threads(sys->threads) schedule(static)
+  for(size_t ij = 0; ij < veclen; ij++)
+  {
+    int rand_sample = philox_rand4(rseed, ij, 0, 1).v[0];
+    sys->state[ij] = (rand_sample>0)?-1:1;
+  }
+  sys->counter = 0;
+  sys->rseed = rseed;
+}
+
+static void
+cpu_row_scalar(cpuSys sys, size_t i)
+{
+  size_t sx = sys->sizex, sy = sys->sizey;
+  uint_t iter = sys->counter;
+  state_t *row = sys->state + i*sy,
+          *up = sys->state + ((i+sx-1)%sx)*sy,
+          *down = sys->state + ((i+1)%sx)*sy;
+
+  for(size_t j = (i+iter+1)%2; j < sy; j += 2) // (i+j+iter)%2 == 1
+  {
+    state_t self_s = row[j];
+    state_t s_sum = self_s*(up[j] + row[(j+sy-1)%sy] + down[j] + row[(j+1)%sy]);
+    uint_t rand_sample = philox_rand4(sys->rseed, i*sy + j, iter, 0).v[0];
+    row[j] = (rand_sample < sys->probs[PROB_Z + s_sum/2])?-self_s:self_s;
+  }
+}
+
+// Lanes of a 16 site block taking the k-th random word, and the active lanes,
+// for the two possible offsets of the first active site
+static const int cpu_perm[2][8] = {{0,0,1,1,2,2,3,3}, {0,0,0,1,1,2,2,3}};
+static const int cpu_mask[2][8] = {{-1,0,-1,0,-1,0,-1,0}, {0,-1,0,-1,0,-1,0,-1}};
+
+__attribute__((target("avx2"))) static inline __m256i
+cpu_mulhi8(__m256i a, __m256i b)
+{
+  __m256i even = _mm256_srli_epi64(_mm256_mul_epu32(a, b), 32);
+  __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32));
+  return _mm256_blend_epi32(even, odd, 0xAA);
+}
+
+// First word of philox_rand4(seed, site, step, sub) for eight sites
+__attribute__((target("avx2"))) static inline __m256i
+cpu_philox8(__m256i site, uint32_t seed, uint32_t step, uint32_t sub)
+{
+  __m256i c0 = site, c1 = _mm256_set1_epi32(step), c2 = _mm256_set1_epi32(sub),
+          c3 = _mm256_setzero_si256();
+  __m256i m0 = _mm256_set1_epi32(PHILOX_M0), m1 = _mm256_set1_epi32(PHILOX_M1);
+  uint32_t k0 = seed, k1 = PHILOX_K1;
+
+  for(int r = 0; r < PHILOX_ROUNDS; r++)
+  {
+    __m256i hi0 = cpu_mulhi8(m0, c0), lo0 = _mm256_mullo_epi32(m0, c0);
+    __m256i hi1 = cpu_mulhi8(m1, c2), lo1 = _mm256_mullo_epi32(m1, c2);
+    c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), _mm256_set1_epi32(k0));
+    c1 = lo1;
+    c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), _mm256_set1_epi32(k1));
+    c3 = lo0;
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+  return c0;
+}
+
+// Blocks of 16 sites: Philox runs once for their 8 active sites, and its words
+// are permuted onto the active lanes of the two 8 site halves. The row is
+// copied to pad with its wrapped ends, so left/right neighbours are plain loads.
+// Whole vectors are stored back, inactive lanes unchanged.
+__attribute__((target("avx2"))) static void
+cpu_row_avx2(cpuSys sys, size_t i, state_t *pad)
+{
+  size_t sx = sys->sizex, sy = sys->sizey;
+  uint_t iter = sys->counter;
+  state_t *row = sys->state + i*sy,
+          *up = sys->state + ((i+sx-1)%sx)*sy,
+          *down = sys->state + ((i+1)%sx)*sy;
+  int a = (i+iter+1)%2; // first active site of every block
+
+  memcpy(pad+1, row, sizeof(state_t)*sy);
+  pad[0] = row[sy-1];
+  pad[sy+1] = row[0];
+
+  __m256i perm[2], mask = _mm256_loadu_si256((const __m256i*)cpu_mask[a]);
+  __m256i sign = _mm256_set1_epi32(0x80000000), stride = _mm256_setr_epi32(0,2,4,6,8,10,12,14);
+  perm[0] = _mm256_loadu_si256((const __m256i*)cpu_perm[a]);
+  perm[1] = _mm256_add_epi32(perm[0], _mm256_set1_epi32(4));
+
+  for(size_t j = 0; j < sy; j += 16)
+  {
+    __m256i site = _mm256_add_epi32(_mm256_set1_epi32(i*sy + j + a), stride);
+    __m256i rand = cpu_philox8(site, sys->rseed, iter, 0);
+
+    for(int h = 0; h < 2; h++)
+    {
+      size_t jj = j + 8*h;
+      __m256i self_s = _mm256_loadu_si256((const __m256i*)(row+jj));
+      __m256i neig = _mm256_add_epi32(
+        _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(up+jj)),
+                         _mm256_loadu_si256((const __m256i*)(down+jj))),
+        _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(pad+jj)),
+                         _mm256_loadu_si256((const __m256i*)(pad+jj+2))));
+      __m256i s_sum = _mm256_mullo_epi32(self_s, neig);
+      __m256i idx = _mm256_add_epi32(_mm256_srai_epi32(s_sum, 1), _mm256_set1_epi32(PROB_Z));
+      __m256i prob = _mm256_i32gather_epi32((const int*)sys->probs, idx, 4);
+      __m256i rand_h = _mm256_permutevar8x32_epi32(rand, perm[h]);
+
+      // rand < prob unsigned, then -self_s where flipped
+      __m256i flip = _mm256_and_si256(mask, _mm256_cmpgt_epi32(_mm256_xor_si256(prob, sign),
+        _mm256_xor_si256(rand_h, sign)));
+      self_s = _mm256_sub_epi32(_mm256_xor_si256(self_s, flip), flip);
+      _mm256_storeu_si256((__m256i*)(row+jj), self_s);
+    }
+  }
+}
+
+void
+cpu_run_update(cpuSys sys)
+{
+  int avx2 = cpu_use_avx2(sys);
+
+  #pragma omp parallel num_threads(sys->threads)
+  {
+    state_t *pad = (state_t*)malloc(sizeof(state_t)*(sys->sizey+2));
+
+    #pragma omp for schedule(static)
+    for(int i = 0; i < sys->sizex; i++)
+    {
+      if(avx2) cpu_row_avx2(sys, i, pad);
+      else cpu_row_scalar(sys, i);
+    }
+    free(pad);
+  }
+  sys->counter++;
+}
+
+void
+cpu_run_update_n(cpuSys sys, size_t n)
+{
+  for(size_t i = 0; i < n; i++) cpu_run_update(sys);
+}
+
+// As measure_k: output_s with mag[BUFFLEN/MEASDIV], then the lattices
+void
+cpu_run_meas(cpuSys sys)
+{
+  size_t veclen = (size_t)sys->sizex*sys->sizey;
+  size_t out_i = (uint_t)(sys->counter + sys->meas_arg.ioffset)/sys->meas_arg.idiv;
+  out_t *mag = (out_t*)sys->output, sum = 0;
+  state_t *states = (state_t*)(mag + BUFFLEN/MEASDIV);
+
+  CHKERROR(out_i>=BUFFLEN/MEASDIV, "Measurement index out of the output buffer");
+
+  #pragma omp parallel for num_threads(sys->threads) reduction(+:sum) schedule(static)
+  for(size_t i = 0; i < veclen; i++) sum += sys->state[i];
+
+  mag[out_i] += sum;
+  memcpy(states + out_i*veclen, sys->state, sizeof(state_t)*veclen);
+}
+
+void
+cpu_get_meas(cpuSys sys, void *out)
+{
+  memcpy(out, sys->output, sys->output_s);
+}
+
+void
+cpu_get_state(cpuSys sys, state_t *out)
+{
+  memcpy(out, sys->state, sizeof(state_t)*sys->sizex*sys->sizey);
+}
+
+void
+cpu_release_sys(cpuSys sys)
+{
+  free(sys->state);
+  free(sys->output);
+  free(sys);
+}
+
+// oclSys backend, see cls_native in oclsim.h. Sizes come from the SIZEX and
+// SIZEY defines; CPU_THREADS sets the thread count and CPU_SIMD=0 forces the
+// scalar path.
+static long
+cpu_define(const char *defines, const char *name, long value)
+{
+  char key[64];
+  snprintf(key, sizeof(key), " -D %s=", name);
+  for(const char *d = strstr(defines, key); d!=NULL; d = strstr(d+1, key))
+  {
+    value = atol(d + strlen(key)); // later defines win, as with the compiler
+  }
+  return value;
+}
+
+static void*
+cpu_native_load(const char *defines, size_t states_s)
+{
+  int sizex = cpu_define(defines, "SIZEX", SIZEX), sizey = cpu_define(defines, "SIZEY", SIZEY);
+  CHKERROR(states_s!=ISING_STATE_S((size_t)sizex*sizey), "State size doesn't match the lattice");
+
+  cpuSys sys = cpu_new_sys(sizex, sizey, cpu_define(defines, "CPU_THREADS", 0));
+  cpu_set_simd(sys, cpu_define(defines, "CPU_SIMD", 1));
+  fprintf(stderr, "Selected device: native CPU engine, %s, %d threads\n",
+    cpu_engine(sys), sys->threads);
+  return sys;
+}
+
+static void
+cpu_native_set_arg(void *eng, cls_step step, void *arg, size_t arg_s)
+{
+  switch(step)
+  {
+    case CLS_STEP_INIT:
+      CHKERROR(arg_s!=sizeof(struct init_arg_s), "Init argument is not an init_arg_s");
+      cpu_set_init_arg(eng, arg);
+      break;
+    case CLS_STEP_UPDATE:
+      CHKERROR(arg_s!=sizeof(struct main_arg_s), "Main argument is not a main_arg_s");
+      cpu_set_main_arg(eng, arg);
+      break;
+    case CLS_STEP_MEAS:
+      CHKERROR(arg_s!=sizeof(struct meas_arg_s), "Measure argument is not a meas_arg_s");
+      cpu_set_meas_arg(eng, arg);
+      break;
+  }
+}
+
+static void
+cpu_native_run(void *eng, cls_step step)
+{
+  switch(step)
+  {
+    case CLS_STEP_INIT: cpu_run_init(eng); break;
+    case CLS_STEP_UPDATE: cpu_run_update(eng); break;
+    case CLS_STEP_MEAS: cpu_run_meas(eng); break;
+  }
+}
+
+static void
+cpu_native_get_meas(void *eng, void *out, size_t out_s, int clear)
+{
+  cpuSys sys = eng;
+
+  CHKERROR(out_s!=sys->output_s, "Output size doesn't match measure_k's");
+  memcpy(out, sys->output, out_s);
+  if(clear) memset(sys->output, 0, out_s);
+}
+
+static void
+cpu_native_release(void *eng)
+{
+  cpu_release_sys(eng);
+}
+
+const cls_native cpu_native =
+{
+  .load = cpu_native_load,
+  .set_arg = cpu_native_set_arg,
+  .run = cpu_native_run,
+  .get_meas = cpu_native_get_meas,
+  .release = cpu_native_release
+};
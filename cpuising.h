@@ -0,0 +1,49 @@
+/*
+Copyright (C) 2022 Franco Sauvisky
+cpuising.h is part of oclsim
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef CPUISING_HEADER
+#define CPUISING_HEADER
+
+#include "oclsim.h" // OpenCL types used by ising.h, no device is needed
+#include "ising.h"
+
+// Native CPU Ising engine with the same calls and results as an oclSys running
+// init_k/update_k/measure_k: same Philox streams, so lattices and measurements
+// match the OpenCL kernels bit for bit. Rows are split over OpenMP threads
+// (build with -fopenmp), and an AVX2 path is used when the CPU has it and
+// sizey is a multiple of 16. Used directly, it needs no OpenCL library;
+// cls_new_sys_native(&cpu_native) runs it behind the oclsim calls instead.
+typedef struct cpu_ising* cpuSys;
+
+extern const cls_native cpu_native;
+
+cpuSys cpu_new_sys(int sizex, int sizey, int threads); // threads<=0: OpenMP default
+void cpu_set_simd(cpuSys sys, int simd); // 0 forces the scalar path
+const char* cpu_engine(cpuSys sys); // "avx2" or "scalar"
+
+void cpu_set_init_arg(cpuSys sys, struct init_arg_s* arg);
+void cpu_set_main_arg(cpuSys sys, struct main_arg_s* arg);
+void cpu_set_meas_arg(cpuSys sys, struct meas_arg_s* arg); // zeroes the output
+
+void cpu_run_init(cpuSys sys);
+void cpu_run_update(cpuSys sys);
+void cpu_run_update_n(cpuSys sys, size_t n);
+void cpu_run_meas(cpuSys sys);
+
+void cpu_get_meas(cpuSys sys, void* out); // ISING_OUTPUT_S(sizex*sizey) bytes
+void cpu_get_state(cpuSys sys, state_t* out); // current lattice
+void cpu_release_sys(cpuSys sys);
+
+#endif
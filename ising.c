@@ -15,8 +15,12 @@ GNU General Public License for more details.
 
 #include "oclsim.h"
 #include "ising.h"
+#include "cpuising.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <time.h>
 #include <math.h>
 
@@ -27,65 +31,588 @@ int64_t millis()
   return ((int64_t) now.tv_sec) * 1000 + ((int64_t) now.tv_nsec) / 1000000;
 }
 
+// Metropolis acceptance thresholds of one temperature. probs is a row of
+// probs_b or the member of a packed main_arg_s, so entries are copied bytewise.
 void
-main(void)
+set_probs(void *probs, double temp)
 {
-  oclSys ising = cls_new_sys(2,0);
-  cls_load_sys_from_file(ising, "./ising.cl", sizeof(struct state_s));
+  for(int i = 0; i < PROB_L; i++)
+  {
+    uint_t p = (cl_ulong)CL_UINT_MAX * PROB_MAX * MIN(1.0, exp(-4.0*(i-PROB_Z)/temp));
+    memcpy((char*)probs + i*sizeof(uint_t), &p, sizeof(p));
+  }
+}
+
+// Adds one replica's measurements and hands its slot back
+void
+reduce_meas(oclSys ising, int slot, double *mag, double *mag2)
+{
+  out_t *out_mag = cls_wait_meas(ising, slot); // output_s starts with mag
+
+  for(int i = 0; i < BUFFLEN/MEASDIV; i++)
+  {
+    *mag += (double)out_mag[i];
+    *mag2 += pow(out_mag[i],2);
+  }
+  cls_release_meas(ising, slot);
+}
+
+// Temperature sweep on a sizex*sizey lattice, kernels specialized for it. Runs
+// on ising and releases it.
+void
+sweep_on(oclSys ising, int sizex, int sizey)
+{
+  size_t veclen = (size_t)sizex*sizey;
+
+  cls_define(ising, "SIZEX", sizex);
+  cls_define(ising, "SIZEY", sizey);
+  cls_load_sys_from_file(ising, "./ising.cl", ISING_STATE_S(veclen));
 
   struct init_arg_s init_arg;
   struct main_arg_s main_arg;
   struct meas_arg_s meas_arg = {.idiv = MEASDIV, .ioffset = -BUFFLEN/4-MEASDIV};
+  dims_i main_dims = ISING_DIMS_2D_N(sizex,sizey);
+  int tuned = 0;
 
   uint rseed = (uint)time(NULL);
   srand(rseed);
 
-  struct output_s *out = malloc(sizeof(struct output_s));
+  cls_set_meas_slots(ising, 2);
+
+  // MEASDIV updates then one measurement, BUFFLEN/MEASDIV times
+  oclSched meas_sched = cls_new_sched(ising);
+  cls_sched_add(meas_sched, CLS_STEP_UPDATE, MEASDIV);
+  cls_sched_add(meas_sched, CLS_STEP_MEAS, 1);
 
   for(float temp = 2.0; temp < 3.0; temp+=0.05)
   {
     double mag = 0.0, mag2 = 0.0;
+    int prev = -1;
 
-    for(int i = 0; i < PROB_L; i++)
-    {
-      main_arg.probs[i] = (cl_ulong)CL_UINT_MAX * PROB_MAX * MIN(1.0, exp(-4.0*(i-PROB_Z)/temp));
-    }
+    set_probs(main_arg.probs, temp);
 
     for(int k = 0; k < REPEAT_SIM; k++)
     {
       cl_uint new_seed = rand();
       init_arg.rseed = new_seed;
 
-      cls_set_init_arg(ising, &init_arg, sizeof(init_arg), ISING_DIMS_2D);
-      cls_set_main_arg(ising, &main_arg, sizeof(main_arg), 1, ISING_DIMS_2D);
-      cls_set_meas_arg(ising, &meas_arg, sizeof(meas_arg), sizeof(state_t)*LOCAL_1D_LENGTH, sizeof(struct output_s), ISING_DIMS_1D);
+      cls_set_init_arg(ising, &init_arg, sizeof(init_arg), ISING_DIMS_2D_N(sizex,sizey));
+      cls_set_main_arg(ising, &main_arg, sizeof(main_arg), 1, main_dims);
+      if(!tuned++) // local range of update_k for this device, cached after the first run
+      {
+        cls_run_init(ising);
+        main_dims = cls_autotune(ising, CLS_STEP_UPDATE);
+      }
+      cls_set_meas_arg(ising, &meas_arg, sizeof(meas_arg), sizeof(state_t)*LOCAL_1D_LENGTH,
+        ISING_OUTPUT_S(veclen), ISING_DIMS_1D_N(veclen));
 
       cls_run_init(ising);
+      cls_run_update_n(ising, BUFFLEN/4);
+      cls_run_sched(meas_sched, BUFFLEN/MEASDIV);
+
+      // Replica k is read back while the host reduces replica k-1
+      int slot = cls_get_meas_async(ising, NULL, NULL);
+      if(prev>=0) reduce_meas(ising, prev, &mag, &mag2);
+      prev = slot;
+    }
+    reduce_meas(ising, prev, &mag, &mag2);
+    printf("%f %f %f\n", temp, mag/(BUFFLEN/MEASDIV*REPEAT_SIM), sqrt(mag2/(BUFFLEN/MEASDIV*REPEAT_SIM)));
+  }
 
-      for(int i = 0; i < BUFFLEN/4; i++)
+  cls_release_sched(meas_sched);
+  cls_release_sys(ising);
+}
+
+void
+sweep(int sizex, int sizey)
+{
+  sweep_on(cls_new_sys(2,0), sizex, sizey);
+}
+
+// Same sweep on the native CPU engine of cpuising.c, behind the same calls
+void
+sweep_cpu(int sizex, int sizey)
+{
+  sweep_on(cls_new_sys_native(&cpu_native), sizex, sizey);
+}
+
+// Same sweep with measure_obs_k: the observables of every replica of a
+// temperature are summed on the device and read once, as a few dozen bytes.
+// Prints per site <m>, <|m|>, <m^2>, <e>, the Binder cumulant, the
+// susceptibility and the specific heat.
+void
+sweep_obs(int sizex, int sizey)
+{
+  size_t veclen = (size_t)sizex*sizey;
+
+  oclSys ising = cls_new_sys(2,0);
+  cls_define(ising, "SIZEX", sizex);
+  cls_define(ising, "SIZEY", sizey);
+  cls_load_sys_from_file(ising, "./ising.cl", ISING_STATE_S(veclen));
+  cls_add_buffer(ising, "partial_b", CLS_BUF_SCRATCH, ISING_PARTIAL_S(veclen), NULL);
+  cls_set_meas_kernel(ising, "measure_obs_k");
+
+  struct init_arg_s init_arg;
+  struct main_arg_s main_arg;
+  struct meas_arg_s meas_arg = {0};
+  struct obs_output_s obs;
+  dims_i main_dims = ISING_DIMS_2D_N(sizex,sizey);
+  int tuned = 0;
+
+  srand((uint)time(NULL));
+
+  oclSched meas_sched = cls_new_sched(ising);
+  cls_sched_add(meas_sched, CLS_STEP_UPDATE, MEASDIV);
+  cls_sched_add(meas_sched, CLS_STEP_MEAS, 1);
+
+  printf("# temp m |m| m^2 e binder chi c\n");
+  for(int t = 0; t < TEMP_N; t++)
+  {
+    double temp = TEMP_0 + TEMP_D*t, avg[OBS_N];
+    set_probs(main_arg.probs, temp);
+
+    for(int k = 0; k < REPEAT_SIM; k++)
+    {
+      init_arg.rseed = rand();
+      cls_set_init_arg(ising, &init_arg, sizeof(init_arg), ISING_DIMS_2D_N(sizex,sizey));
+      cls_set_main_arg(ising, &main_arg, sizeof(main_arg), 1, main_dims);
+      if(!tuned++)
+      {
+        cls_run_init(ising);
+        main_dims = cls_autotune(ising, CLS_STEP_UPDATE);
+      }
+      if(k==0) // zeroes the running sums
       {
-        cls_run_update(ising);
+        cls_set_meas_arg(ising, &meas_arg, sizeof(meas_arg), 2*sizeof(int_t)*LOCAL_1D_LENGTH,
+          sizeof(struct obs_output_s), ISING_DIMS_1D_N(veclen));
       }
 
+      cls_run_init(ising);
+      cls_run_update_n(ising, BUFFLEN/4);
+      cls_run_sched(meas_sched, BUFFLEN/MEASDIV);
+    }
+    cls_get_meas(ising, &obs);
+
+    for(int o = 0; o < OBS_N; o++) avg[o] = ((double)obs.sum[o] - obs.comp[o])/obs.n;
+    printf("%f %f %f %f %f %f %f %f\n", temp, avg[0], avg[1], avg[2], avg[4],
+      1.0 - avg[3]/(3.0*avg[2]*avg[2]), veclen*(avg[2] - avg[1]*avg[1])/temp,
+      veclen*(avg[5] - avg[4]*avg[4])/(temp*temp));
+  }
+
+  cls_release_sched(meas_sched);
+  cls_release_sys(ising);
+}
+
+// Sweep as a job pool: every (temperature, replica) pair is a job, spread over
+// POOL_QUEUES systems per device. Seeds are drawn up front, so the results do
+// not depend on which system ran a job.
+struct pool_sweep
+{
+  oclPool pool;
+  dims_i *main_dims; // tuned for each system of the pool
+  rand_st *seeds;
+  double mag, mag2;
+};
+
+void
+pool_job(oclSys ising, int job, void *user)
+{
+  struct pool_sweep *ps = user;
+  struct init_arg_s init_arg = {.rseed = ps->seeds[job]};
+  struct main_arg_s main_arg;
+  double temp = TEMP_0 + TEMP_D*(job/REPEAT_SIM);
+  int s = 0;
+
+  while(cls_pool_sys(ps->pool, s)!=ising) s++;
+  set_probs(main_arg.probs, temp);
+
+  cls_set_init_arg(ising, &init_arg, sizeof(init_arg), ps->main_dims[s]);
+  cls_set_main_arg(ising, &main_arg, sizeof(main_arg), 1, ps->main_dims[s]);
+  cls_run_init(ising);
+  cls_run_update_n(ising, BUFFLEN/4);
+  for(int m = 0; m < BUFFLEN/MEASDIV; m++)
+  {
+    cls_run_update_n(ising, MEASDIV);
+    cls_run_meas(ising);
+  }
+}
+
+void
+pool_done(int job, void *meas, void *user)
+{
+  struct pool_sweep *ps = user;
+  out_t *out_mag = meas; // output_s starts with mag
+
+  for(int i = 0; i < BUFFLEN/MEASDIV; i++)
+  {
+    ps->mag += (double)out_mag[i];
+    ps->mag2 += pow(out_mag[i],2);
+  }
+  if(job%REPEAT_SIM==REPEAT_SIM-1) // last replica of a temperature
+  {
+    printf("%f %f %f\n", TEMP_0 + TEMP_D*(job/REPEAT_SIM), ps->mag/(BUFFLEN/MEASDIV*REPEAT_SIM),
+      sqrt(ps->mag2/(BUFFLEN/MEASDIV*REPEAT_SIM)));
+    ps->mag = ps->mag2 = 0.0;
+  }
+}
+
+void
+sweep_pool(int sizex, int sizey)
+{
+  size_t veclen = (size_t)sizex*sizey;
+  int jobs_n = TEMP_N*REPEAT_SIM;
+  struct pool_sweep ps = {.pool = cls_new_pool(2, NULL, 0, POOL_QUEUES)};
+  struct init_arg_s init_arg = {0};
+  struct main_arg_s main_arg = {0};
+  struct meas_arg_s meas_arg = {.idiv = MEASDIV, .ioffset = -BUFFLEN/4-MEASDIV};
+  int systems = cls_pool_size(ps.pool);
+
+  ps.main_dims = malloc(sizeof(dims_i)*systems);
+  ps.seeds = malloc(sizeof(rand_st)*jobs_n);
+  srand((uint)time(NULL));
+  for(int j = 0; j < jobs_n; j++) ps.seeds[j] = rand();
+
+  for(int s = 0; s < systems; s++)
+  {
+    oclSys ising = cls_pool_sys(ps.pool, s);
+    cls_define(ising, "SIZEX", sizex);
+    cls_define(ising, "SIZEY", sizey);
+    cls_load_sys_from_file(ising, "./ising.cl", ISING_STATE_S(veclen));
+    cls_set_init_arg(ising, &init_arg, sizeof(init_arg), ISING_DIMS_2D_N(sizex,sizey));
+    cls_set_main_arg(ising, &main_arg, sizeof(main_arg), 1, ISING_DIMS_2D_N(sizex,sizey));
+    cls_run_init(ising);
+    ps.main_dims[s] = cls_autotune(ising, CLS_STEP_UPDATE);
+    cls_set_meas_arg(ising, &meas_arg, sizeof(meas_arg), sizeof(state_t)*LOCAL_1D_LENGTH,
+      ISING_OUTPUT_S(veclen), ISING_DIMS_1D_N(veclen));
+  }
+
+  cls_run_pool(ps.pool, jobs_n, pool_job, pool_done, &ps);
+
+  cls_release_pool(ps.pool);
+  free(ps.main_dims);
+  free(ps.seeds);
+}
+
+// Warm-started sweep: the replicas of a temperature start from the lattice the
+// previous temperature ended with, kept by a second system of the same context
+// and copied on the device, reseeded by warm_init_k and thermalized for only
+// WARM_THERM updates. After every temperature that lattice and the position in
+// the sweep are checkpointed, and a run started again resumes from there.
+struct warm_ckpt
+{
+  cl_int sizex, sizey, temp_i; // last finished temperature
+};
+
+void
+sweep_warm(int sizex, int sizey)
+{
+  size_t veclen = (size_t)sizex*sizey;
+  char ckpt_path[256];
+  struct warm_ckpt ckpt;
+  struct init_arg_s init_arg;
+  struct main_arg_s main_arg;
+  struct meas_arg_s meas_arg = {.idiv = MEASDIV, .ioffset = -WARM_THERM-MEASDIV};
+  oclSys ising = cls_new_sys(2,0);
+  oclSys warm = cls_new_sys_shared(ising);
+  oclSys systems[2] = {ising, warm};
+  int first_t = 0;
+
+  srand((uint)time(NULL));
+  for(int s = 0; s < 2; s++)
+  {
+    cls_define(systems[s], "SIZEX", sizex);
+    cls_define(systems[s], "SIZEY", sizey);
+    cls_load_sys_from_file(systems[s], "./ising.cl", ISING_STATE_S(veclen));
+  }
+  cls_set_init_kernel(ising, "warm_init_k");
+  cls_set_meas_slots(ising, 2);
+
+  snprintf(ckpt_path, sizeof(ckpt_path), WARM_CKPT, sizex, sizey);
+  if(access(ckpt_path, R_OK)==0)
+  {
+    cls_load_state(warm, ckpt_path, &ckpt, sizeof(ckpt));
+    if((ckpt.sizex!=sizex)||(ckpt.sizey!=sizey))
+    {
+      fprintf(stderr, "Checkpoint %s is for another lattice\n", ckpt_path);
+      exit(1);
+    }
+    first_t = ckpt.temp_i+1;
+    fprintf(stderr, "Resuming from %s after T=%f\n", ckpt_path, TEMP_0 + TEMP_D*ckpt.temp_i);
+  }
+  else // cold start, equilibrated at the first temperature
+  {
+    init_arg.rseed = rand();
+    set_probs(main_arg.probs, TEMP_0);
+    cls_set_init_arg(warm, &init_arg, sizeof(init_arg), ISING_DIMS_2D_N(sizex,sizey));
+    cls_set_main_arg(warm, &main_arg, sizeof(main_arg), 1, ISING_DIMS_2D_N(sizex,sizey));
+    cls_run_init(warm);
+    cls_run_update_n(warm, BUFFLEN/4);
+  }
+
+  oclSched meas_sched = cls_new_sched(ising);
+  cls_sched_add(meas_sched, CLS_STEP_UPDATE, MEASDIV);
+  cls_sched_add(meas_sched, CLS_STEP_MEAS, 1);
+
+  for(int t = first_t; t < TEMP_N; t++)
+  {
+    double temp = TEMP_0 + TEMP_D*t, mag = 0.0, mag2 = 0.0;
+    int prev = -1;
+    set_probs(main_arg.probs, temp);
+
+    for(int k = 0; k < REPEAT_SIM; k++)
+    {
+      init_arg.rseed = rand();
+      cls_set_init_arg(ising, &init_arg, sizeof(init_arg), ISING_DIMS_2D_N(sizex,sizey));
+      cls_set_main_arg(ising, &main_arg, sizeof(main_arg), 1, ISING_DIMS_2D_N(sizex,sizey));
+      cls_set_meas_arg(ising, &meas_arg, sizeof(meas_arg), sizeof(state_t)*LOCAL_1D_LENGTH,
+        ISING_OUTPUT_S(veclen), ISING_DIMS_1D_N(veclen));
+
+      cls_copy_state(ising, warm);
+      cls_run_init(ising);
+      cls_run_update_n(ising, WARM_THERM);
+      cls_run_sched(meas_sched, BUFFLEN/MEASDIV);
+
+      int slot = cls_get_meas_async(ising, NULL, NULL);
+      if(prev>=0) reduce_meas(ising, prev, &mag, &mag2);
+      prev = slot;
+    }
+    reduce_meas(ising, prev, &mag, &mag2);
+    printf("%f %f %f\n", temp, mag/(BUFFLEN/MEASDIV*REPEAT_SIM), sqrt(mag2/(BUFFLEN/MEASDIV*REPEAT_SIM)));
+    fflush(stdout);
+
+    cls_copy_state(warm, ising); // the last replica starts the next temperature
+    ckpt = (struct warm_ckpt){.sizex = sizex, .sizey = sizey, .temp_i = t};
+    cls_save_state(warm, ckpt_path, &ckpt, sizeof(ckpt));
+  }
+  remove(ckpt_path); // sweep complete
+
+  cls_release_sched(meas_sched);
+  cls_release_sys(warm);
+  cls_release_sys(ising);
+}
+
+// Same sweep as one ensemble: every (temperature, replica) pair is a replica of
+// the state buffer, so each launch advances a whole batch of them
+void
+sweep_ens(int sizex, int sizey)
+{
+  size_t veclen = (size_t)sizex*sizey, total = (size_t)TEMP_N*REPEAT_SIM;
+  size_t batch = MIN(total, MAX(1, ENS_BYTES/ISING_STATE_S(veclen)));
+  double mag[TEMP_N] = {0.0}, mag2[TEMP_N] = {0.0};
+  uint_t *probs = malloc(sizeof(uint_t)*PROB_L*batch);
+  rand_st *seeds = malloc(sizeof(rand_st)*batch);
+  struct ens_output_s *out = malloc(sizeof(struct ens_output_s)*batch);
+
+  oclSys ising = cls_new_sys(2,0);
+  cls_define(ising, "SIZEX", sizex);
+  cls_define(ising, "SIZEY", sizey);
+  cls_load_sys_from_file(ising, "./ising.cl", ISING_STATE_S(veclen)*batch);
+  cls_add_buffer(ising, "probs_b", CLS_BUF_STATIC, sizeof(uint_t)*PROB_L*batch, NULL);
+  cls_add_buffer(ising, "seeds_b", CLS_BUF_STATIC, sizeof(rand_st)*batch, NULL);
+  cls_set_init_kernel(ising, "init_ens_k");
+  cls_set_main_kernel(ising, "update_ens_k");
+  cls_set_meas_kernel(ising, "measure_ens_k");
+
+  struct init_arg_s init_arg = {0};
+  struct main_arg_s main_arg = {0}; // unused, the probabilities are in probs_b
+  struct meas_arg_s meas_arg = {.idiv = MEASDIV, .ioffset = -BUFFLEN/4-MEASDIV};
+  dims_i main_dims = ISING_DIMS_ENS_N(sizex,sizey,batch);
+  int tuned = 0;
+
+  srand((uint)time(NULL));
+
+  oclSched meas_sched = cls_new_sched(ising);
+  cls_sched_add(meas_sched, CLS_STEP_UPDATE, MEASDIV);
+  cls_sched_add(meas_sched, CLS_STEP_MEAS, 1);
+
+  for(size_t first = 0; first < total; first += batch)
+  {
+    size_t n = MIN(batch, total - first);
+
+    for(size_t r = 0; r < n; r++)
+    {
+      set_probs(probs + r*PROB_L, TEMP_0 + TEMP_D*((first+r)/REPEAT_SIM));
+      seeds[r] = rand();
+    }
+    cls_write_buffer(ising, "probs_b", probs);
+    cls_write_buffer(ising, "seeds_b", seeds);
+
+    main_dims.global[2] = n;
+    cls_set_init_arg(ising, &init_arg, sizeof(init_arg), ISING_DIMS_ENS_N(sizex,sizey,n));
+    cls_set_main_arg(ising, &main_arg, sizeof(main_arg), 1, main_dims);
+    if(!tuned++)
+    {
+      cls_run_init(ising);
+      main_dims = cls_autotune(ising, CLS_STEP_UPDATE);
+    }
+    cls_set_meas_arg(ising, &meas_arg, sizeof(meas_arg), sizeof(state_t)*LOCAL_1D_LENGTH,
+      sizeof(struct ens_output_s)*batch, ISING_DIMS_ENS_MEAS_N(veclen,n));
+
+    cls_run_init(ising);
+    cls_run_update_n(ising, BUFFLEN/4);
+    cls_run_sched(meas_sched, BUFFLEN/MEASDIV);
+    cls_get_meas(ising, out);
+
+    for(size_t r = 0; r < n; r++)
+    {
+      int t = (first+r)/REPEAT_SIM;
       for(int i = 0; i < BUFFLEN/MEASDIV; i++)
       {
-        for(int k = 0; k < MEASDIV; k++)
-        {
-          cls_run_update(ising);
-        }
-        cls_run_meas(ising);
+        mag[t] += (double)out[r].mag[i];
+        mag2[t] += pow(out[r].mag[i],2);
       }
+    }
+  }
+
+  for(int t = 0; t < TEMP_N; t++)
+  {
+    printf("%f %f %f\n", TEMP_0 + TEMP_D*t, mag[t]/(BUFFLEN/MEASDIV*REPEAT_SIM),
+      sqrt(mag2[t]/(BUFFLEN/MEASDIV*REPEAT_SIM)));
+  }
 
-      cls_get_meas(ising, out);
+  cls_release_sched(meas_sched);
+  cls_release_sys(ising);
+  free(probs);
+  free(seeds);
+  free(out);
+}
 
-      for(int i = 0; i < BUFFLEN/MEASDIV; i++)
+// Replica exchange sweep: one replica per temperature and chain, all advanced
+// by the same launches. Every PT_EVERY half-sweeps the energies measured on the
+// device decide the swaps of neighbouring temperatures. A swap exchanges the
+// probs_b rows of the two replicas, the lattices stay where they are.
+void
+sweep_pt(int sizex, int sizey)
+{
+  size_t veclen = (size_t)sizex*sizey;
+  int chains = MIN(PT_CHAINS, MAX(1, ENS_BYTES/(TEMP_N*ISING_STATE_S(veclen))));
+  int reps = chains*TEMP_N;
+  int rep_of[reps]; // replica at temperature t of chain c is rep_of[c*TEMP_N+t]
+  uint_t probs[TEMP_N][PROB_L], *rep_probs = malloc(sizeof(uint_t)*PROB_L*reps);
+  rand_st *seeds = malloc(sizeof(rand_st)*reps);
+  double mag[TEMP_N] = {0.0}, mag2[TEMP_N] = {0.0};
+  long tried[TEMP_N] = {0}, swapped[TEMP_N] = {0};
+
+  srand((uint)time(NULL));
+  for(int t = 0; t < TEMP_N; t++) set_probs(probs[t], TEMP_0 + TEMP_D*t);
+  for(int r = 0; r < reps; r++)
+  {
+    rep_of[r] = r;
+    seeds[r] = rand();
+    memcpy(rep_probs + r*PROB_L, probs[r%TEMP_N], sizeof(probs[0]));
+  }
+
+  oclSys ising = cls_new_sys(2,0);
+  cls_define(ising, "SIZEX", sizex);
+  cls_define(ising, "SIZEY", sizey);
+  cls_load_sys_from_file(ising, "./ising.cl", ISING_STATE_S(veclen)*reps);
+  cls_add_buffer(ising, "probs_b", CLS_BUF_STATIC, sizeof(uint_t)*PROB_L*reps, rep_probs);
+  cls_add_buffer(ising, "seeds_b", CLS_BUF_STATIC, sizeof(rand_st)*reps, seeds);
+  cls_set_init_kernel(ising, "init_ens_k");
+  cls_set_main_kernel(ising, "update_ens_k");
+  cls_set_meas_kernel(ising, "measure_pt_k");
+
+  struct init_arg_s init_arg = {0};
+  struct main_arg_s main_arg = {0}; // unused, the probabilities are in probs_b
+  struct meas_arg_s meas_arg = {0};
+  cls_set_init_arg(ising, &init_arg, sizeof(init_arg), ISING_DIMS_ENS_N(sizex,sizey,reps));
+  cls_set_main_arg(ising, &main_arg, sizeof(main_arg), 1, ISING_DIMS_ENS_N(sizex,sizey,reps));
+  cls_run_init(ising);
+  cls_autotune(ising, CLS_STEP_UPDATE);
+  cls_set_meas_arg(ising, &meas_arg, sizeof(meas_arg), 2*sizeof(state_t)*LOCAL_1D_LENGTH,
+    sizeof(struct pt_output_s)*reps, ISING_DIMS_ENS_MEAS_N(veclen,reps));
+
+  cls_run_init(ising);
+  for(int e = 0; e < PT_THERM+PT_MEAS; e++)
+  {
+    cls_run_update_n(ising, PT_EVERY);
+    cls_run_meas(ising);
+    int slot = cls_get_meas_async(ising, NULL, NULL); // also zeroes the output
+    struct pt_output_s *out = cls_wait_meas(ising, slot);
+
+    for(int c = 0; c < chains; c++)
+    {
+      int *chain = rep_of + c*TEMP_N;
+
+      for(int t = 0; (e>=PT_THERM)&&(t < TEMP_N); t++)
+      {
+        mag[t] += (double)out[chain[t]].mag;
+        mag2[t] += pow(out[chain[t]].mag,2);
+      }
+
+      for(int t = e%2; t+1 < TEMP_N; t += 2) // even and odd pairs alternate
       {
-        mag += (double)out->mag[i];
-        mag2 += pow(out->mag[i],2);
+        double beta_d = 1.0/(TEMP_0 + TEMP_D*t) - 1.0/(TEMP_0 + TEMP_D*(t+1));
+        double delta = beta_d*(out[chain[t]].energy - out[chain[t+1]].energy);
+
+        tried[t]++;
+        if((delta>=0)||((double)rand()/RAND_MAX < exp(delta)))
+        {
+          int r = chain[t];
+          chain[t] = chain[t+1];
+          chain[t+1] = r;
+          memcpy(rep_probs + chain[t]*PROB_L, probs[t], sizeof(probs[0]));
+          memcpy(rep_probs + chain[t+1]*PROB_L, probs[t+1], sizeof(probs[0]));
+          swapped[t]++;
+        }
       }
     }
-    printf("%f %f %f\n", temp, mag/(BUFFLEN/MEASDIV*REPEAT_SIM), sqrt(mag2/(BUFFLEN/MEASDIV*REPEAT_SIM)));
+    cls_release_meas(ising, slot);
+    cls_write_buffer(ising, "probs_b", rep_probs);
+  }
+
+  for(int t = 0; t < TEMP_N; t++)
+  {
+    printf("%f %f %f\n", TEMP_0 + TEMP_D*t, mag[t]/((double)PT_MEAS*chains),
+      sqrt(mag2[t]/((double)PT_MEAS*chains)));
+  }
+  for(int t = 0; t+1 < TEMP_N; t++)
+  {
+    fprintf(stderr, "swap %f <-> %f: %.3f accepted\n", TEMP_0 + TEMP_D*t, TEMP_0 + TEMP_D*(t+1),
+      (double)swapped[t]/MAX(tried[t], 1));
   }
 
   cls_release_sys(ising);
+  free(rep_probs);
+  free(seeds);
+}
+
+// Without arguments runs the default SIZEX*SIZEY lattice; otherwise sweeps the
+// given square lattice sizes, one block per size after a "# size" line. With
+// -e first, every sweep runs as a batched ensemble (sweep_ens); with -t, as
+// parallel tempering chains (sweep_pt); with -s, with scalar observables
+// reduced on the device (sweep_obs); with -j, as jobs of a pool of systems
+// (sweep_pool); with -w, warm-started and checkpointed (sweep_warm); with -c,
+// on the native CPU engine instead of a device (sweep_cpu).
+void
+main(int argc, char **argv)
+{
+  void (*run)(int, int) = sweep;
+  int first = 1;
+
+  if((argc>1)&&!strcmp(argv[1], "-e")) {run = sweep_ens; first++;}
+  else if((argc>1)&&!strcmp(argv[1], "-t")) {run = sweep_pt; first++;}
+  else if((argc>1)&&!strcmp(argv[1], "-s")) {run = sweep_obs; first++;}
+  else if((argc>1)&&!strcmp(argv[1], "-j")) {run = sweep_pool; first++;}
+  else if((argc>1)&&!strcmp(argv[1], "-w")) {run = sweep_warm; first++;}
+  else if((argc>1)&&!strcmp(argv[1], "-c")) {run = sweep_cpu; first++;}
+
+  if(argc<=first)
+  {
+    run(SIZEX, SIZEY);
+    return;
+  }
+
+  for(int a = first; a < argc; a++)
+  {
+    int size = atoi(argv[a]);
+    if((size<LOCAL_2D_WIDTH)||(size&(size-1))) // RIND wraps with unsigned modulo
+    {
+      fprintf(stderr, "Lattice size %s must be a power of two, at least %d\n",
+        argv[a], LOCAL_2D_WIDTH);
+      exit(1);
+    }
+    printf("# size %d\n", size);
+    run(size, size);
+  }
 }
@@ -1,4 +1,5 @@
 #include "ising.h"
+#include "philox.h"
 
 //  MWC64X Random Number Generator
 // uint
@@ -14,18 +15,9 @@
 //   return res;                       // Return the next result
 // }
 
-// Based on "4-byte Integer Hashing" by Thomas Wang
-// http://www.burtleburtle.net/bob/hash/integer.html
-inline uint
-randomize_seed(uint a)
-{
-  a = (a ^ 61) ^ (a >> 16);
-  a = a + (a << 3);
-  a = a ^ (a >> 4);
-  a = a * 0x27d4eb2d;
-  a = a ^ (a >> 15);
-  return a;
-}
+// Random words come from Philox keyed by (rseed, site, counter); sub-stream 0
+// is used by the updates, sub-stream 1 by init_k, and sub-streams 2 and 3 by
+// the Swendsen-Wang bonds and cluster flips.
 
 kernel void
 init_k(global struct state_s *output,
@@ -35,14 +27,29 @@ init_k(global struct state_s *output,
          j = get_global_id(1);
 
   size_t ij = IND(i,j);
-  int rand_sample = randomize_seed(arg->rseed + 42013*ij);
+  int rand_sample = philox_rand4(arg->rseed, GIND(i,j), 0, 1).v[0];
 
   output->state[ij] = (rand_sample>0)?-1:1;
-  output->rseeds[ij] = randomize_seed(arg->rseed + 98473*ij);
 
   if(ij==0)
   {
     output->counter = 0;
+    output->rseed = arg->rseed;
+    output->groups_done = 0;
+  }
+}
+
+// Warm start: keeps the lattice already in the state (cls_copy_state or
+// cls_load_state) and restarts its counter with a new seed
+kernel void
+warm_init_k(global struct state_s *output,
+          constant struct init_arg_s *arg)
+{
+  if((get_global_id(0)==0)&&(get_global_id(1)==0))
+  {
+    output->counter = 0;
+    output->rseed = arg->rseed;
+    output->groups_done = 0;
   }
 }
 
@@ -55,24 +62,128 @@ update_k(global struct state_s *output,
   size_t i = get_global_id(0),
          j = get_global_id(1);
   size_t ij = IND(i,j);
-  uint rand_sample = input->rseeds[ij];
   uint iter =  input->counter;
+  rand_st rseed = input->rseed;
 
   state_t self_s = input->state[IND(i,j)];
-  state_t neig1_s = input->state[RIND(i-1,j)];
-  state_t neig2_s = input->state[RIND(i,j-1)];
-  state_t neig3_s = input->state[RIND(i+1,j)];
-  state_t neig4_s = input->state[RIND(i,j+1)];
-  state_t s_sum = self_s*(neig1_s+neig2_s+neig3_s+neig4_s);
+  uint par = ((GROW(i)+j+(iter%2))%2); // checkboard pattern (0 or 1)
 
-  uint par = ((i+j+(iter%2))%2); // checkboard pattern (0 or 1)
-  char flip = par&&(rand_sample < arg->probs[(size_t)(PROB_Z + s_sum/2)]);
+  if(par)
+  {
+    state_t neig1_s = input->state[RIND(i-1,j)];
+    state_t neig2_s = input->state[RIND(i,j-1)];
+    state_t neig3_s = input->state[RIND(i+1,j)];
+    state_t neig4_s = input->state[RIND(i,j+1)];
+    state_t s_sum = self_s*(neig1_s+neig2_s+neig3_s+neig4_s);
 
-  output->state[ij] = (flip)?-self_s:self_s;
-  output->rseeds[ij] = randomize_seed(rand_sample + 42013*ij);
-  if(ij==0)
+    uint rand_sample = philox_rand4(rseed, GIND(i,j), iter, 0).v[0];
+    char flip = rand_sample < arg->probs[(size_t)(PROB_Z + s_sum/2)];
+    self_s = (flip)?-self_s:self_s;
+  }
+
+  output->state[ij] = self_s;
+  if((i==SLAB_HALO)&&(j==0)) // first owned site
   {
     output->counter = iter+1;
+    output->rseed = rseed;
+    output->groups_done = 0;
+  }
+}
+
+// In-place update for CLS_MODE_INPLACE: launched over SIZEX/2 x SIZEY, one
+// work-item per site of the active color. Neighbours all have the other color
+// and are not written during the launch. The counter is bumped by the last
+// work-group to finish, after every work-group has read it.
+kernel void
+update_rb_k(global struct state_s *state,
+            global struct state_s *alias, // same buffer as state
+            local void *lc_skpd,
+            constant struct main_arg_s *arg,
+            uint color)
+{
+  size_t j = get_global_id(1),
+         i = 2*get_global_id(0) + (j+color+1)%2; // (i+j+color)%2 == 1
+  size_t ij = IND(i,j);
+  uint iter = state->counter;
+
+  state_t self_s = state->state[ij];
+  state_t neig1_s = state->state[RIND(i-1,j)];
+  state_t neig2_s = state->state[RIND(i,j-1)];
+  state_t neig3_s = state->state[RIND(i+1,j)];
+  state_t neig4_s = state->state[RIND(i,j+1)];
+  state_t s_sum = self_s*(neig1_s+neig2_s+neig3_s+neig4_s);
+
+  uint rand_sample = philox_rand4(state->rseed, ij, iter, 0).v[0];
+  char flip = rand_sample < arg->probs[(size_t)(PROB_Z + s_sum/2)];
+
+  state->state[ij] = (flip)?-self_s:self_s;
+
+  barrier(CLK_GLOBAL_MEM_FENCE);
+  if((get_local_id(0)==0)&&(get_local_id(1)==0))
+  {
+    uint groups = get_num_groups(0)*get_num_groups(1);
+    if(atomic_inc(&state->groups_done)==groups-1)
+    {
+      state->groups_done = 0;
+      state->counter = iter+1;
+    }
+  }
+}
+
+// Same dynamics as TBLOCK launches of update_k. The tile plus a TBLOCK wide
+// halo is kept in local memory; halo sites are recomputed redundantly by the
+// neighbouring work-groups, so the valid region shrinks by one site per step.
+// Tile origins assume LOCAL_2D_WIDTH square groups, which the attribute enforces
+// (and tells cls_autotune not to try other shapes).
+kernel __attribute__((reqd_work_group_size(LOCAL_2D_WIDTH, LOCAL_2D_WIDTH, 1))) void
+update_tiled_k(global struct state_s *output,
+               global struct state_s *input,
+               local void *lc_skpd,
+               constant struct main_arg_s *arg)
+{
+  int i_l = get_local_id(0), j_l = get_local_id(1);
+  int i0 = get_group_id(0)*LOCAL_2D_WIDTH - TBLOCK,
+      j0 = get_group_id(1)*LOCAL_2D_WIDTH - TBLOCK;
+  uint iter = input->counter;
+  rand_st rseed = input->rseed;
+
+  local state_t *tile_s = lc_skpd;
+
+  for(int c = i_l*LOCAL_2D_WIDTH + j_l; c < TILE_W*TILE_W; c += LOCAL_1D_LENGTH)
+  {
+    tile_s[c] = input->state[RIND(i0 + c/TILE_W + SIZEX, j0 + c%TILE_W + SIZEY)];
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for(int h = 0; h < TBLOCK; h++)
+  {
+    // Active sites only read inactive neighbours, so updating in place is safe
+    for(int c = i_l*LOCAL_2D_WIDTH + j_l; c < TILE_W*TILE_W; c += LOCAL_1D_LENGTH)
+    {
+      int ti = c/TILE_W, tj = c%TILE_W;
+      if((ti <= h)||(tj <= h)||(ti >= TILE_W-1-h)||(tj >= TILE_W-1-h)) continue;
+
+      size_t gi = (i0 + ti + SIZEX)%SIZEX, gj = (j0 + tj + SIZEY)%SIZEY;
+      uint par = ((gi+gj+((iter+h)%2))%2);
+      if(!par) continue;
+
+      state_t self_s = tile_s[c];
+      state_t s_sum = self_s*(tile_s[c-TILE_W] + tile_s[c-1] + tile_s[c+TILE_W] + tile_s[c+1]);
+      uint rand_sample = philox_rand4(rseed, IND(gi,gj), iter+h, 0).v[0];
+      char flip = rand_sample < arg->probs[(size_t)(PROB_Z + s_sum/2)];
+
+      tile_s[c] = (flip)?-self_s:self_s;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  size_t i = get_global_id(0), j = get_global_id(1);
+  output->state[IND(i,j)] = tile_s[(i_l+TBLOCK)*TILE_W + (j_l+TBLOCK)];
+  if(IND(i,j)==0)
+  {
+    output->counter = iter+TBLOCK;
+    output->rseed = rseed;
+    output->groups_done = 0;
   }
 }
 
@@ -90,8 +201,8 @@ measure_k(global struct output_s *output,
   state_t self_s = input->state[i];
   local state_t *local_buff = lc_skpd;
 
-  // Parallel sum in local buffer
-  local_buff[i_l] = self_s;
+  // Parallel sum in local buffer, halo rows of a slab left out
+  local_buff[i_l] = OWNED(i/SIZEY) ? self_s : 0;
   for(int delta = i_T/2; delta != 0; delta >>= 1)
   {
     barrier(CLK_LOCAL_MEM_FENCE);
@@ -104,3 +215,314 @@ measure_k(global struct output_s *output,
     atomic_add(&output->mag[out_i], local_buff[0]);
   }
 }
+
+// Ensemble kernels: replica r is input[r], with probabilities probs_b[r] and
+// seed seeds_b[r]. Every replica follows the same random stream as a single
+// system run with its seed.
+kernel void
+init_ens_k(global struct state_s *output,
+         constant struct init_arg_s *arg,
+         global const rand_st *seeds_b)
+{
+  size_t i = get_global_id(0),
+         j = get_global_id(1),
+         r = get_global_id(2);
+
+  size_t ij = IND(i,j);
+  rand_st rseed = seeds_b[r];
+  int rand_sample = philox_rand4(rseed, ij, 0, 1).v[0];
+
+  output[r].state[ij] = (rand_sample>0)?-1:1;
+
+  if(ij==0)
+  {
+    output[r].counter = 0;
+    output[r].rseed = rseed;
+    output[r].groups_done = 0;
+  }
+}
+
+kernel void
+update_ens_k(global struct state_s *output,
+           global struct state_s *input,
+           local void *lc_skpd,
+           constant struct main_arg_s *arg,
+           global const uint_t *probs_b)
+{
+  size_t i = get_global_id(0),
+         j = get_global_id(1),
+         r = get_global_id(2);
+  size_t ij = IND(i,j);
+  global struct state_s *in = input + r;
+  uint iter = in->counter;
+  rand_st rseed = in->rseed;
+
+  state_t self_s = in->state[ij];
+  uint par = ((i+j+(iter%2))%2); // checkboard pattern (0 or 1)
+
+  if(par)
+  {
+    state_t neig1_s = in->state[RIND(i-1,j)];
+    state_t neig2_s = in->state[RIND(i,j-1)];
+    state_t neig3_s = in->state[RIND(i+1,j)];
+    state_t neig4_s = in->state[RIND(i,j+1)];
+    state_t s_sum = self_s*(neig1_s+neig2_s+neig3_s+neig4_s);
+
+    uint rand_sample = philox_rand4(rseed, ij, iter, 0).v[0];
+    char flip = rand_sample < probs_b[r*PROB_L + (size_t)(PROB_Z + s_sum/2)];
+    self_s = (flip)?-self_s:self_s;
+  }
+
+  output[r].state[ij] = self_s;
+  if(ij==0)
+  {
+    output[r].counter = iter+1;
+    output[r].rseed = rseed;
+    output[r].groups_done = 0;
+  }
+}
+
+// Magnetization only, the lattices stay on the device
+kernel void
+measure_ens_k(global struct ens_output_s *output,
+            global struct state_s *input,
+            local void* lc_skpd,
+            constant struct meas_arg_s *arg)
+{
+  size_t i = get_global_id(0),
+         r = get_global_id(1),
+         i_l = get_local_id(0),
+         i_T = get_local_size(0);
+  int iter = input[r].counter;
+  size_t out_i = (iter+arg->ioffset)/arg->idiv;
+  local state_t *local_buff = lc_skpd;
+
+  local_buff[i_l] = input[r].state[i];
+  for(int delta = i_T/2; delta != 0; delta >>= 1)
+  {
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if(i_l<delta) local_buff[i_l] += local_buff[i_l + delta];
+  }
+
+  if(i_l == 0)
+  {
+    atomic_add(&output[r].mag[out_i], local_buff[0]);
+  }
+}
+
+// Replica exchange measurement: magnetization and energy of every replica,
+// each site counting its bonds to the next row and column
+kernel void
+measure_pt_k(global struct pt_output_s *output,
+           global struct state_s *input,
+           local void* lc_skpd,
+           constant struct meas_arg_s *arg)
+{
+  size_t i = get_global_id(0),
+         r = get_global_id(1),
+         i_l = get_local_id(0),
+         i_T = get_local_size(0);
+  size_t x = i/SIZEY, y = i%SIZEY;
+  global state_t *lattice = input[r].state;
+  state_t self_s = lattice[i];
+  local state_t *mag_buff = lc_skpd, *energy_buff = mag_buff + i_T;
+
+  mag_buff[i_l] = self_s;
+  energy_buff[i_l] = -self_s*(lattice[RIND(x+1,y)] + lattice[RIND(x,y+1)]);
+  for(int delta = i_T/2; delta != 0; delta >>= 1)
+  {
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if(i_l<delta)
+    {
+      mag_buff[i_l] += mag_buff[i_l + delta];
+      energy_buff[i_l] += energy_buff[i_l + delta];
+    }
+  }
+
+  if(i_l == 0)
+  {
+    atomic_add(&output[r].mag, mag_buff[0]);
+    atomic_add(&output[r].energy, energy_buff[0]);
+  }
+}
+
+inline void
+kahan_add(global float_t *sum, global float_t *comp, float_t x)
+{
+  float_t y = x - *comp;
+  float_t t = *sum + y;
+  *comp = (t - *sum) - y;
+  *sum = t;
+}
+
+// Scalar observables in two levels: every work-group leaves its magnetization
+// and energy sums in partial_b, and the last one to finish reduces those and
+// adds this measurement's per site values to the running sums.
+kernel void
+measure_obs_k(global struct obs_output_s *output,
+            global struct state_s *input,
+            local void* lc_skpd,
+            constant struct meas_arg_s *arg,
+            global int_t *partial_b)
+{
+  size_t i = get_global_id(0),
+         i_l = get_local_id(0),
+         i_T = get_local_size(0),
+         group = get_group_id(0),
+         groups = get_num_groups(0);
+  size_t x = i/SIZEY, y = i%SIZEY;
+  state_t self_s = input->state[i];
+  local int_t *mag_buff = lc_skpd, *energy_buff = mag_buff + i_T;
+  local int last;
+
+  mag_buff[i_l] = self_s;
+  energy_buff[i_l] = -self_s*(input->state[RIND(x+1,y)] + input->state[RIND(x,y+1)]);
+  for(int delta = i_T/2; delta != 0; delta >>= 1)
+  {
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if(i_l<delta)
+    {
+      mag_buff[i_l] += mag_buff[i_l + delta];
+      energy_buff[i_l] += energy_buff[i_l + delta];
+    }
+  }
+
+  if(i_l == 0)
+  {
+    partial_b[2*group] = mag_buff[0];
+    partial_b[2*group+1] = energy_buff[0];
+    mem_fence(CLK_GLOBAL_MEM_FENCE);
+    last = atomic_inc(&output->groups_done)==groups-1;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if(!last) return;
+
+  // Final pass over the partial sums
+  volatile global int_t *partial = partial_b;
+  int_t mag = 0, energy = 0;
+  for(size_t g = i_l; g < groups; g += i_T)
+  {
+    mag += partial[2*g];
+    energy += partial[2*g+1];
+  }
+  mag_buff[i_l] = mag;
+  energy_buff[i_l] = energy;
+  for(int delta = i_T/2; delta != 0; delta >>= 1)
+  {
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if(i_l<delta)
+    {
+      mag_buff[i_l] += mag_buff[i_l + delta];
+      energy_buff[i_l] += energy_buff[i_l + delta];
+    }
+  }
+
+  if(i_l == 0)
+  {
+    float_t m = (float_t)mag_buff[0]/VECLEN, e = (float_t)energy_buff[0]/VECLEN;
+    float_t obs[OBS_N] = {m, fabs(m), m*m, m*m*m*m, e, e*e};
+
+    for(int o = 0; o < OBS_N; o++) kahan_add(&output->sum[o], &output->comp[o], obs[o]);
+    output->n++;
+    output->groups_done = 0;
+  }
+}
+
+// Swendsen-Wang cluster update, three nodes of a kernel graph (see isingsw.c).
+// sw_bond_k activates the bonds between equal neighbours with probability
+// sw_p_b[0]/2^32 and makes every site its own label, sw_merge_k joins bonded
+// sites with a lock-free union-find (atomic_min on the roots), and sw_flip_k
+// flips each cluster with probability 1/2. The flip is drawn from the random
+// stream of the cluster root, so all of its sites agree without an extra pass.
+inline uint
+sw_find(volatile global uint *label, uint x)
+{
+  uint next;
+  while((next = label[x])!=x) x = next;
+  return x;
+}
+
+inline void
+sw_merge(volatile global uint *label, uint a, uint b)
+{
+  for(;;)
+  {
+    a = sw_find(label, a);
+    b = sw_find(label, b);
+    if(a==b) return;
+    if(a>b) {uint t = a; a = b; b = t;}
+
+    uint old = atomic_min(&label[b], a);
+    if(old==b) return; // b was still a root, now under a
+    b = old; // b got linked meanwhile, retry from its new parent
+  }
+}
+
+kernel void
+sw_bond_k(global struct state_s *input,
+          global uchar *bond_b,
+          global uint *label_b,
+          global const uint_t *sw_p_b)
+{
+  size_t i = get_global_id(0),
+         j = get_global_id(1);
+  size_t ij = IND(i,j);
+  philox4x32_t rand = philox_rand4(input->rseed, ij, input->counter, 2);
+  state_t self_s = input->state[ij];
+  uchar bond = 0;
+
+  if((self_s==input->state[RIND(i,j+1)])&&(rand.v[0] < sw_p_b[0])) bond |= 1;
+  if((self_s==input->state[RIND(i+1,j)])&&(rand.v[1] < sw_p_b[0])) bond |= 2;
+
+  bond_b[ij] = bond;
+  label_b[ij] = ij;
+}
+
+kernel void
+sw_merge_k(global const uchar *bond_b,
+           global uint *label_b)
+{
+  size_t i = get_global_id(0),
+         j = get_global_id(1);
+  size_t ij = IND(i,j);
+  uchar bond = bond_b[ij];
+
+  if(bond&1) sw_merge(label_b, ij, RIND(i,j+1));
+  if(bond&2) sw_merge(label_b, ij, RIND(i+1,j));
+}
+
+kernel void
+sw_flip_k(global struct state_s *output,
+          global struct state_s *input,
+          global uint *label_b)
+{
+  size_t i = get_global_id(0),
+         j = get_global_id(1);
+  size_t ij = IND(i,j);
+  uint iter = input->counter;
+  rand_st rseed = input->rseed;
+
+  uint root = sw_find(label_b, ij);
+  state_t self_s = input->state[ij];
+  uint rand_sample = philox_rand4(rseed, root, iter, 3).v[0];
+
+  output->state[ij] = (rand_sample&1)?-self_s:self_s;
+  if(ij==0)
+  {
+    output->counter = iter+1;
+    output->rseed = rseed;
+    output->groups_done = 0;
+  }
+}
+
+// Streaming measurement: copies the lattice into slot frame of the ring
+kernel void
+snapshot_k(global state_t *ring,
+         global struct state_s *input,
+         local void* lc_skpd,
+         constant struct meas_arg_s *arg,
+         uint frame)
+{
+  size_t i = get_global_id(0);
+  ring[frame*VECLEN + i] = input->state[i];
+}
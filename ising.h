@@ -16,39 +16,114 @@ GNU General Public License for more details.
 #ifndef ISING_DEFS_HEADER
 #define ISING_DEFS_HEADER
 
-// Definitions & constants:
+// Definitions & constants (SIZEX/SIZEY can be overridden at load time, see cls_define;
+// BUFFLEN/MEASDIV only together with the host, see ising_define_out):
+#ifndef SIZEX
 #define SIZEX 64
+#endif
+#ifndef SIZEY
 #define SIZEY 64
+#endif
+#ifndef BUFFLEN
 #define BUFFLEN (1024)
+#endif
 #define VECLEN (SIZEX*SIZEY)
 #define NEIGH_N 4
 #define PROB_L (NEIGH_N+1)
 #define PROB_Z (NEIGH_N/2)
 #define PROB_MAX 1.0
+#ifndef MEASDIV
 #define MEASDIV 512
+#endif
 #define REPEAT_SIM 256
 
 #define GLOBAL_1D_LENGTH (VECLEN)
 #define GLOBAL_1D_RANGE {VECLEN,0,0}
 #define GLOBAL_2D_RANGE {SIZEX,SIZEY,0}
 
+#ifndef LOCAL_2D_WIDTH
 #define LOCAL_2D_WIDTH 16
+#endif
 #define LOCAL_1D_LENGTH (LOCAL_2D_WIDTH*LOCAL_2D_WIDTH)
 #define LOCAL_1D_RANGE {LOCAL_1D_LENGTH,0,0}
 #define LOCAL_2D_RANGE {LOCAL_2D_WIDTH,LOCAL_2D_WIDTH,0}
 
-#define ISING_DIMS_1D ((dims_i){.dim=1,.global=GLOBAL_1D_RANGE,.local=LOCAL_1D_RANGE})
-#define ISING_DIMS_2D ((dims_i){.dim=2,.global=GLOBAL_2D_RANGE,.local=LOCAL_2D_RANGE})
+// Tiled update (update_tiled_k): half-sweeps per launch and tile width with halo
+#define TBLOCK 4
+#define TILE_W (LOCAL_2D_WIDTH+2*TBLOCK)
+#define TILE_LOCAL_S (TILE_W*TILE_W*sizeof(state_t))
+
+#define ISING_DIMS_1D_N(vec) ((dims_i){.dim=1,.global={(vec),0,0},.local=LOCAL_1D_RANGE})
+#define ISING_DIMS_2D_N(sx,sy) ((dims_i){.dim=2,.global={(sx),(sy),0},.local=LOCAL_2D_RANGE})
+#define ISING_DIMS_ENS_N(sx,sy,r) ((dims_i){.dim=3,.global={(sx),(sy),(r)},.local={LOCAL_2D_WIDTH,LOCAL_2D_WIDTH,1}})
+#define ISING_DIMS_ENS_MEAS_N(vec,r) ((dims_i){.dim=2,.global={(vec),(r),0},.local={LOCAL_1D_LENGTH,1,0}})
+#define ISING_PARTIAL_S(vec) (2*sizeof(int_t)*((vec)/LOCAL_1D_LENGTH)) // partial_b of measure_obs_k
+#define ISING_DIMS_1D ISING_DIMS_1D_N(VECLEN)
+#define ISING_DIMS_2D ISING_DIMS_2D_N(SIZEX,SIZEY)
 
 #define OVERSAMPLE 1
 
+// Snapshot stream (isingview): device ring of lattices, drained to disk by chunks
+#define SNAP_RING 64
+#define SNAP_CHUNK 16
+#define SNAP_FILE "./build/isingview.snap"
+
+// Slab of a multi-device lattice (isingmulti): SIZEX counts the SLAB_HALO rows
+// on either side, SLAB_X0 is the global row of the first owned row and
+// SLAB_GSIZEX the global lattice height. The defaults give the whole lattice.
+#ifndef SLAB_HALO
+#define SLAB_HALO 0
+#endif
+#ifndef SLAB_X0
+#define SLAB_X0 0
+#endif
+#ifndef SLAB_GSIZEX
+#define SLAB_GSIZEX SIZEX
+#endif
+#define MULTI_HALO LOCAL_2D_WIDTH // keeps slab ranges divisible by the local range
+
+// Ensemble (ising -e): replicas side by side in one state buffer, dimension 2
+// of the update range (1 of the measurement range) picks the replica. Each one
+// has its row in the "probs_b" and "seeds_b" named buffers. Batches are capped
+// at ENS_BYTES of state so large lattices still fit in device memory.
+#define TEMP_N 20
+#define TEMP_0 2.0
+#define TEMP_D 0.05
+#ifndef ENS_BYTES
+#define ENS_BYTES (256<<20)
+#endif
+
+// Parallel tempering (ising -t): PT_CHAINS independent chains of TEMP_N
+// replicas in one ensemble. Every PT_EVERY half-sweeps neighbouring
+// temperatures of a chain propose a swap; the first PT_THERM exchanges are
+// not measured.
+#define PT_CHAINS 16
+#define PT_EVERY 8 // even, the checkerboard phase is the same for every replica
+#define PT_THERM 64
+#define PT_MEAS 1024
+
+// Sweep job pool (ising -j): systems per device of the platform
+#define POOL_QUEUES 4
+
+// Warm-started sweep (ising -w): thermalization from the previous temperature's
+// lattice, and the checkpoint written after every temperature
+#define WARM_THERM (BUFFLEN/16)
+#define WARM_CKPT "./build/ising_%dx%d.ckpt"
+
+// Scalar observables (ising -s): per site m, |m|, m^2, m^4, e and e^2 of every
+// measurement, summed on the device
+#define OBS_N 6
+
 // Macros:
 #define MAX(x,y) ((x)>(y)?(x):(y))
 #define MIN(x,y) ((x)>(y)?(y):(x))
-#define IND(x,y) ( (x)*SIZEX + (y) ) // 2D xy -> 1D vector
-#define RIND(x,y) ( ((x)%SIZEX)*SIZEX + ((y)%SIZEY) ) // rectangular
-#define TIND(x,y) ( ((x)*SIZEX + (y))%VECLEN ) // torus
-#define GETI(c,x,y) ( *(y) = ((c)-(*(x)=(c)/SIZEX)) ); // 1D vector -> 2D xy
+#define IND(x,y) ( (x)*SIZEY + (y) ) // 2D xy -> 1D vector
+#define RIND(x,y) ( ((x)%SIZEX)*SIZEY + ((y)%SIZEY) ) // rectangular
+#define TIND(x,y) ( ((x)*SIZEY + (y))%VECLEN ) // torus
+#define GETI(c,x,y) ( *(y) = ((c)-(*(x)=(c)/SIZEY)*SIZEY) ); // 1D vector -> 2D xy
+#define GROW(x) ( ((x) + SLAB_GSIZEX + SLAB_X0 - SLAB_HALO)%SLAB_GSIZEX ) // slab -> global row
+#define GIND(x,y) ( GROW(x)*SIZEY + (y) ) // global site index, keys the random stream
+#define OWNED(x) ( ((x)>=SLAB_HALO)&&((x)<SIZEX-SLAB_HALO) ) // not a halo row
 
 // Typedefs:
 #ifdef __OPENCL_VERSION__
@@ -74,23 +149,37 @@ typedef struct main_arg_s* main_arg_p;
 typedef struct meas_arg_s* meas_arg_p;
 
 // Structs:
-struct output_s
+struct output_s // mag first, so its offset does not depend on the lattice size
 {
+  out_t mag[BUFFLEN/MEASDIV];
   state_t states[BUFFLEN/MEASDIV][VECLEN];
+} __attribute__((__packed__));
+
+struct state_s
+{
+  state_t state[VECLEN];
+  int_t counter;
+  rand_st rseed; // Philox key, see philox.h
+  uint_t groups_done; // finished work-groups of an in-place launch
+} __attribute__((__packed__));
+
+struct ens_output_s // one per replica of an ensemble
+{
   out_t mag[BUFFLEN/MEASDIV];
 } __attribute__((__packed__));
 
-struct output2_s
+struct pt_output_s // one per replica, energy is -sum(s_i s_j) over the bonds
 {
-  state_t states[BUFFLEN][VECLEN];
-  out_t mag[BUFFLEN];
+  out_t mag;
+  int_t energy;
 } __attribute__((__packed__));
 
-struct state_s
+struct obs_output_s // running sums over every measurement since the output was zeroed
 {
-  state_t state[VECLEN];
-  rand_st rseeds[VECLEN];
-  int_t counter;
+  float_t sum[OBS_N];
+  float_t comp[OBS_N]; // Kahan compensation of sum
+  int_t n; // measurements
+  uint_t groups_done; // finished work-groups of the current measurement
 } __attribute__((__packed__));
 
 struct init_arg_s
@@ -109,4 +198,25 @@ struct meas_arg_s
   int_t ioffset;
 } __attribute__((__packed__));
 
+#ifndef __OPENCL_VERSION__
+// Host side buffer sizes for a lattice of vec sites, when SIZEX/SIZEY are
+// chosen at load time with cls_define instead of the defaults above. The
+// output size (and output_s, ens_output_s) uses the host's BUFFLEN/MEASDIV,
+// so a kernel built with other values would write past it.
+#define ISING_STATE_S(vec) (sizeof(state_t)*(vec) + sizeof(int_t) + sizeof(rand_st) + sizeof(uint_t))
+#define ISING_OUTPUT_S(vec) ((sizeof(out_t) + sizeof(state_t)*(vec))*(BUFFLEN/MEASDIV))
+
+// To change BUFFLEN/MEASDIV define them before including this header and hand
+// the same values to the kernels with this, instead of cls_define
+static inline void
+ising_define_out(oclSys sys)
+{
+  cls_define(sys, "BUFFLEN", BUFFLEN);
+  cls_define(sys, "MEASDIV", MEASDIV);
+}
+
+_Static_assert(ISING_STATE_S(VECLEN)==sizeof(struct state_s), "state_s layout");
+_Static_assert(ISING_OUTPUT_S(VECLEN)==sizeof(struct output_s), "output_s layout");
+#endif
+
 #endif
@@ -0,0 +1,120 @@
+/*
+Copyright (C) 2022 Franco Sauvisky
+isingcpu.c is part of oclsim
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "cpuising.h" // the engine alone: neither oclsim.o nor libOpenCL is linked
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <math.h>
+
+int64_t millis()
+{
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return ((int64_t) now.tv_sec) * 1000 + ((int64_t) now.tv_nsec) / 1000000;
+}
+
+void
+set_probs(struct main_arg_s *main_arg, double temp)
+{
+  for(int i = 0; i < PROB_L; i++)
+  {
+    main_arg->probs[i] = (cl_ulong)CL_UINT_MAX * PROB_MAX * MIN(1.0, exp(-4.0*(i-PROB_Z)/temp));
+  }
+}
+
+// One replica as ising.c runs it: BUFFLEN/4 updates, then MEASDIV updates and
+// a measurement, BUFFLEN/MEASDIV times
+void
+run_cpu(cpuSys sys, struct init_arg_s *init_arg, struct main_arg_s *main_arg,
+        struct meas_arg_s *meas_arg, void *out)
+{
+  cpu_set_init_arg(sys, init_arg);
+  cpu_set_main_arg(sys, main_arg);
+  cpu_set_meas_arg(sys, meas_arg);
+  cpu_run_init(sys);
+  cpu_run_update_n(sys, BUFFLEN/4);
+  for(int m = 0; m < BUFFLEN/MEASDIV; m++)
+  {
+    cpu_run_update_n(sys, MEASDIV);
+    cpu_run_meas(sys);
+  }
+  cpu_get_meas(sys, out);
+}
+
+// Temperature sweep of ising.c on the CPU engine, same output
+void
+sweep(int size)
+{
+  size_t veclen = (size_t)size*size;
+  struct init_arg_s init_arg;
+  struct main_arg_s main_arg;
+  struct meas_arg_s meas_arg = {.idiv = MEASDIV, .ioffset = -BUFFLEN/4-MEASDIV};
+  out_t *out = malloc(ISING_OUTPUT_S(veclen)); // output_s starts with mag
+  cpuSys sys = cpu_new_sys(size, size, 0);
+  int64_t start = millis();
+
+  srand((uint)time(NULL));
+  for(int t = 0; t < TEMP_N; t++)
+  {
+    double temp = TEMP_0 + TEMP_D*t, mag = 0.0, mag2 = 0.0;
+    set_probs(&main_arg, temp);
+
+    for(int k = 0; k < REPEAT_SIM; k++)
+    {
+      init_arg.rseed = rand();
+      run_cpu(sys, &init_arg, &main_arg, &meas_arg, out);
+      for(int i = 0; i < BUFFLEN/MEASDIV; i++)
+      {
+        mag += (double)out[i];
+        mag2 += pow(out[i],2);
+      }
+    }
+    printf("%f %f %f\n", temp, mag/(BUFFLEN/MEASDIV*REPEAT_SIM), sqrt(mag2/(BUFFLEN/MEASDIV*REPEAT_SIM)));
+  }
+
+  double flips = (double)TEMP_N*REPEAT_SIM*(BUFFLEN/4 + BUFFLEN)*veclen/2;
+  fprintf(stderr, "%s engine: %e flips/s\n", cpu_engine(sys), flips/(MAX(millis() - start, 1)/1000.0));
+  cpu_release_sys(sys);
+}
+
+// isingcpu [sizes]: ising.c's sweep on the CPU engine (SIZEX by default). The
+// cross-check against the OpenCL kernels is isingcpucheck.
+void
+main(int argc, char **argv)
+{
+  for(int a = 1; a < argc; a++)
+  {
+    int size = atoi(argv[a]);
+    if((size<LOCAL_2D_WIDTH)||(size&(size-1))) // same sizes as the OpenCL kernels
+    {
+      fprintf(stderr, "Lattice size %s must be a power of two, at least %d\n",
+        argv[a], LOCAL_2D_WIDTH);
+      exit(1);
+    }
+  }
+
+  if(argc<2)
+  {
+    sweep(SIZEX);
+    return;
+  }
+  for(int a = 1; a < argc; a++)
+  {
+    printf("# size %d\n", atoi(argv[a]));
+    sweep(atoi(argv[a]));
+  }
+}
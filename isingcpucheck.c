@@ -0,0 +1,147 @@
+/*
+Copyright (C) 2022 Franco Sauvisky
+isingcpucheck.c is part of oclsim
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "oclsim.h"
+#include "ising.h"
+#include "cpuising.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#define CHECK_TEMPS 3
+#define CHECK_SYSTEMS 3
+
+int64_t millis()
+{
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return ((int64_t) now.tv_sec) * 1000 + ((int64_t) now.tv_nsec) / 1000000;
+}
+
+void
+set_probs(struct main_arg_s *main_arg, double temp)
+{
+  for(int i = 0; i < PROB_L; i++)
+  {
+    main_arg->probs[i] = (cl_ulong)CL_UINT_MAX * PROB_MAX * MIN(1.0, exp(-4.0*(i-PROB_Z)/temp));
+  }
+}
+
+// Platform 0 device 0, the CPU engine, and the CPU engine's scalar path, all
+// set up the same way through the oclsim calls
+oclSys
+check_sys(int s, int size)
+{
+  oclSys sys = (s==0) ? cls_new_sys(0,0) : cls_new_sys_native(&cpu_native);
+
+  cls_define(sys, "SIZEX", size);
+  cls_define(sys, "SIZEY", size);
+  if(s==2) cls_define(sys, "CPU_SIMD", 0);
+  cls_load_sys_from_file(sys, "./ising.cl", ISING_STATE_S((size_t)size*size));
+  return sys;
+}
+
+// One replica as ising.c runs it, output read into out
+void
+run_sys(oclSys sys, oclSched sched, int size, struct init_arg_s *init_arg,
+        struct main_arg_s *main_arg, struct meas_arg_s *meas_arg, void *out)
+{
+  size_t veclen = (size_t)size*size;
+
+  cls_set_init_arg(sys, init_arg, sizeof(*init_arg), ISING_DIMS_2D_N(size,size));
+  cls_set_main_arg(sys, main_arg, sizeof(*main_arg), 1, ISING_DIMS_2D_N(size,size));
+  cls_set_meas_arg(sys, meas_arg, sizeof(*meas_arg), sizeof(state_t)*LOCAL_1D_LENGTH,
+    ISING_OUTPUT_S(veclen), ISING_DIMS_1D_N(veclen));
+  cls_run_init(sys);
+  cls_run_update_n(sys, BUFFLEN/4);
+  cls_run_sched(sched, BUFFLEN/MEASDIV);
+  cls_get_meas(sys, out);
+}
+
+// The same replicas on update_k/measure_k and on both CPU paths. Outputs
+// (magnetizations and lattices) must match byte for byte, since all share the
+// Philox streams.
+int
+check(int size)
+{
+  size_t out_s = ISING_OUTPUT_S((size_t)size*size);
+  double temps[CHECK_TEMPS] = {2.0, 2.269185, 2.6};
+  char *names[CHECK_SYSTEMS] = {"opencl", "cpu", "cpu scalar"};
+  struct init_arg_s init_arg = {.rseed = (cl_uint)time(NULL)};
+  struct main_arg_s main_arg;
+  struct meas_arg_s meas_arg = {.idiv = MEASDIV, .ioffset = -BUFFLEN/4-MEASDIV};
+  oclSys systems[CHECK_SYSTEMS];
+  oclSched scheds[CHECK_SYSTEMS];
+  char *ref = malloc(out_s), *out = malloc(out_s);
+  int ok = 1;
+
+  for(int s = 0; s < CHECK_SYSTEMS; s++)
+  {
+    systems[s] = check_sys(s, size);
+    scheds[s] = cls_new_sched(systems[s]);
+    cls_sched_add(scheds[s], CLS_STEP_UPDATE, MEASDIV);
+    cls_sched_add(scheds[s], CLS_STEP_MEAS, 1);
+  }
+
+  for(int t = 0; t < CHECK_TEMPS; t++)
+  {
+    set_probs(&main_arg, temps[t]);
+    printf("T=%f", temps[t]);
+    for(int s = 0; s < CHECK_SYSTEMS; s++)
+    {
+      int64_t start = millis();
+      run_sys(systems[s], scheds[s], size, &init_arg, &main_arg, &meas_arg, s ? out : ref);
+      int64_t end = millis();
+
+      if(s==0)
+      {
+        printf(" mag %d: %s %ld ms", ((out_t*)ref)[BUFFLEN/MEASDIV-1], names[s], (long)(end-start));
+        continue;
+      }
+      int match = !memcmp(ref, out, out_s);
+      printf(", %s %s (%ld ms)", names[s], match ? "matches" : "DIFFERS", (long)(end-start));
+      ok &= match;
+    }
+    printf("\n");
+    init_arg.rseed++;
+  }
+
+  for(int s = 0; s < CHECK_SYSTEMS; s++)
+  {
+    cls_release_sched(scheds[s]);
+    cls_release_sys(systems[s]);
+  }
+  free(ref);
+  free(out);
+  return ok;
+}
+
+// isingcpucheck [size]: the CPU engine against the OpenCL kernels (SIZEX by
+// default), exit status 1 on mismatch
+void
+main(int argc, char **argv)
+{
+  int size = (argc>1) ? atoi(argv[1]) : SIZEX;
+
+  if((size<LOCAL_2D_WIDTH)||(size&(size-1))) // same sizes as the OpenCL kernels
+  {
+    fprintf(stderr, "Lattice size %d must be a power of two, at least %d\n", size, LOCAL_2D_WIDTH);
+    exit(1);
+  }
+  exit(!check(size));
+}
@@ -0,0 +1,242 @@
+/*
+Copyright (C) 2022 Franco Sauvisky
+isingmsc.c is part of oclsim
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "oclsim.h"
+#include "isingmsc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#define CHECK_TEMPS 3
+#define CHECK_LAUNCHES 4 // MSC launches per temperature, and MSC_BITS times as many ising.cl runs
+#define CHECK_SIGMAS 4.0
+
+int64_t millis()
+{
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return ((int64_t) now.tv_sec) * 1000 + ((int64_t) now.tv_nsec) / 1000000;
+}
+
+void
+set_probs(struct main_arg_s *main_arg, double temp)
+{
+  for(int i = 0; i < PROB_L; i++)
+  {
+    main_arg->probs[i] = (cl_ulong)CL_UINT_MAX * PROB_MAX * MIN(1.0, exp(-4.0*(i-PROB_Z)/temp));
+  }
+}
+
+// Temperature sweep of ising.c, MSC_BITS replicas per launch
+void
+sweep(void)
+{
+  oclSys ising = cls_new_sys(2,0);
+  cls_load_sys_from_file(ising, "./isingmsc.cl", sizeof(struct msc_state_s));
+
+  struct init_arg_s init_arg;
+  struct main_arg_s main_arg;
+  struct meas_arg_s meas_arg = {.idiv = MEASDIV, .ioffset = -BUFFLEN/4-MEASDIV};
+
+  uint rseed = (uint)time(NULL);
+  srand(rseed);
+
+  struct msc_output_s *out = malloc(sizeof(struct msc_output_s));
+
+  // MEASDIV updates then one measurement, BUFFLEN/MEASDIV times
+  oclSched meas_sched = cls_new_sched(ising);
+  cls_sched_add(meas_sched, CLS_STEP_UPDATE, MEASDIV);
+  cls_sched_add(meas_sched, CLS_STEP_MEAS, 1);
+
+  int64_t start = millis();
+  size_t sweeps = 0;
+
+  for(float temp = 2.0; temp < 3.0; temp+=0.05)
+  {
+    double mag = 0.0, mag2 = 0.0;
+
+    set_probs(&main_arg, temp);
+
+    // Every launch advances MSC_BITS independent replicas
+    for(int k = 0; k < REPEAT_SIM/MSC_BITS; k++)
+    {
+      cl_uint new_seed = rand();
+      init_arg.rseed = new_seed;
+
+      cls_set_init_arg(ising, &init_arg, sizeof(init_arg), ISING_DIMS_2D);
+      cls_set_main_arg(ising, &main_arg, sizeof(main_arg), 1, ISING_DIMS_2D);
+      cls_set_meas_arg(ising, &meas_arg, sizeof(meas_arg), 1, sizeof(struct msc_output_s), MSC_MEAS_DIMS);
+
+      cls_run_init(ising);
+      cls_run_update_n(ising, BUFFLEN/4);
+      cls_run_sched(meas_sched, BUFFLEN/MEASDIV);
+
+      cls_get_meas(ising, out);
+      sweeps += BUFFLEN/4 + BUFFLEN;
+
+      for(int i = 0; i < BUFFLEN/MEASDIV; i++)
+      {
+        for(int b = 0; b < MSC_BITS; b++)
+        {
+          mag += (double)out->mag[i][b];
+          mag2 += pow(out->mag[i][b],2);
+        }
+      }
+    }
+    printf("%f %f %f\n", temp, mag/(BUFFLEN/MEASDIV*REPEAT_SIM), sqrt(mag2/(BUFFLEN/MEASDIV*REPEAT_SIM)));
+  }
+
+  int64_t end = millis();
+  fprintf(stderr, "%e site-updates/s\n",
+    (double)sweeps*VECLEN*MSC_BITS/(MAX(end - start, 1)/1000.0));
+
+  cls_release_sched(meas_sched);
+  cls_release_sys(ising);
+}
+
+// Per replica time averages of |m| and m^2 per site, summed over replicas
+struct check_acc
+{
+  double sum[2], sum2[2];
+  int n;
+};
+
+void
+check_add(struct check_acc *acc, double *mag, int n)
+{
+  double avg[2] = {0.0, 0.0};
+
+  for(int i = 0; i < n; i++)
+  {
+    avg[0] += fabs(mag[i])/VECLEN/n;
+    avg[1] += pow(mag[i]/VECLEN, 2)/n;
+  }
+  for(int o = 0; o < 2; o++)
+  {
+    acc->sum[o] += avg[o];
+    acc->sum2[o] += avg[o]*avg[o];
+  }
+  acc->n++;
+}
+
+// Mean over replicas and its standard error
+double
+check_mean(struct check_acc *acc, int o, double *err)
+{
+  double mean = acc->sum[o]/acc->n;
+  *err = sqrt(MAX(acc->sum2[o]/acc->n - mean*mean, 0.0)/(acc->n - 1));
+  return mean;
+}
+
+// Statistical cross-check: the same protocol (BUFFLEN/4 thermalizing
+// updates, then BUFFLEN/MEASDIV measurements) on MSC replicas and on as many
+// update_k/measure_k runs. Replicas are independent, so <|m|> and <m^2> per
+// site must agree within CHECK_SIGMAS standard errors.
+int
+check(void)
+{
+  double temps[CHECK_TEMPS] = {2.0, 2.269185, 2.6}, mag[BUFFLEN/MEASDIV];
+  struct init_arg_s init_arg;
+  struct main_arg_s main_arg;
+  struct meas_arg_s meas_arg = {.idiv = MEASDIV, .ioffset = -BUFFLEN/4-MEASDIV};
+  struct msc_output_s *msc_out = malloc(sizeof(struct msc_output_s));
+  out_t *ref_out = malloc(ISING_OUTPUT_S(VECLEN)); // output_s starts with mag
+  int ok = 1;
+
+  oclSys msc = cls_new_sys(2,0);
+  cls_load_sys_from_file(msc, "./isingmsc.cl", sizeof(struct msc_state_s));
+  oclSys ref = cls_new_sys(2,0);
+  cls_load_sys_from_file(ref, "./ising.cl", ISING_STATE_S(VECLEN));
+
+  oclSched scheds[2];
+  for(int e = 0; e < 2; e++)
+  {
+    scheds[e] = cls_new_sched(e ? ref : msc);
+    cls_sched_add(scheds[e], CLS_STEP_UPDATE, MEASDIV);
+    cls_sched_add(scheds[e], CLS_STEP_MEAS, 1);
+  }
+
+  srand((uint)time(NULL));
+  printf("# temp <|m|> msc ref sigmas, <m^2> msc ref sigmas\n");
+  for(int t = 0; t < CHECK_TEMPS; t++)
+  {
+    struct check_acc acc[2];
+    memset(acc, 0, sizeof(acc));
+    set_probs(&main_arg, temps[t]);
+
+    for(int k = 0; k < CHECK_LAUNCHES; k++)
+    {
+      init_arg.rseed = rand();
+      cls_set_init_arg(msc, &init_arg, sizeof(init_arg), ISING_DIMS_2D);
+      cls_set_main_arg(msc, &main_arg, sizeof(main_arg), 1, ISING_DIMS_2D);
+      cls_set_meas_arg(msc, &meas_arg, sizeof(meas_arg), 1, sizeof(struct msc_output_s), MSC_MEAS_DIMS);
+      cls_run_init(msc);
+      cls_run_update_n(msc, BUFFLEN/4);
+      cls_run_sched(scheds[0], BUFFLEN/MEASDIV);
+      cls_get_meas(msc, msc_out);
+
+      for(int b = 0; b < MSC_BITS; b++)
+      {
+        for(int i = 0; i < BUFFLEN/MEASDIV; i++) mag[i] = msc_out->mag[i][b];
+        check_add(&acc[0], mag, BUFFLEN/MEASDIV);
+      }
+    }
+
+    for(int k = 0; k < CHECK_LAUNCHES*MSC_BITS; k++)
+    {
+      init_arg.rseed = rand();
+      cls_set_init_arg(ref, &init_arg, sizeof(init_arg), ISING_DIMS_2D);
+      cls_set_main_arg(ref, &main_arg, sizeof(main_arg), 1, ISING_DIMS_2D);
+      cls_set_meas_arg(ref, &meas_arg, sizeof(meas_arg), sizeof(state_t)*LOCAL_1D_LENGTH,
+        ISING_OUTPUT_S(VECLEN), ISING_DIMS_1D_N(VECLEN));
+      cls_run_init(ref);
+      cls_run_update_n(ref, BUFFLEN/4);
+      cls_run_sched(scheds[1], BUFFLEN/MEASDIV);
+      cls_get_meas(ref, ref_out);
+
+      for(int i = 0; i < BUFFLEN/MEASDIV; i++) mag[i] = ref_out[i];
+      check_add(&acc[1], mag, BUFFLEN/MEASDIV);
+    }
+
+    printf("%f", temps[t]);
+    for(int o = 0; o < 2; o++)
+    {
+      double err[2], mean[2] = {check_mean(&acc[0], o, &err[0]), check_mean(&acc[1], o, &err[1])};
+      double sigmas = fabs(mean[0] - mean[1])/MAX(sqrt(err[0]*err[0] + err[1]*err[1]), 1e-12);
+      printf(" %f %f %.2f%s", mean[0], mean[1], sigmas, (sigmas<CHECK_SIGMAS) ? "" : " DIFFERS");
+      ok &= sigmas<CHECK_SIGMAS;
+    }
+    printf("\n");
+  }
+
+  for(int e = 0; e < 2; e++) cls_release_sched(scheds[e]);
+  cls_release_sys(msc);
+  cls_release_sys(ref);
+  free(msc_out);
+  free(ref_out);
+  return ok;
+}
+
+// isingmsc: ising.c's sweep on the multi-spin-coded engine
+// isingmsc -c: statistical check against ising.cl, exit status 1 on mismatch
+void
+main(int argc, char **argv)
+{
+  if((argc>1)&&!strcmp(argv[1], "-c")) exit(!check());
+  sweep();
+}
@@ -0,0 +1,131 @@
+#include "isingmsc.h"
+#include "philox.h"
+
+// Next random word with one random bit per replica, taken from Philox blocks
+// keyed by (rseed, site, counter). The updates use sub-streams 2 and up, since
+// sub-stream 1 of counter 0 is the block init_k draws the lattice from.
+inline msc_t
+msc_rand(philox4x32_t *blk, uint *used, uint *sub, rand_st rseed, size_t ij, uint iter)
+{
+  if(*used==4)
+  {
+    *blk = philox_rand4(rseed, ij, iter, 2 + (*sub)++);
+    *used = 0;
+  }
+#if MSC_BITS == 64
+  *used += 2;
+  return ((msc_t)blk->v[*used-2] << 32)|blk->v[*used-1];
+#else
+  return blk->v[(*used)++];
+#endif
+}
+
+kernel void
+init_k(global struct msc_state_s *output,
+       constant struct init_arg_s *arg)
+{
+  size_t i = get_global_id(0),
+         j = get_global_id(1);
+
+  size_t ij = IND(i,j);
+  philox4x32_t blk = philox_rand4(arg->rseed, ij, 0, 1);
+
+#if MSC_BITS == 64
+  output->state[ij] = ((msc_t)blk.v[0] << 32)|blk.v[1];
+#else
+  output->state[ij] = blk.v[0];
+#endif
+
+  if(ij==0)
+  {
+    output->counter = 0;
+    output->rseed = arg->rseed;
+  }
+}
+
+kernel void
+update_k(global struct msc_state_s *output,
+         global struct msc_state_s *input,
+         local void *lc_skpd,
+         constant struct main_arg_s *arg)
+{
+  size_t i = get_global_id(0),
+         j = get_global_id(1);
+  size_t ij = IND(i,j);
+  uint iter = input->counter;
+  rand_st rseed = input->rseed;
+  msc_t self_s = input->state[ij];
+
+  uint par = ((i+j+(iter%2))%2); // checkboard pattern (0 or 1)
+  if(par)
+  {
+    // Anti-aligned neighbours of every replica, summed bit-sliced into n2:n1:n0
+    msc_t a1 = self_s^input->state[RIND(i-1,j)];
+    msc_t a2 = self_s^input->state[RIND(i,j-1)];
+    msc_t a3 = self_s^input->state[RIND(i+1,j)];
+    msc_t a4 = self_s^input->state[RIND(i,j+1)];
+    msc_t s0 = a1^a2, c0 = a1&a2, s1 = a3^a4, c1 = a3&a4, t = s0&s1;
+    msc_t n0 = s0^s1, n1 = c0^c1^t, n2 = c0&c1;
+
+    // eq[k]: replicas whose probs index (aligned neighbours) is k
+    msc_t eq[PROB_L];
+    eq[0] = n2;
+    eq[1] = n0&n1;
+    eq[2] = ~n0&n1;
+    eq[3] = n0&~n1;
+    eq[4] = ~(n0|n1|n2);
+
+    // Bit-serial "random < probs[k]" for all replicas, MSB first, stops once
+    // every replica is decided
+    msc_t flip = 0, und = ~(msc_t)0;
+    philox4x32_t blk;
+    uint used = 4, sub = 0;
+    for(int b = 31; (b >= 0)&&und; b--)
+    {
+      msc_t r = msc_rand(&blk, &used, &sub, rseed, ij, iter);
+      und = 0;
+      for(int k = 0; k < PROB_L; k++)
+      {
+        if((arg->probs[k]>>b)&1)
+        {
+          flip |= eq[k]&~r;
+          eq[k] &= r;
+        }
+        else
+        {
+          eq[k] &= ~r;
+        }
+        und |= eq[k];
+      }
+    }
+    self_s ^= flip;
+  }
+
+  output->state[ij] = self_s;
+  if(ij==0)
+  {
+    output->counter = iter+1;
+    output->rseed = rseed;
+  }
+}
+
+kernel void
+measure_k(global struct msc_output_s *output,
+          global struct msc_state_s *input,
+          local void* lc_skpd,
+          constant struct meas_arg_s *arg)
+{
+  size_t b = get_global_id(0),
+         i = get_global_id(1);
+  int iter = input->counter;
+  size_t out_i = (iter+arg->ioffset)/arg->idiv;
+
+  // Replica b, row i: up spins count +1, down spins -1
+  int_t sum = 0;
+  for(size_t j = 0; j < SIZEY; j++)
+  {
+    sum += (int_t)((input->state[IND(i,j)]>>b)&1);
+  }
+
+  atomic_add(&output->mag[out_i][b], 2*sum - SIZEY);
+}
@@ -0,0 +1,54 @@
+/*
+Copyright (C) 2022 Franco Sauvisky
+isingmsc.h is part of oclsim
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef ISINGMSC_HEADER
+#define ISINGMSC_HEADER
+
+#include "ising.h"
+
+// Multi-spin coding: bit b of every word belongs to replica b (1 = up spin)
+#define MSC_BITS 32
+
+#define MSC_MEAS_DIMS ((dims_i){.dim=2,.global={MSC_BITS,SIZEX,0},.local={MSC_BITS,1,0}})
+
+// Typedefs:
+#ifdef __OPENCL_VERSION__
+#if MSC_BITS == 64
+typedef ulong msc_t;
+#else
+typedef uint msc_t;
+#endif
+#else
+#if MSC_BITS == 64
+typedef cl_ulong msc_t;
+#else
+typedef cl_uint msc_t;
+#endif
+#endif
+
+// Structs:
+struct msc_state_s
+{
+  msc_t state[VECLEN];
+  int_t counter;
+  rand_st rseed; // Philox key, see philox.h
+} __attribute__((__packed__));
+
+struct msc_output_s
+{
+  out_t mag[BUFFLEN/MEASDIV][MSC_BITS];
+} __attribute__((__packed__));
+
+#endif
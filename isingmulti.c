@@ -0,0 +1,173 @@
+/*
+Copyright (C) 2022 Franco Sauvisky
+isingmulti.c is part of oclsim
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "oclsim.h"
+#include "ising.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#define MULTI_SIZE 512
+#define MULTI_SWEEPS 1024 // half-sweeps
+#define MULTI_SEED 1234
+
+int64_t millis()
+{
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return ((int64_t) now.tv_sec) * 1000 + ((int64_t) now.tv_nsec) / 1000000;
+}
+
+void
+set_probs(struct main_arg_s *main_arg, float temp)
+{
+  for(int i = 0; i < PROB_L; i++)
+  {
+    main_arg->probs[i] = (cl_ulong)CL_UINT_MAX * PROB_MAX * MIN(1.0, exp(-4.0*(i-PROB_Z)/temp));
+  }
+}
+
+// Whole lattice on one device, output is ISING_OUTPUT_S(MULTI_SIZE^2) bytes
+double
+run_single(void *out)
+{
+  size_t veclen = (size_t)MULTI_SIZE*MULTI_SIZE;
+  struct init_arg_s init_arg = {.rseed = MULTI_SEED};
+  struct main_arg_s main_arg;
+  struct meas_arg_s meas_arg = {.idiv = CL_INT_MAX, .ioffset = 0};
+  set_probs(&main_arg, 2.27);
+
+  oclSys ising = cls_new_sys(0,0);
+  cls_define(ising, "SIZEX", MULTI_SIZE);
+  cls_define(ising, "SIZEY", MULTI_SIZE);
+  cls_load_sys_from_file(ising, "./ising.cl", ISING_STATE_S(veclen));
+  cls_set_init_arg(ising, &init_arg, sizeof(init_arg), ISING_DIMS_2D_N(MULTI_SIZE,MULTI_SIZE));
+  cls_set_main_arg(ising, &main_arg, sizeof(main_arg), 1, ISING_DIMS_2D_N(MULTI_SIZE,MULTI_SIZE));
+  cls_set_meas_arg(ising, &meas_arg, sizeof(meas_arg), sizeof(state_t)*LOCAL_1D_LENGTH,
+    ISING_OUTPUT_S(veclen), ISING_DIMS_1D_N(veclen));
+
+  cls_run_init(ising);
+  cls_finish(ising);
+  int64_t start = millis();
+  cls_run_update_n(ising, MULTI_SWEEPS);
+  cls_finish(ising);
+  int64_t end = millis();
+  cls_run_meas(ising);
+  cls_get_meas(ising, out);
+  cls_release_sys(ising);
+
+  return (double)MULTI_SWEEPS*veclen/2/(MAX(end - start, 1)/1000.0);
+}
+
+// Same lattice split in row slabs over the parts; checks the owned rows and the
+// summed magnetization of every part against the single device result
+double
+run_multi(oclMulti multi, void *ref, int *lattice_ok, int *mag_ok)
+{
+  int parts = cls_multi_parts(multi);
+  size_t rows[parts], slab_rows = MULTI_SIZE/parts;
+  size_t slab_vec = (slab_rows + 2*MULTI_HALO)*MULTI_SIZE;
+  struct init_arg_s init_arg = {.rseed = MULTI_SEED};
+  struct main_arg_s main_arg;
+  struct meas_arg_s meas_arg = {.idiv = CL_INT_MAX, .ioffset = 0};
+  set_probs(&main_arg, 2.27);
+
+  if((MULTI_SIZE%parts)||(slab_rows%LOCAL_2D_WIDTH))
+  {
+    fprintf(stderr, "%d rows can't be split in %d slabs of whole work-groups\n", MULTI_SIZE, parts);
+    exit(1);
+  }
+
+  for(int p = 0; p < parts; p++)
+  {
+    oclSys part = cls_multi_part(multi, p);
+    rows[p] = slab_rows;
+    cls_define(part, "SIZEX", slab_rows + 2*MULTI_HALO);
+    cls_define(part, "SIZEY", MULTI_SIZE);
+    cls_define(part, "SLAB_HALO", MULTI_HALO);
+    cls_define(part, "SLAB_X0", p*slab_rows);
+    cls_define(part, "SLAB_GSIZEX", MULTI_SIZE);
+    cls_load_sys_from_file(part, "./ising.cl", ISING_STATE_S(slab_vec));
+    cls_set_init_arg(part, &init_arg, sizeof(init_arg),
+      ISING_DIMS_2D_N(slab_rows + 2*MULTI_HALO, MULTI_SIZE));
+    cls_set_main_arg(part, &main_arg, sizeof(main_arg), 1, ISING_DIMS_2D_N(slab_rows, MULTI_SIZE));
+    cls_set_meas_arg(part, &meas_arg, sizeof(meas_arg), sizeof(state_t)*LOCAL_1D_LENGTH,
+      ISING_OUTPUT_S(slab_vec), ISING_DIMS_1D_N(slab_vec));
+  }
+  cls_multi_layout(multi, sizeof(state_t)*MULTI_SIZE, MULTI_HALO, 1, rows);
+
+  cls_multi_run_init(multi);
+  cls_multi_finish(multi);
+  int64_t start = millis();
+  cls_multi_run_update_n(multi, MULTI_SWEEPS);
+  cls_multi_finish(multi);
+  int64_t end = millis();
+  cls_multi_run_meas(multi);
+
+  // output_s: mag[BUFFLEN/MEASDIV], then the lattices
+  out_t *ref_mag = ref, mag = 0;
+  state_t *ref_states = (state_t*)(ref_mag + BUFFLEN/MEASDIV);
+  char *out = malloc(ISING_OUTPUT_S(slab_vec));
+  *lattice_ok = 1;
+
+  for(int p = 0; p < parts; p++)
+  {
+    cls_get_meas(cls_multi_part(multi, p), out);
+    state_t *states = (state_t*)((out_t*)out + BUFFLEN/MEASDIV);
+    mag += *(out_t*)out;
+    *lattice_ok &= !memcmp(states + MULTI_HALO*MULTI_SIZE, ref_states + p*slab_rows*MULTI_SIZE,
+      sizeof(state_t)*slab_rows*MULTI_SIZE);
+  }
+  *mag_ok = mag==ref_mag[0];
+  free(out);
+
+  return (double)MULTI_SWEEPS*MULTI_SIZE*MULTI_SIZE/2/(MAX(end - start, 1)/1000.0);
+}
+
+// isingmulti [parts]: sub-devices of device 0 (2 by default)
+// isingmulti -d dev...: listed devices of platform 0
+void
+main(int argc, char **argv)
+{
+  oclMulti multi;
+
+  if((argc>1)&&!strcmp(argv[1], "-d"))
+  {
+    int devs_n = argc-2, devs[argc];
+    for(int d = 0; d < devs_n; d++) devs[d] = atoi(argv[d+2]);
+    multi = cls_new_multi(0, devs, devs_n);
+  }
+  else
+  {
+    multi = cls_new_multi_sub(0, 0, (argc>1) ? atoi(argv[1]) : 2);
+  }
+
+  void *ref = malloc(ISING_OUTPUT_S((size_t)MULTI_SIZE*MULTI_SIZE));
+  int lattice_ok, mag_ok;
+  double single_rate = run_single(ref);
+  double multi_rate = run_multi(multi, ref, &lattice_ok, &mag_ok);
+
+  printf("single device: %e flips/s\n", single_rate);
+  printf("%d parts:       %e flips/s (%.2fx)\n", cls_multi_parts(multi), multi_rate,
+    multi_rate/single_rate);
+  printf("slab lattice %s\n", lattice_ok ? "matches" : "DIFFERS");
+  printf("slab magnetization %s\n", mag_ok ? "matches" : "DIFFERS");
+
+  cls_release_multi(multi);
+  free(ref);
+}
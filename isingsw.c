@@ -0,0 +1,161 @@
+/*
+Copyright (C) 2022 Franco Sauvisky
+isingsw.c is part of oclsim
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "oclsim.h"
+
+#define BUFFLEN 4096 // samples per engine, one per sweep
+#define MEASDIV 1
+#include "ising.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <math.h>
+
+#define SW_THERM 256 // sweeps before the first sample
+#define SW_TEMP 2.269185 // Tc = 2/ln(1+sqrt(2))
+
+int64_t millis()
+{
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return ((int64_t) now.tv_sec) * 1000 + ((int64_t) now.tv_nsec) / 1000000;
+}
+
+// Integrated autocorrelation time, summed up to Sokal's window W >= 6 tau
+double
+tau_int(double *x, int n)
+{
+  double mean = 0.0, c0 = 0.0, tau = 0.5;
+
+  for(int t = 0; t < n; t++) mean += x[t]/n;
+  for(int t = 0; t < n; t++) c0 += pow(x[t]-mean, 2)/n;
+  if(c0==0.0) return tau;
+
+  for(int w = 1; (w < n/2)&&(w < 6*tau); w++)
+  {
+    double c = 0.0;
+    for(int t = 0; t < n-w; t++) c += (x[t]-mean)*(x[t+w]-mean);
+    tau += c/(n-w)/c0;
+  }
+  return tau;
+}
+
+// BUFFLEN samples of |m| per site at SW_TEMP, one per sweep: two update_k
+// half-sweeps, or one Swendsen-Wang update run as a kernel graph. Returns sweeps/s.
+double
+run_engine(int size, int sw, double *absm)
+{
+  size_t veclen = (size_t)size*size;
+  struct init_arg_s init_arg = {.rseed = (cl_uint)time(NULL)};
+  struct main_arg_s main_arg;
+  struct meas_arg_s meas_arg = sw ? (struct meas_arg_s){.idiv = 1, .ioffset = -SW_THERM-1}
+                                  : (struct meas_arg_s){.idiv = 2, .ioffset = -2*SW_THERM-2};
+  struct ens_output_s out;
+  uint_t sw_p = (cl_ulong)CL_UINT_MAX * (1.0 - exp(-2.0/SW_TEMP));
+  oclGraph graph = NULL;
+  oclSched sched = NULL;
+
+  for(int i = 0; i < PROB_L; i++)
+  {
+    main_arg.probs[i] = (cl_ulong)CL_UINT_MAX * PROB_MAX * MIN(1.0, exp(-4.0*(i-PROB_Z)/SW_TEMP));
+  }
+
+  oclSys ising = cls_new_sys(0,0);
+  cls_define(ising, "SIZEX", size);
+  cls_define(ising, "SIZEY", size);
+  ising_define_out(ising);
+  cls_load_sys_from_file(ising, "./ising.cl", ISING_STATE_S(veclen));
+  cls_set_meas_kernel(ising, "measure_ens_k");
+  cls_set_init_arg(ising, &init_arg, sizeof(init_arg), ISING_DIMS_2D_N(size,size));
+  cls_set_main_arg(ising, &main_arg, sizeof(main_arg), 1, ISING_DIMS_2D_N(size,size));
+  cls_set_meas_arg(ising, &meas_arg, sizeof(meas_arg), sizeof(state_t)*LOCAL_1D_LENGTH,
+    sizeof(out), ISING_DIMS_ENS_MEAS_N(veclen,1));
+
+  if(sw)
+  {
+    cls_add_buffer(ising, "bond_b", CLS_BUF_SCRATCH, sizeof(cl_uchar)*veclen, NULL);
+    cls_add_buffer(ising, "label_b", CLS_BUF_SCRATCH, sizeof(cl_uint)*veclen, NULL);
+    cls_add_buffer(ising, "sw_p_b", CLS_BUF_STATIC, sizeof(uint_t), &sw_p);
+
+    graph = cls_new_graph(ising);
+    int bond = cls_graph_node(graph, "sw_bond_k", ISING_DIMS_2D_N(size,size), 0, 0);
+    int merge = cls_graph_node(graph, "sw_merge_k", ISING_DIMS_2D_N(size,size), 0, 0);
+    int flip = cls_graph_node(graph, "sw_flip_k", ISING_DIMS_2D_N(size,size), 0, 1);
+    cls_graph_dep(graph, merge, bond);
+    cls_graph_dep(graph, flip, merge);
+  }
+  else
+  {
+    sched = cls_new_sched(ising);
+    cls_sched_add(sched, CLS_STEP_UPDATE, 2);
+    cls_sched_add(sched, CLS_STEP_MEAS, 1);
+  }
+
+  cls_run_init(ising);
+  if(sw) cls_run_graph(graph, SW_THERM);
+  else cls_run_update_n(ising, 2*SW_THERM);
+  cls_finish(ising);
+
+  int64_t start = millis();
+  if(sw)
+  {
+    for(int s = 0; s < BUFFLEN; s++)
+    {
+      cls_run_graph(graph, 1);
+      cls_run_meas(ising);
+    }
+  }
+  else
+  {
+    cls_run_sched(sched, BUFFLEN);
+  }
+  cls_get_meas(ising, &out);
+  int64_t end = millis();
+
+  for(int s = 0; s < BUFFLEN; s++) absm[s] = fabs((double)out.mag[s])/veclen;
+
+  if(graph) cls_release_graph(graph);
+  if(sched) cls_release_sched(sched);
+  cls_release_sys(ising);
+
+  return BUFFLEN/(MAX(end - start, 1)/1000.0);
+}
+
+// isingsw [size]: Metropolis against Swendsen-Wang at Tc on a size^2 lattice
+// (64 by default), compared by independent samples of |m| per second
+void
+main(int argc, char **argv)
+{
+  int size = (argc>1) ? atoi(argv[1]) : 64;
+  char *names[2] = {"metropolis", "swendsen-wang"};
+  double absm[BUFFLEN];
+
+  if((size<LOCAL_2D_WIDTH)||(size&(size-1))) // RIND wraps with unsigned modulo
+  {
+    fprintf(stderr, "Lattice size %d must be a power of two, at least %d\n", size, LOCAL_2D_WIDTH);
+    exit(1);
+  }
+
+  printf("# engine sweeps/s <|m|> tau_int samples/s\n");
+  for(int sw = 0; sw < 2; sw++)
+  {
+    double rate = run_engine(size, sw, absm), mean = 0.0;
+    double tau = tau_int(absm, BUFFLEN);
+
+    for(int s = 0; s < BUFFLEN; s++) mean += absm[s]/BUFFLEN;
+    printf("%s %e %f %f %e\n", names[sw], rate, mean, tau, rate/(2*tau));
+  }
+}
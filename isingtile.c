@@ -0,0 +1,96 @@
+/*
+Copyright (C) 2022 Franco Sauvisky
+isingtile.c is part of oclsim
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "oclsim.h"
+#include "ising.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#define SWEEPS (BUFFLEN*TBLOCK)
+
+int64_t millis()
+{
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return ((int64_t) now.tv_sec) * 1000 + ((int64_t) now.tv_nsec) / 1000000;
+}
+
+// Runs SWEEPS half-sweeps with the selected update kernel, returns site-updates/s
+double
+run_kernel(oclSys ising, char *name, size_t local_s, size_t steps_per_launch,
+           struct output_s *out)
+{
+  struct init_arg_s init_arg = {.rseed = 1234};
+  struct main_arg_s main_arg;
+  struct meas_arg_s meas_arg = {.idiv = CL_INT_MAX, .ioffset = 0};
+  float temp = 2.3;
+
+  for(int i = 0; i < PROB_L; i++)
+  {
+    main_arg.probs[i] = (cl_ulong)CL_UINT_MAX * PROB_MAX * MIN(1.0, exp(-4.0*(i-PROB_Z)/temp));
+  }
+
+  cls_set_main_kernel(ising, name);
+  cls_set_init_arg(ising, &init_arg, sizeof(init_arg), ISING_DIMS_2D);
+  cls_set_main_arg(ising, &main_arg, sizeof(main_arg), local_s, ISING_DIMS_2D);
+  cls_set_meas_arg(ising, &meas_arg, sizeof(meas_arg), sizeof(state_t)*LOCAL_1D_LENGTH, sizeof(struct output_s), ISING_DIMS_1D);
+
+  cls_run_init(ising);
+  cls_get_meas(ising, out); // drain queue before timing
+
+  int64_t start = millis();
+  cls_run_update_n(ising, SWEEPS/steps_per_launch);
+  cls_run_meas(ising);
+  cls_get_meas(ising, out);
+  int64_t end = millis();
+
+  return (double)SWEEPS*VECLEN/(MAX(end - start, 1)/1000.0);
+}
+
+void
+main(void)
+{
+  oclSys ising = cls_new_sys(0,0);
+  cls_load_sys_from_file(ising, "./ising.cl", sizeof(struct state_s));
+
+  struct output_s *ref = malloc(sizeof(struct output_s));
+  struct output_s *out = malloc(sizeof(struct output_s));
+
+  double ref_rate = run_kernel(ising, MAIN_K_NAME, 1, 1, ref);
+  double tile_rate = run_kernel(ising, "update_tiled_k", TILE_LOCAL_S, TBLOCK, out);
+  int tile_match = !memcmp(ref->states[0], out->states[0], sizeof(ref->states[0]));
+
+  cls_release_sys(ising);
+
+  // Red/black in place on a single buffer
+  oclSys ising_rb = cls_new_sys(0,0);
+  cls_set_mode(ising_rb, CLS_MODE_INPLACE);
+  cls_load_sys_from_file(ising_rb, "./ising.cl", sizeof(struct state_s));
+  double rb_rate = run_kernel(ising_rb, "update_rb_k", 1, 1, out);
+  int rb_match = !memcmp(ref->states[0], out->states[0], sizeof(ref->states[0]));
+  cls_release_sys(ising_rb);
+
+  printf("update_k:       %e site-updates/s\n", ref_rate);
+  printf("update_tiled_k: %e site-updates/s (%.2fx)\n", tile_rate, tile_rate/ref_rate);
+  printf("update_rb_k:    %e site-updates/s (%.2fx)\n", rb_rate, rb_rate/ref_rate);
+  printf("tiled final lattice %s\n", tile_match ? "matches" : "DIFFERS");
+  printf("red/black final lattice %s\n", rb_match ? "matches" : "DIFFERS");
+
+  free(ref);
+  free(out);
+}
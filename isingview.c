@@ -27,11 +27,13 @@ int64_t millis()
   return ((int64_t) now.tv_sec) * 1000 + ((int64_t) now.tv_nsec) / 1000000;
 }
 
-void
-main(void)
+// Simulates BUFFLEN updates, streaming every lattice to SNAP_FILE
+float
+simulate(void)
 {
   oclSys ising = cls_new_sys(1,0);
   cls_load_sys_from_file(ising, "./ising.cl", sizeof(struct state_s));
+  cls_set_meas_kernel(ising, "snapshot_k");
 
   struct init_arg_s init_arg;
   struct main_arg_s main_arg;
@@ -40,8 +42,6 @@ main(void)
   uint rseed = (uint)time(NULL);
   srand(rseed);
 
-  struct output2_s *out = malloc(sizeof(struct output2_s));
-
   float temp = 2.3;
 
   for(int i = 0; i < PROB_L; i++)
@@ -54,46 +54,63 @@ main(void)
 
   cls_set_init_arg(ising, &init_arg, sizeof(init_arg), ISING_DIMS_2D);
   cls_set_main_arg(ising, &main_arg, sizeof(main_arg), 1, ISING_DIMS_2D);
-  cls_set_meas_arg(ising, &meas_arg, sizeof(meas_arg), sizeof(state_t)*LOCAL_1D_LENGTH, sizeof(struct output2_s), ISING_DIMS_1D);
+  cls_set_meas_arg(ising, &meas_arg, sizeof(meas_arg), sizeof(state_t), SNAP_RING*sizeof(state_t)*VECLEN, ISING_DIMS_1D);
 
-  int64_t start = millis();
+  cls_stream_hdr hdr = {.dtype = CLS_DTYPE_I32, .dim = 2, .dims = {SIZEY, SIZEX, 1},
+    .stride = 1, .frame_s = sizeof(state_t)*VECLEN};
+  cls_open_stream(ising, SNAP_FILE, &hdr, SNAP_CHUNK);
 
-  cls_run_init(ising);
+  oclSched sched = cls_new_sched(ising);
+  cls_sched_add(sched, CLS_STEP_MEAS, 1);
+  cls_sched_add(sched, CLS_STEP_UPDATE, 1);
 
-  for(int i = 0; i < BUFFLEN; i++)
-  {
-    cls_run_meas(ising);
-    cls_run_update(ising);
-  }
+  int64_t start = millis();
 
-  cls_get_meas(ising, out);
+  cls_run_init(ising);
+  cls_run_sched(sched, BUFFLEN);
+  cls_close_stream(ising);
 
   int64_t end = millis();
 
+  cls_release_sched(sched);
   cls_release_sys(ising);
 
+  return (float)(end - start) / 1000;
+}
+
+// Without arguments simulates first; otherwise replays the given stream file
+void
+main(int argc, char **argv)
+{
+  char *filename = (argc>1) ? argv[1] : SNAP_FILE;
+  float seconds = (argc>1) ? 0.0 : simulate();
+
+  cls_stream_hdr *hdr = cls_map_stream(filename);
+  int sizex = hdr->dims[1], sizey = hdr->dims[0];
+
   // Print states/data
   printf("\e[1;1H\e[2J"); // clear screen
-  for (int k = 0; k < BUFFLEN; k+=1)
+  for (cl_ulong k = 0; k < hdr->frames; k+=1)
   {
+    state_t *states = (state_t*)((char*)hdr + hdr->data_offset + k*hdr->frame_s);
     printf("\033[0;0H"); // Move cursor to (0,0)
 
     // Print states
     printf("┌");
-    for(int i = 0; i < 2*SIZEX/OVERSAMPLE+2; i++) printf("─");
+    for(int i = 0; i < 2*sizex/OVERSAMPLE+2; i++) printf("─");
     printf("┐\n");
 
-    for (int i = 0; i < SIZEY; i+=OVERSAMPLE)
+    for (int i = 0; i < sizex; i+=OVERSAMPLE)
     {
       printf("│ ");
-      for (int j = 0; j < SIZEX; j+=OVERSAMPLE)
+      for (int j = 0; j < sizey; j+=OVERSAMPLE)
       {
         int sum = 0;
         for(int iov = 0; iov < OVERSAMPLE; iov++)
         {
           for(int jov = 0; jov < OVERSAMPLE; jov++)
           {
-            sum+=out->states[k][(i+iov)*SIZEX + (j+jov)];
+            sum+=states[(i+iov)*sizey + (j+jov)];
           }
         }
         printf("\033[48;5;%3dm  \e[0m",242 + 8*sum/(OVERSAMPLE*OVERSAMPLE));
@@ -102,10 +119,10 @@ main(void)
     }
 
     printf("└");
-    for(int i = 0; i < 2*SIZEX/OVERSAMPLE+2; i++) printf("─");
+    for(int i = 0; i < 2*sizex/OVERSAMPLE+2; i++) printf("─");
     printf("┘\n");
   }
 
-  float seconds = (float)(end - start) / 1000;
-  printf("exec time: %f s\n",seconds);
+  cls_unmap_stream(hdr);
+  if(argc<=1) printf("exec time: %f s\n",seconds);
 }
@@ -15,6 +15,7 @@ GNU General Public License for more details.
 
 #include "oclsim.h"
 #include "mandel.h"
+#include "mandelbin.h"
 
 #include <stdio.h>
 #include <time.h>
@@ -25,6 +26,7 @@ main(void)
 {
   oclSys testsim = cls_new_sys(2,0);
   cls_load_sys_from_file(testsim, "./mandel.cl", sizeof(struct state_s));
+  cls_add_buffer(testsim, "z0_b", CLS_BUF_STATIC, sizeof(state_t)*VECLEN*VECLEN, NULL);
 
   struct init_arg_s init_arg = {.z0={.x=X0, .y=Y0}, .dz={.x=DX, .y=DY}};
   struct main_arg_s main_arg;
@@ -34,17 +36,17 @@ main(void)
   cls_set_main_arg(testsim, &main_arg, sizeof(main_arg), 1, ISING_DIMS_2D);
   cls_set_meas_arg(testsim, &meas_arg, sizeof(meas_arg), 1, sizeof(struct output_s), ISING_DIMS_1D);
 
+  cls_run_init(testsim); // z0_b for the tuning launches
+  cls_autotune(testsim, CLS_STEP_UPDATE);
+
   cls_run_init(testsim);
-  for(int i = 0; i < ITER; i++)
-  {
-    cls_run_update(testsim);
-  }
+  cls_run_update_n(testsim, ITER);
 
   cls_run_meas(testsim);
   struct output_s *out = malloc(sizeof(struct output_s));
   cls_get_meas(testsim, out);
   cls_release_sys(testsim);
 
-  for(int i = 0; i < VECLEN*VECLEN; i++) printf("%d,%f\n",out->lastc[i],out->abs[i]);
-  printf("\n");
+  mandel_write_bin(MANDEL_BIN_FILE, out, ITER, X0, Y0, DX, DY);
+  free(out);
 }
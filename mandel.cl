@@ -2,7 +2,8 @@
 
 kernel void
 init_k(global struct state_s *output,
-       constant struct init_arg_s *arg)
+       constant struct init_arg_s *arg,
+       global state_t *z0_b)
 {
   size_t i = get_global_id(0), j = get_global_id(1), ij = IND(i,j);
   state_t z0;
@@ -11,7 +12,7 @@ init_k(global struct state_s *output,
   z0.y = arg->z0.y+arg->dz.y*((int_t)j-VECLEN/2);
 
   output->states[ij] = z0;
-  output->z0[ij] = z0;
+  z0_b[ij] = z0;
   output->lastc[ij]=1;
 }
 
@@ -19,10 +20,11 @@ kernel void
 update_k(global struct state_s *output,
          global struct state_s *input,
          local void *lc_skpd,
-         constant struct main_arg_s *arg)
+         constant struct main_arg_s *arg,
+         global const state_t *z0_b)
 {
   size_t i = get_global_id(0), j = get_global_id(1), ij = IND(i,j);
-  state_t z = input->states[ij], z0 = input->z0[ij], new;
+  state_t z = input->states[ij], z0 = z0_b[ij], new;
   int_t lcount = input->lastc[ij];
 
   new.x = z.x*z.x-z.y*z.y+z0.x; // z^2+z0
@@ -33,7 +35,6 @@ update_k(global struct state_s *output,
 
   output->states[ij] = new*mask+z*(1-mask); // update or hold
   output->lastc[ij] = lcount+mask;
-  output->z0[ij] = z0;
 }
 
 kernel void
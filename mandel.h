@@ -29,6 +29,18 @@ GNU General Public License for more details.
 #define DX 0.0000001l/VECLEN
 #define DY 0.0000001l/VECLEN
 
+// Deep zoom (mandelpt): center as decimal strings, parsed in quad precision
+#define PT_X0 "-0.743643887037158704752191506114774"
+#define PT_Y0 "0.131825904205311970493132056385139"
+#define PT_DX (1e-26/VECLEN)
+#define PT_DY (1e-26/VECLEN)
+#define PT_ITER 20000
+#define PT_SERIES 1 // skip the first iterations by series approximation
+#define PT_SA_TOL 1e-6
+
+// Iterations per launch of the worklist engine (mandelwl):
+#define CHUNK 100
+
 // Resolution of image:
 #define VECLEN 512
 
@@ -79,10 +91,9 @@ struct output_s
   int_t lastc[VECLEN*VECLEN];
 };
 
-struct state_s
+struct state_s // z0 lives in a separate static buffer
 {
   state_t states[VECLEN*VECLEN];
-  state_t z0[VECLEN*VECLEN];
   int_t lastc[VECLEN*VECLEN];
 };
 
@@ -101,4 +112,59 @@ struct meas_arg_s
   int_t und;
 };
 
+// Worklist engine (mandelwl): only pixels that are still iterating are kept,
+// compacted into the other buffer after every chunk of iterations. Results go
+// to the single buffers abs_b/lastc_b when a pixel leaves the list.
+struct wl_item_s
+{
+  state_t z;
+  int_t idx;
+  int_t lastc;
+};
+
+struct wl_state_s
+{
+  int_t count; // live items
+  int_t next_count; // append cursor into the other buffer
+  uint_t groups_done;
+  int_t iter;
+  struct wl_item_s items[VECLEN*VECLEN];
+};
+
+// Perturbation engine (mandelpt): each pixel iterates only its offset from a
+// reference orbit computed on the host
+struct pt_state_s
+{
+  state_t dz[VECLEN*VECLEN]; // offset from the reference orbit
+  int_t m[VECLEN*VECLEN]; // position on the reference orbit
+  int_t lastc[VECLEN*VECLEN];
+  int_t esc[VECLEN*VECLEN];
+  float_t abs[VECLEN*VECLEN];
+  int_t iter;
+};
+
+struct pt_init_arg_s
+{
+  state_t dc; // pixel spacing
+  state_t sa[3]; // series coefficients A, B, C at iteration skip
+  int_t skip;
+};
+
+struct pt_main_arg_s // bound as global memory, too large for constant
+{
+  state_t dc;
+  int_t ref_len;
+  int_t iter_max;
+  int_t chunk;
+  int_t pad;
+  state_t ref[PT_ITER+1];
+};
+
+struct wl_main_arg_s
+{
+  state_t z0, dz;
+  int_t iter_max;
+  int_t chunk;
+};
+
 #endif
@@ -1,6 +1,15 @@
-data=csvread("./build/mandel.dat");
-outdata=data(:,1);
-indata=data(:,2)/2;
+f=fopen("./build/mandel.bin","r");
+magic=fread(f,8,"char=>char")';
+dims=fread(f,4,"uint32"); % width, height, iter, pad
+view=fread(f,4,"double"); % x0, y0, dx, dy
+offs=fread(f,2,"uint64"); % abs, lastc
+fseek(f,offs(1),SEEK_SET);
+absdata=fread(f,dims(1)*dims(2),"float32");
+fseek(f,offs(2),SEEK_SET);
+lastc=fread(f,dims(1)*dims(2),"int32");
+fclose(f);
+outdata=lastc;
+indata=absdata/2;
 outdata(outdata==max(outdata))=0;
 outdata=outdata/max(outdata);
 indata(indata>1.0)=1;
@@ -8,5 +17,5 @@ indata(outdata!=0)=0;
 indata=sqrt(indata);
 outdata=sqrt(outdata);
 zdata = max(indata,outdata);
-zmat = flipud(reshape(zdata,sqrt(size(zdata,1))*[1,1]));
+zmat = flipud(reshape(zdata,[dims(2),dims(1)]));
 imwrite(zmat,"./build/mandel.png");
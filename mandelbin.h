@@ -0,0 +1,99 @@
+/*
+Copyright (C) 2022 Franco Sauvisky
+mandelbin.h is part of oclsim
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef MANDELBIN_HEADER
+#define MANDELBIN_HEADER
+
+// Binary Mandelbrot results, host side only. The file is the header followed by
+// the abs[] and lastc[] arrays of struct output_s, unchanged: pixel IND(x,y),
+// with y varying fastest. Arrays start at 64 byte aligned offsets, so the file
+// can be mapped and used in place.
+
+#include "mandel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define MANDEL_BIN_FILE "./build/mandel.bin"
+#define MANDEL_BIN_MAGIC "MANDBIN1"
+
+struct mandel_bin_s
+{
+  char magic[8];
+  cl_uint width; // x
+  cl_uint height; // y
+  cl_uint iter; // iteration limit
+  cl_uint pad;
+  cl_double x0, y0; // center
+  cl_double dx, dy; // pixel size
+  cl_ulong abs_offset; // cl_float abs[width*height]
+  cl_ulong lastc_offset; // cl_int lastc[width*height]
+};
+
+static inline void
+mandel_write_bin(char *filename, struct output_s *out, cl_uint iter,
+                 double x0, double y0, double dx, double dy)
+{
+  struct mandel_bin_s hdr = {.magic = MANDEL_BIN_MAGIC, .width = VECLEN, .height = VECLEN,
+    .iter = iter, .x0 = x0, .y0 = y0, .dx = dx, .dy = dy};
+  hdr.abs_offset = (sizeof(hdr)+63)/64*64;
+  hdr.lastc_offset = (hdr.abs_offset + sizeof(out->abs) + 63)/64*64;
+
+  FILE *f = fopen(filename, "wb");
+  if(f==NULL) {perror(filename); exit(1);}
+
+  char zero[64] = {0};
+  fwrite(&hdr, sizeof(hdr), 1, f);
+  fwrite(zero, hdr.abs_offset - sizeof(hdr), 1, f);
+  fwrite(out->abs, sizeof(out->abs), 1, f);
+  fwrite(zero, hdr.lastc_offset - hdr.abs_offset - sizeof(out->abs), 1, f);
+  fwrite(out->lastc, sizeof(out->lastc), 1, f);
+
+  if(fclose(f)!=0) {perror(filename); exit(1);}
+}
+
+// Read-only mapping of a results file, arrays at the header offsets
+static inline struct mandel_bin_s*
+mandel_map_bin(char *filename, size_t *map_s)
+{
+  int fd = open(filename, O_RDONLY);
+  if(fd<0) {perror(filename); exit(1);}
+  *map_s = lseek(fd, 0, SEEK_END);
+  if(*map_s<sizeof(struct mandel_bin_s))
+  {
+    fprintf(stderr, "%s: not a Mandelbrot results file\n", filename);
+    exit(1);
+  }
+
+  struct mandel_bin_s *hdr = mmap(NULL, *map_s, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(hdr==MAP_FAILED) {perror(filename); exit(1);}
+
+  size_t pixels = (size_t)hdr->width*hdr->height;
+  if(memcmp(hdr->magic, MANDEL_BIN_MAGIC, 8)||
+     (hdr->abs_offset + pixels*sizeof(cl_float)>*map_s)||
+     (hdr->lastc_offset + pixels*sizeof(cl_int)>*map_s))
+  {
+    fprintf(stderr, "%s: not a Mandelbrot results file\n", filename);
+    exit(1);
+  }
+  return hdr;
+}
+
+#endif
@@ -0,0 +1,153 @@
+/*
+Copyright (C) 2022 Franco Sauvisky
+mandelpng.c is part of oclsim
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "oclsim.h"
+#include "mandelbin.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+
+#define PNG_FILE "./build/mandel.png"
+#define STORED_MAX 65535 // bytes per uncompressed deflate block
+
+static uint32_t crc_table[256];
+
+void
+crc_init(void)
+{
+  for(uint32_t n = 0; n < 256; n++)
+  {
+    uint32_t c = n;
+    for(int k = 0; k < 8; k++) c = (c&1) ? 0xedb88320u^(c>>1) : c>>1;
+    crc_table[n] = c;
+  }
+}
+
+uint32_t
+crc_update(uint32_t crc, const uint8_t *buf, size_t len)
+{
+  for(size_t n = 0; n < len; n++) crc = crc_table[(crc^buf[n])&0xff]^(crc>>8);
+  return crc;
+}
+
+void
+put_u32(uint8_t *p, uint32_t v)
+{
+  p[0] = v>>24; p[1] = v>>16; p[2] = v>>8; p[3] = v;
+}
+
+void
+write_chunk(FILE *f, const char *type, const uint8_t *data, uint32_t len)
+{
+  uint8_t word[4];
+
+  put_u32(word, len);
+  fwrite(word, 4, 1, f);
+  uint32_t crc = crc_update(0xffffffffu, (const uint8_t*)type, 4);
+  crc = crc_update(crc, data, len)^0xffffffffu;
+  fwrite(type, 4, 1, f);
+  fwrite(data, len, 1, f);
+  put_u32(word, crc);
+  fwrite(word, 4, 1, f);
+}
+
+// 8-bit grayscale PNG. The zlib stream uses stored deflate blocks, so no
+// compression library is needed; the image is small next to the text output.
+void
+write_png(char *filename, const uint8_t *gray, uint32_t width, uint32_t height)
+{
+  size_t raw_s = (size_t)(width+1)*height; // filter byte per row
+  size_t blocks = (raw_s+STORED_MAX-1)/STORED_MAX;
+  size_t idat_s = 2 + raw_s + 5*blocks + 4;
+  uint8_t *idat = malloc(idat_s), *p = idat;
+  uint32_t s1 = 1, s2 = 0; // adler32
+
+  *p++ = 0x78; *p++ = 0x01;
+  size_t left = raw_s, pos = 0;
+  for(size_t b = 0; b < blocks; b++)
+  {
+    uint16_t len = MIN(left, STORED_MAX);
+    *p++ = (b==blocks-1);
+    *p++ = len; *p++ = len>>8;
+    *p++ = ~len; *p++ = (~len)>>8;
+    for(uint16_t k = 0; k < len; k++, pos++)
+    {
+      size_t x = pos%(width+1);
+      uint8_t v = x ? gray[(pos/(width+1))*width + x-1] : 0;
+      *p++ = v;
+      s1 = (s1+v)%65521;
+      s2 = (s2+s1)%65521;
+    }
+    left -= len;
+  }
+  put_u32(p, (s2<<16)|s1);
+
+  uint8_t ihdr[13] = {0};
+  put_u32(ihdr, width);
+  put_u32(ihdr+4, height);
+  ihdr[8] = 8; // bit depth, color type 0 (gray)
+
+  FILE *f = fopen(filename, "wb");
+  if(f==NULL) {perror(filename); exit(1);}
+  fwrite("\x89PNG\r\n\x1a\n", 8, 1, f);
+  write_chunk(f, "IHDR", ihdr, sizeof(ihdr));
+  write_chunk(f, "IDAT", idat, idat_s);
+  write_chunk(f, "IEND", NULL, 0);
+  if(fclose(f)!=0) {perror(filename); exit(1);}
+
+  free(idat);
+}
+
+// Same mapping as mandel_plot.m: escaped pixels shaded by sqrt of their
+// normalized escape count (the maximum count is treated as interior), interior
+// pixels by sqrt(|z|^2/2) clamped to 1. Rows are flipped so y points up.
+void
+main(int argc, char **argv)
+{
+  char *in_file = (argc>1) ? argv[1] : MANDEL_BIN_FILE;
+  char *out_file = (argc>2) ? argv[2] : PNG_FILE;
+
+  size_t map_s;
+  struct mandel_bin_s *hdr = mandel_map_bin(in_file, &map_s);
+  const cl_float *abs = (const cl_float*)((char*)hdr + hdr->abs_offset);
+  const cl_int *lastc = (const cl_int*)((char*)hdr + hdr->lastc_offset);
+  uint32_t w = hdr->width, h = hdr->height;
+  size_t pixels = (size_t)w*h;
+
+  cl_int max_c = INT32_MIN, out_max = 0;
+  for(size_t i = 0; i < pixels; i++) max_c = MAX(max_c, lastc[i]);
+  for(size_t i = 0; i < pixels; i++) if(lastc[i]!=max_c) out_max = MAX(out_max, lastc[i]);
+
+  uint8_t *gray = malloc(pixels);
+  for(uint32_t x = 0; x < w; x++)
+  {
+    for(uint32_t y = 0; y < h; y++)
+    {
+      size_t i = (size_t)x*h + y;
+      double outd = ((lastc[i]==max_c)||(out_max==0)) ? 0.0 : (double)lastc[i]/out_max;
+      double ind = (outd!=0.0) ? 0.0 : MIN(abs[i]/2.0, 1.0);
+      double z = MAX(sqrt(ind), sqrt(outd));
+      gray[(size_t)(h-1-y)*w + x] = (uint8_t)lround(z*255.0);
+    }
+  }
+
+  crc_init();
+  write_png(out_file, gray, w, h);
+  fprintf(stderr, "%s: %ux%u, %u iterations\n", out_file, w, h, hdr->iter);
+
+  free(gray);
+  munmap(hdr, map_s);
+}
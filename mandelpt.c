@@ -0,0 +1,126 @@
+/*
+Copyright (C) 2022 Franco Sauvisky
+mandelpt.c is part of oclsim
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "oclsim.h"
+#include "mandel.h"
+#include "mandelbin.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <complex.h>
+#include <math.h>
+
+typedef __float128 hp_t;
+
+// Decimal string -> quad precision (sign, digits and one decimal point)
+hp_t
+parse_hp(char *str)
+{
+  hp_t val = 0, scale = 1;
+  int neg = (*str=='-'), frac = 0;
+
+  for(str += (*str=='-')||(*str=='+'); *str; str++)
+  {
+    if(*str=='.')
+    {
+      frac = 1;
+      continue;
+    }
+    val = 10*val + (*str-'0');
+    if(frac) scale *= 10;
+  }
+  return (neg ? -val : val)/scale;
+}
+
+// Reference orbit from z=0 at the image center, rounded to double
+int_t
+ref_orbit(state_t *ref)
+{
+  hp_t cx = parse_hp(PT_X0), cy = parse_hp(PT_Y0), zx = 0, zy = 0;
+  int_t n = 0;
+
+  ref[0] = (state_t){.x=0.0, .y=0.0};
+  while(n < PT_ITER)
+  {
+    hp_t nx = zx*zx - zy*zy + cx;
+    zy = 2*zx*zy + cy;
+    zx = nx;
+    n++;
+    ref[n] = (state_t){.x=(double)zx, .y=(double)zy};
+    if(zx*zx + zy*zy > 4) break; // the reference escaped, pixels rebase at n
+  }
+  return n;
+}
+
+// Series approximation dz_n = A dc + B dc^2 + C dc^3, advanced while the cubic
+// term stays negligible for the farthest pixel
+int_t
+series_skip(state_t *ref, int_t ref_len, double radius, state_t sa[3])
+{
+  double complex a = 1, b = 0, c = 0;
+  int_t n = 1;
+
+  while(PT_SERIES && (n+1 < ref_len))
+  {
+    double complex z = ref[n].x + I*ref[n].y;
+    double complex na = 2*z*a + 1, nb = 2*z*b + a*a, nc = 2*z*c + 2*a*b;
+
+    if(cabs(nc)*radius > PT_SA_TOL*cabs(nb)) break;
+    if(cabs(nb)*radius > PT_SA_TOL*cabs(na)) break;
+    a = na; b = nb; c = nc;
+    n++;
+  }
+
+  sa[0] = (state_t){.x=creal(a), .y=cimag(a)};
+  sa[1] = (state_t){.x=creal(b), .y=cimag(b)};
+  sa[2] = (state_t){.x=creal(c), .y=cimag(c)};
+  return n;
+}
+
+void
+main(void)
+{
+  oclSys testsim = cls_new_sys(2,0);
+  cls_load_sys_from_file(testsim, "./mandelpt.cl", sizeof(struct pt_state_s));
+
+  struct pt_main_arg_s *main_arg = malloc(sizeof(struct pt_main_arg_s));
+  struct pt_init_arg_s init_arg = {.dc={.x=PT_DX, .y=PT_DY}};
+  struct meas_arg_s meas_arg;
+
+  main_arg->dc = init_arg.dc;
+  main_arg->ref_len = ref_orbit(main_arg->ref);
+  init_arg.skip = series_skip(main_arg->ref, main_arg->ref_len,
+    hypot(PT_DX, PT_DY)*VECLEN/2, init_arg.sa);
+  main_arg->iter_max = PT_ITER - init_arg.skip + 1;
+  main_arg->chunk = CHUNK;
+
+  fprintf(stderr, "Reference orbit: %d iterations, series skip: %d\n",
+    main_arg->ref_len, init_arg.skip);
+
+  cls_set_init_arg(testsim, &init_arg, sizeof(init_arg), ISING_DIMS_2D);
+  cls_set_main_arg(testsim, main_arg, sizeof(struct pt_main_arg_s), 1, ISING_DIMS_2D);
+  cls_set_meas_arg(testsim, &meas_arg, sizeof(meas_arg), 1, sizeof(struct output_s), ISING_DIMS_1D);
+
+  cls_run_init(testsim);
+  cls_run_update_n(testsim, (main_arg->iter_max+CHUNK-1)/CHUNK);
+
+  cls_run_meas(testsim);
+  struct output_s *out = malloc(sizeof(struct output_s));
+  cls_get_meas(testsim, out);
+  cls_release_sys(testsim);
+
+  mandel_write_bin(MANDEL_BIN_FILE, out, PT_ITER, strtod(PT_X0, NULL), strtod(PT_Y0, NULL), PT_DX, PT_DY);
+  free(out);
+}
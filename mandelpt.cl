@@ -0,0 +1,96 @@
+#include "mandel.h"
+
+inline state_t
+cmul(state_t a, state_t b)
+{
+  return (state_t)(a.x*b.x - a.y*b.y, a.x*b.y + a.y*b.x);
+}
+
+kernel void
+init_k(global struct pt_state_s *output,
+       constant struct pt_init_arg_s *arg)
+{
+  size_t i = get_global_id(0), j = get_global_id(1), ij = IND(i,j);
+  state_t dc;
+
+  dc.x = arg->dc.x*((int_t)i-VECLEN/2);
+  dc.y = arg->dc.y*((int_t)j-VECLEN/2);
+
+  // dz = A dc + B dc^2 + C dc^3 at iteration skip (A=1, B=C=0 for skip 1)
+  state_t dc2 = cmul(dc, dc);
+  output->dz[ij] = cmul(arg->sa[0], dc) + cmul(arg->sa[1], dc2) + cmul(arg->sa[2], cmul(dc2, dc));
+  output->m[ij] = arg->skip;
+  output->lastc[ij] = arg->skip;
+  output->esc[ij] = 0;
+  output->abs[ij] = 0.0;
+
+  if(ij==0)
+  {
+    output->iter = 0;
+  }
+}
+
+// z = ref[m] + dz, with dz' = 2 ref[m] dz + dz^2 + dc. When |z| drops below
+// |dz| the offset has lost precision (glitch), so the pixel is rebased onto the
+// start of the orbit (dz = z, m = 0); the same happens at the orbit's end.
+kernel void
+update_k(global struct pt_state_s *output,
+         global struct pt_state_s *input,
+         local void *lc_skpd,
+         global const struct pt_main_arg_s *arg)
+{
+  size_t i = get_global_id(0), j = get_global_id(1), ij = IND(i,j);
+  int_t iter = input->iter, n = min(arg->chunk, arg->iter_max - iter);
+  int_t m = input->m[ij], lastc = input->lastc[ij], esc = input->esc[ij];
+  state_t dz = input->dz[ij], dc, z = arg->ref[m] + dz;
+
+  dc.x = arg->dc.x*((int_t)i-VECLEN/2);
+  dc.y = arg->dc.y*((int_t)j-VECLEN/2);
+
+  for(int_t c = 0; (c < n)&&!esc; c++)
+  {
+    state_t new_dz = 2.0*cmul(arg->ref[m], dz) + cmul(dz, dz) + dc;
+    state_t new = arg->ref[m+1] + new_dz;
+
+    double zz = new.x*new.x + new.y*new.y;
+    float_t abs = zz;
+    if(!(abs<=4.0))
+    {
+      esc = 1; // hold the last bounded z
+      break;
+    }
+
+    z = new;
+    dz = new_dz;
+    m++;
+    lastc++;
+
+    if((zz < dz.x*dz.x + dz.y*dz.y)||(m==arg->ref_len))
+    {
+      dz = z;
+      m = 0;
+    }
+  }
+
+  output->dz[ij] = dz;
+  output->m[ij] = m;
+  output->lastc[ij] = lastc;
+  output->esc[ij] = esc;
+  output->abs[ij] = z.x*z.x + z.y*z.y;
+
+  if(ij==0)
+  {
+    output->iter = iter+n;
+  }
+}
+
+kernel void
+measure_k(global struct output_s *output,
+          global struct pt_state_s *input,
+          local void* lc_skpd,
+          constant struct meas_arg_s *arg)
+{
+  size_t i = get_global_id(0);
+  output->lastc[i] = input->lastc[i];
+  output->abs[i] = input->abs[i];
+}
@@ -0,0 +1,51 @@
+/*
+Copyright (C) 2022 Franco Sauvisky
+mandelwl.c is part of oclsim
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "oclsim.h"
+#include "mandel.h"
+#include "mandelbin.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <math.h>
+
+void
+main(void)
+{
+  oclSys testsim = cls_new_sys(2,0);
+  cls_load_sys_from_file(testsim, "./mandelwl.cl", sizeof(struct wl_state_s));
+  cls_add_buffer(testsim, "abs_b", CLS_BUF_SCRATCH, sizeof(float_t)*VECLEN*VECLEN, NULL);
+  cls_add_buffer(testsim, "lastc_b", CLS_BUF_SCRATCH, sizeof(int_t)*VECLEN*VECLEN, NULL);
+
+  struct init_arg_s init_arg = {.z0={.x=X0, .y=Y0}, .dz={.x=DX, .y=DY}};
+  struct wl_main_arg_s main_arg = {.z0={.x=X0, .y=Y0}, .dz={.x=DX, .y=DY},
+                                   .iter_max=ITER, .chunk=CHUNK};
+  struct meas_arg_s meas_arg;
+
+  cls_set_init_arg(testsim, &init_arg, sizeof(init_arg), ISING_DIMS_2D);
+  cls_set_main_arg(testsim, &main_arg, sizeof(main_arg), 2*sizeof(int_t), ISING_DIMS_1D);
+  cls_set_meas_arg(testsim, &meas_arg, sizeof(meas_arg), 1, sizeof(struct output_s), ISING_DIMS_1D);
+
+  cls_run_init(testsim);
+  cls_run_update_n(testsim, (ITER+CHUNK-1)/CHUNK);
+
+  cls_run_meas(testsim);
+  struct output_s *out = malloc(sizeof(struct output_s));
+  cls_get_meas(testsim, out);
+  cls_release_sys(testsim);
+
+  mandel_write_bin(MANDEL_BIN_FILE, out, ITER, X0, Y0, DX, DY);
+  free(out);
+}
@@ -0,0 +1,113 @@
+#include "mandel.h"
+
+kernel void
+init_k(global struct wl_state_s *output,
+       constant struct init_arg_s *arg)
+{
+  size_t i = get_global_id(0), j = get_global_id(1), ij = IND(i,j);
+  struct wl_item_s item;
+
+  item.z.x = arg->z0.x+arg->dz.x*((int_t)i-VECLEN/2);
+  item.z.y = arg->z0.y+arg->dz.y*((int_t)j-VECLEN/2);
+  item.idx = ij;
+  item.lastc = 1;
+  output->items[ij] = item;
+
+  if(ij==0)
+  {
+    output->count = VECLEN*VECLEN;
+    output->next_count = 0;
+    output->groups_done = 0;
+    output->iter = 0;
+  }
+}
+
+// Iterates every live pixel for up to one chunk, stopping as soon as it
+// escapes. Pixels still iterating are appended to the other buffer, one global
+// atomic per work-group. Finished pixels write their results once.
+kernel void
+update_k(global struct wl_state_s *output,
+         global struct wl_state_s *input,
+         local void *lc_skpd,
+         constant struct wl_main_arg_s *arg,
+         global float_t *abs_b,
+         global int_t *lastc_b)
+{
+  size_t k = get_global_id(0), k_l = get_local_id(0);
+  local int_t *l_n = lc_skpd, *l_base = l_n + 1;
+  int_t count = input->count, iter = input->iter;
+  int_t n = min(arg->chunk, arg->iter_max - iter);
+  int_t live = 0;
+  struct wl_item_s item;
+
+  if(k_l==0) *l_n = 0;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if(k < count)
+  {
+    item = input->items[k];
+    size_t i = item.idx/VECLEN, j = item.idx%VECLEN;
+    state_t z = item.z, z0, new;
+
+    z0.x = arg->z0.x+arg->dz.x*((int_t)i-VECLEN/2);
+    z0.y = arg->z0.y+arg->dz.y*((int_t)j-VECLEN/2);
+
+    live = 1;
+    for(int_t c = 0; c < n; c++)
+    {
+      new.x = z.x*z.x-z.y*z.y+z0.x; // z^2+z0
+      new.y = 2*z.x*z.y+z0.y;
+
+      float_t abs = new.x*new.x + new.y*new.y;
+      if(!(abs<=4.0))
+      {
+        live = 0;
+        break;
+      }
+      z = new;
+      item.lastc++;
+    }
+    item.z = z;
+
+    if(!live||(iter + n >= arg->iter_max))
+    {
+      live = 0;
+      abs_b[item.idx] = z.x*z.x+z.y*z.y;
+      lastc_b[item.idx] = item.lastc;
+    }
+  }
+
+  // Work-group aggregated append
+  int_t slot = live ? atomic_inc(l_n) : 0;
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if(k_l==0) *l_base = atomic_add(&input->next_count, *l_n);
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if(live) output->items[*l_base + slot] = item;
+
+  // The last work-group to finish publishes the compacted list
+  barrier(CLK_GLOBAL_MEM_FENCE);
+  if(k_l==0)
+  {
+    if(atomic_inc(&input->groups_done)==get_num_groups(0)-1)
+    {
+      output->count = atomic_xchg(&input->next_count, 0);
+      output->next_count = 0;
+      output->groups_done = 0;
+      output->iter = iter + n;
+      input->groups_done = 0;
+    }
+  }
+}
+
+kernel void
+measure_k(global struct output_s *output,
+          global struct wl_state_s *input,
+          local void* lc_skpd,
+          constant struct meas_arg_s *arg,
+          global const float_t *abs_b,
+          global const int_t *lastc_b)
+{
+  size_t i = get_global_id(0);
+  output->lastc[i] = lastc_b[i];
+  output->abs[i] = abs_b[i];
+}
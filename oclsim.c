@@ -16,8 +16,14 @@ GNU General Public License for more details.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "oclsim.h"
+#include <CL/cl_ext.h>
 
 #define PINFORM(x, ...) {fprintf(stderr, (x), ##__VA_ARGS__);}
 #define PERROR(x,val) {fprintf(stderr,\
@@ -25,6 +31,86 @@ GNU General Public License for more details.
 val,__LINE__, __FILE__, __func__, (x));}
 #define CHKERROR(flag,str) {if(flag){PERROR(str,flag);exit(1);};}
 
+#define CLS_NAME_LEN 64
+#define CLS_GRAPH_MAX 64
+#define CLS_MEAS_SLOTS 4
+#define CLS_BUILD_OPTS "-I. -cl-kernel-arg-info"
+#define CLS_CACHE_DIR "./build/clcache" // overridden by $OCLSIM_CACHE, "" disables
+#define CLS_CACHE_MAGIC "OCLSBIN1"
+#define CLS_STATE_MAGIC "OCLSSTAT"
+#define CLS_STATE_VERSION 1
+#define CLS_INCLUDE_DEPTH 16
+#define CLS_PROF_PENDING 4096 // uncollected events before forcing a collection
+#define CLS_PROF_NAMES 64
+#define CLS_PROF_BINS 496 // duration histogram: 8 bins per power of two of ns
+#define CLS_PROF_TRACE 65536 // commands kept for cls_prof_trace, the first ones
+#define CLS_TUNE_FILE "tune.txt" // in the cache directory
+#define CLS_TUNE_LAUNCHES 8 // timed launches per candidate, even
+#define CLS_TUNE_MAX 64 // candidate shapes
+
+struct cls_buffer
+{
+  char name[CLS_NAME_LEN];
+  cls_role role;
+  size_t size;
+  cl_mem mem[2]; // by parity, both the same unless double buffered
+};
+
+// Host side copy of a kernel argument struct, the source of its pending write
+struct cls_arg
+{
+  void *host;
+  cl_event ev;
+};
+
+// Profiled command: the event is held until its times are collected
+struct prof_rec
+{
+  cl_event ev;
+  short name;
+  short queue; // CLS_Q_*
+  size_t bytes;
+  cl_ulong t[4]; // queued, submit, start, end
+};
+
+enum {CLS_Q_MAIN, CLS_Q_XFER, CLS_Q_GRAPH};
+
+// Collected commands of one name, folded as they complete
+struct prof_agg
+{
+  size_t count;
+  size_t bytes;
+  cl_ulong total, min, max; // ns
+  cl_uint hist[CLS_PROF_BINS];
+};
+
+struct cls_prof
+{
+  struct prof_rec pending[CLS_PROF_PENDING]; // ring, oldest at head
+  size_t head;
+  size_t pending_n;
+  struct prof_rec *trace; // ev unused
+  size_t trace_n;
+  size_t trace_dropped;
+  struct prof_agg aggs[CLS_PROF_NAMES];
+  char names[CLS_PROF_NAMES][CLS_NAME_LEN];
+  int names_n;
+};
+
+// Asynchronous measurement readback slot: the output buffer is copied to dev_b
+// on the main queue and read into pinned memory on the transfer queue
+struct meas_slot
+{
+  oclSys sys;
+  cl_mem dev_b;
+  cl_mem host_b;
+  void *host_p;
+  cl_event ev;
+  volatile int busy; // from cls_get_meas_async until released
+  cls_meas_cb cb;
+  void *user;
+};
+
 struct oclsim_sys
 {
   cl_platform_id platform;
@@ -32,6 +118,7 @@ struct oclsim_sys
   cl_context context;
   cl_command_queue queue;
   cl_program program;
+  cls_mode mode;
   char state;
 
   cl_mem states_b[2];
@@ -43,24 +130,241 @@ struct oclsim_sys
   dims_i init_d;
   cl_mem init_arg_b;
   size_t init_arg_s;
+  struct cls_arg init_arg_h;
 
   cl_kernel main_k[2];
   dims_i main_d;
   cl_mem main_arg_b;
   size_t main_arg_s;
+  struct cls_arg main_arg_h;
   size_t main_local_s;
 
   cl_kernel meas_k[2];
   dims_i meas_d;
   cl_mem meas_arg_b;
   size_t meas_arg_s;
+  struct cls_arg meas_arg_h;
   size_t meas_local_s;
+
+  cl_command_queue xfer_queue;
+  struct meas_slot meas_slot[CLS_MEAS_SLOTS];
+  int meas_slots;
+  int meas_next;
+  size_t meas_slot_s;
+
+  // Snapshot stream: output_b is a ring of frames drained into a mapped file
+  int stream_fd;
+  cls_stream_hdr *stream_map; // header followed by the frames
+  size_t stream_map_s;
+  size_t stream_ring_n;
+  size_t stream_chunk_n;
+  size_t stream_frame_s;
+  cl_ulong stream_frames; // measurements enqueued since opening
+  cl_event *stream_ev; // pending drain of each ring chunk
+
+  unsigned int bind_gen; // bumped when kernel args/dims change
+  char *arg_info; // "kernel index qualifier name" lines, for cached binaries
+  char *defines; // " -D name=value" build options from cls_define
+  cl_ulong prog_key; // cache key of the loaded program
+  struct cls_prof *prof; // NULL unless profiling
+
+  struct cls_buffer *bufs;
+  size_t bufs_n;
+
+  const cls_native *native; // host engine standing in for the kernels, or NULL
+  void *native_eng;
+
+#ifdef cl_khr_command_buffer
+  clCreateCommandBufferKHR_fn cb_create;
+  clCommandNDRangeKernelKHR_fn cb_ndrange;
+  clFinalizeCommandBufferKHR_fn cb_finalize;
+  clEnqueueCommandBufferKHR_fn cb_enqueue;
+  clReleaseCommandBufferKHR_fn cb_release;
+#endif
 };
 
-oclSys
-cls_new_sys(int plat_i, int dev_i)
+struct sched_step
+{
+  cls_step step;
+  size_t count;
+};
+
+struct oclsim_sched
+{
+  oclSys sys;
+  struct sched_step *steps;
+  size_t steps_n;
+  size_t steps_cap;
+
+#ifdef cl_khr_command_buffer
+  // Recorded schedule, one per starting ping-pong parity
+  cl_command_buffer_khr cmdbuf[2];
+  cl_event cmdbuf_ev[2];
+  unsigned int cmdbuf_gen[2];
+  size_t cmdbuf_repeat[2];
+#endif
+};
+
+// Histogram bin of a duration: exact below 8 ns, then 8 bins per power of two
+// (within 12.5%)
+static int
+cls_prof_bin(cl_ulong d)
+{
+  if(d<8) return (int)d;
+  int e = 63-__builtin_clzll(d);
+  return (e-2)*8 + (int)((d>>(e-3))&7);
+}
+
+static cl_ulong
+cls_prof_bin_top(int b) // largest duration in bin b
+{
+  if(b<8) return b;
+  int e = b/8+2;
+  return ((cl_ulong)(8+b%8+1)<<(e-3))-1;
+}
+
+static void
+cls_prof_fold(struct cls_prof *prof, struct prof_rec *rec)
+{
+  struct prof_agg *agg = &prof->aggs[rec->name];
+  cl_ulong d = rec->t[3]-rec->t[2];
+
+  if((agg->count==0)||(d<agg->min)) agg->min = d;
+  if(d>agg->max) agg->max = d;
+  agg->count++;
+  agg->total += d;
+  agg->bytes += rec->bytes;
+  agg->hist[cls_prof_bin(d)]++;
+
+  if(prof->trace_n==CLS_PROF_TRACE) {prof->trace_dropped++; return;}
+  if(prof->trace==NULL) prof->trace = (struct prof_rec*)malloc(CLS_PROF_TRACE*sizeof(struct prof_rec));
+  prof->trace[prof->trace_n++] = *rec;
+}
+
+// Profiling: every enqueue passes cls_prof_ev(...) as its event, which is NULL
+// (no event created) unless profiling is enabled. Events wait in a bounded ring
+// and are folded into per-name aggregates once complete, so memory does not
+// grow with the run; only the first CLS_PROF_TRACE commands are kept whole.
+static void
+cls_prof_collect(struct cls_prof *prof, int wait)
+{
+  for(; prof->pending_n; prof->head = (prof->head+1)%CLS_PROF_PENDING, prof->pending_n--)
+  {
+    struct prof_rec *rec = &prof->pending[prof->head];
+    cl_int status = CL_COMPLETE;
+
+    if(rec->ev==NULL) continue;
+    if(wait) clWaitForEvents(1, &rec->ev);
+    else clGetEventInfo(rec->ev, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+    if(status>CL_COMPLETE) break; // keep order, collect the rest later
+
+    cl_int err=0;
+    err |= clGetEventProfilingInfo(rec->ev, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &rec->t[0], NULL);
+    err |= clGetEventProfilingInfo(rec->ev, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &rec->t[1], NULL);
+    err |= clGetEventProfilingInfo(rec->ev, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &rec->t[2], NULL);
+    err |= clGetEventProfilingInfo(rec->ev, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &rec->t[3], NULL);
+    clReleaseEvent(rec->ev);
+    rec->ev = NULL;
+    if((err>=0)&&(status>=0)&&(rec->t[3]>=rec->t[2])) cls_prof_fold(prof, rec); // failed ones are left out
+  }
+}
+
+static cl_event*
+cls_prof_push(oclSys sys, int queue, cl_kernel kernel, const char *name, size_t bytes)
+{
+  struct cls_prof *prof = sys->prof;
+  char kname[CLS_NAME_LEN];
+  int n;
+
+  if(prof->pending_n==CLS_PROF_PENDING)
+  {
+    cls_prof_collect(prof, 0);
+    if(prof->pending_n==CLS_PROF_PENDING) cls_prof_collect(prof, 1);
+  }
+
+  if(kernel!=NULL)
+  {
+    clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(kname), kname, NULL);
+    name = kname;
+  }
+  for(n = 0; (n < prof->names_n)&&strcmp(prof->names[n], name); n++);
+  if(n==prof->names_n)
+  {
+    CHKERROR(n==CLS_PROF_NAMES, "Too many profiled command names");
+    snprintf(prof->names[n], CLS_NAME_LEN, "%s", name);
+    prof->names_n++;
+  }
+
+  struct prof_rec *rec = &prof->pending[(prof->head+prof->pending_n++)%CLS_PROF_PENDING];
+  memset(rec, 0, sizeof(struct prof_rec));
+  rec->name = n;
+  rec->queue = queue;
+  rec->bytes = bytes;
+  return &rec->ev; // written by the enqueue, before the next push
+}
+
+static inline cl_event*
+cls_prof_ev(oclSys sys, int queue, cl_kernel kernel, const char *name, size_t bytes)
+{
+  return sys->prof ? cls_prof_push(sys, queue, kernel, name, bytes) : NULL;
+}
+
+// For commands whose event oclsim keeps anyway
+static inline void
+cls_prof_add(oclSys sys, int queue, cl_kernel kernel, const char *name, size_t bytes, cl_event ev)
+{
+  if((sys->prof==NULL)||(ev==NULL)) return;
+  clRetainEvent(ev);
+  *cls_prof_push(sys, queue, kernel, name, bytes) = ev;
+}
+
+static int
+dims_differ(dims_i a, dims_i b)
+{
+  return memcmp(&a, &b, sizeof(dims_i))!=0;
+}
+
+static void
+cls_probe_cmdbuf(oclSys sys)
+{
+#ifdef cl_khr_command_buffer
+  size_t ext_s;
+  cl_int err = clGetDeviceInfo(sys->device, CL_DEVICE_EXTENSIONS, 0, NULL, &ext_s);
+  if(err<0) return;
+
+  char *exts = (char*)malloc(ext_s + 1);
+  exts[ext_s] = '\0';
+  clGetDeviceInfo(sys->device, CL_DEVICE_EXTENSIONS, ext_s, exts, NULL);
+
+  if(strstr(exts, "cl_khr_command_buffer")!=NULL)
+  {
+    sys->cb_create = (clCreateCommandBufferKHR_fn)
+      clGetExtensionFunctionAddressForPlatform(sys->platform, "clCreateCommandBufferKHR");
+    sys->cb_ndrange = (clCommandNDRangeKernelKHR_fn)
+      clGetExtensionFunctionAddressForPlatform(sys->platform, "clCommandNDRangeKernelKHR");
+    sys->cb_finalize = (clFinalizeCommandBufferKHR_fn)
+      clGetExtensionFunctionAddressForPlatform(sys->platform, "clFinalizeCommandBufferKHR");
+    sys->cb_enqueue = (clEnqueueCommandBufferKHR_fn)
+      clGetExtensionFunctionAddressForPlatform(sys->platform, "clEnqueueCommandBufferKHR");
+    sys->cb_release = (clReleaseCommandBufferKHR_fn)
+      clGetExtensionFunctionAddressForPlatform(sys->platform, "clReleaseCommandBufferKHR");
+
+    if(!sys->cb_create||!sys->cb_ndrange||!sys->cb_finalize||!sys->cb_enqueue||!sys->cb_release)
+    {
+      sys->cb_create = NULL; // use plain enqueue
+    }
+    else
+    {
+      PINFORM("Using cl_khr_command_buffer for schedules\n");
+    }
+  }
+  free(exts);
+#endif
+}
+
+static cl_platform_id
+cls_get_platform(int plat_i)
 {
-  oclSys newsys = (oclSys)calloc(1,sizeof(struct oclsim_sys));
   cl_int err=0;
   cl_uint plats_n;
 
@@ -71,29 +375,44 @@ cls_new_sys(int plat_i, int dev_i)
 	err = clGetPlatformIDs(plats_n, platforms, NULL);
   CHKERROR(err<0,"Couldn't idenfity platforms");
 
-  newsys->platform = platforms[plat_i];
-
   char platname[100];
-  err = clGetPlatformInfo(newsys->platform,CL_PLATFORM_NAME,100,platname,NULL);
+  err = clGetPlatformInfo(platforms[plat_i],CL_PLATFORM_NAME,100,platname,NULL);
   CHKERROR(err<0,"Couldn't get platform name");
   PINFORM("Selected platform: %s\n", platname);
+  return platforms[plat_i];
+}
 
+static cl_device_id
+cls_get_device(cl_platform_id platform, int dev_i)
+{
+  cl_int err=0;
   cl_uint devs_n;
-  err=clGetDeviceIDs(newsys->platform,CL_DEVICE_TYPE_ALL,0,NULL,&devs_n);
+  err=clGetDeviceIDs(platform,CL_DEVICE_TYPE_ALL,0,NULL,&devs_n);
 
   cl_device_id devices[devs_n];
-  err=clGetDeviceIDs(newsys->platform,CL_DEVICE_TYPE_ALL,devs_n,devices,NULL);
+  err=clGetDeviceIDs(platform,CL_DEVICE_TYPE_ALL,devs_n,devices,NULL);
   CHKERROR(err<0,"Couldn't identify device");
   CHKERROR((dev_i<0)||(dev_i>=devs_n),"Selected device is out of range");
-  newsys->device = devices[dev_i];
 
   char devname[100];
-  err = clGetDeviceInfo(newsys->device,CL_DEVICE_NAME,100,devname,NULL);
+  err = clGetDeviceInfo(devices[dev_i],CL_DEVICE_NAME,100,devname,NULL);
   CHKERROR(err<0,"Couldn't get platform name");
   PINFORM("Selected device: %s\n", devname);
+  return devices[dev_i];
+}
 
-  newsys->context = clCreateContext(NULL, 1, &newsys->device, NULL, NULL, &err);
-  CHKERROR(err<0,"Couldn't create context");
+// System on one device of a context, which may be shared with other systems
+// (multi-device parts); the system holds its own reference to it
+static oclSys
+cls_new_sys_ctx(cl_platform_id platform, cl_device_id device, cl_context context)
+{
+  oclSys newsys = (oclSys)calloc(1,sizeof(struct oclsim_sys));
+  cl_int err=0;
+
+  newsys->platform = platform;
+  newsys->device = device;
+  newsys->context = context;
+  clRetainContext(context);
 
   newsys->queue = clCreateCommandQueueWithProperties(newsys->context,
     newsys->device, (cl_queue_properties[])
@@ -102,238 +421,2499 @@ cls_new_sys(int plat_i, int dev_i)
   newsys->state=0;
 
   CHKERROR(err, "Couldn't create queue");
+  cls_probe_cmdbuf(newsys);
+  if(getenv("OCLSIM_PROFILE")!=NULL) cls_set_profiling(newsys, 1);
   return newsys;
 }
 
-void
-cls_load_sys_from_str(oclSys sys, char *src_str, size_t states_size)
+oclSys
+cls_new_sys(int plat_i, int dev_i)
 {
   cl_int err=0;
-  size_t src_size = strlen(src_str);
-
-  sys->program = clCreateProgramWithSource(sys->context, 1,(const char**)
-                                               &src_str, &src_size, &err);
-  CHKERROR(err<0, "Couldn't create program");
-
-  err = clBuildProgram(sys->program, 0, NULL, "-I.", NULL, NULL);
-  if(err < 0) // Print compilation log if fails for debugging code
-  {
-    size_t log_size;
-    clGetProgramBuildInfo(sys->program, sys->device,
-                          CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-    char *log_buff = (char*)malloc(log_size + 1);
-    log_buff[log_size] = '\0';
-    clGetProgramBuildInfo(sys->program, sys->device,
-                          CL_PROGRAM_BUILD_LOG, log_size, log_buff, NULL);
-    printf("%s\n", log_buff);
-    free(log_buff);
-    exit(1);
-  }
+  cl_platform_id platform = cls_get_platform(plat_i);
+  cl_device_id device = cls_get_device(platform, dev_i);
 
-  sys->init_k = clCreateKernel(sys->program, INIT_K_NAME, &err);
-  sys->main_k[0] = clCreateKernel(sys->program, MAIN_K_NAME, &err);
-  sys->main_k[1] = clCreateKernel(sys->program, MAIN_K_NAME, &err);
-  sys->meas_k[0] = clCreateKernel(sys->program, MEASURE_K_NAME, &err);
-  sys->meas_k[1] = clCreateKernel(sys->program, MEASURE_K_NAME, &err);
+  cl_context context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+  CHKERROR(err<0,"Couldn't create context");
 
-  sys->states_s = states_size;
-  sys->states_b[0] = clCreateBuffer(sys->context, CL_MEM_READ_WRITE, states_size, NULL, &err);
-  sys->states_b[1] = clCreateBuffer(sys->context, CL_MEM_READ_WRITE, states_size, NULL, &err);
-  CHKERROR(err, "Couldn't load system kernels/state buffers");
+  oclSys newsys = cls_new_sys_ctx(platform, device, context);
+  clReleaseContext(context);
+  return newsys;
 }
 
-void
-cls_load_sys_from_file(oclSys sys, char *src_filename, size_t states_size)
+oclSys
+cls_new_sys_native(const cls_native *native)
 {
-  FILE *src_fh = fopen(src_filename, "r");
-  char *src_buff;
-  size_t src_size;
-
-  CHKERROR(src_fh==NULL, "Couldn't open .cl src file");
-  fseek(src_fh, 0, SEEK_END);
-  src_size = ftell(src_fh);
-  rewind(src_fh);
-  src_buff = (char*)malloc(src_size + 1);
-  src_buff[src_size] = '\0';
-  fread(src_buff, sizeof(char), src_size, src_fh); // Copy src to buffer
-  fclose(src_fh);
-  cls_load_sys_from_str(sys, src_buff, states_size);
-  free(src_buff);
+  oclSys newsys = (oclSys)calloc(1,sizeof(struct oclsim_sys));
+  newsys->native = native;
+  return newsys;
 }
 
-void
-cls_set_init_arg(oclSys sys, void* arg, size_t arg_s, dims_i dims)
+oclSys
+cls_new_sys_shared(oclSys sys)
 {
-  cl_int err=0;
-
-  if((sys->init_arg_s!=arg_s)||(sys->init_arg_b==NULL))
-  {
-    if(sys->init_arg_b!=NULL)
-    {
-      clReleaseMemObject(sys->init_arg_b);
-      sys->init_arg_b=NULL;
-    }
-    sys->init_arg_s = arg_s;
-    sys->init_arg_b = clCreateBuffer(sys->context, CL_MEM_READ_ONLY, arg_s, NULL, &err);
-  }
-
-  sys->init_d = dims;
-  err |= clSetKernelArg(sys->init_k, 0, sizeof(cl_mem), &sys->states_b[0]);
-  err |= clSetKernelArg(sys->init_k, 1, sizeof(cl_mem), &sys->init_arg_b);
-  err |= clEnqueueWriteBuffer(sys->queue, sys->init_arg_b, CL_FALSE, 0, arg_s, arg, 0, NULL, NULL);
-
-  CHKERROR(err<0,"Coudn't configure init kernel");
+  CHKERROR(sys->native!=NULL, "Native systems have no context to share");
+  return cls_new_sys_ctx(sys->platform, sys->device, sys->context);
 }
 
-void
-cls_set_main_arg(oclSys sys, void* arg, size_t arg_s, size_t local_s, dims_i dims)
+// Argument name and address qualifier. Programs loaded from a binary have no
+// argument info, so the table saved along with the cached binary is used.
+static cl_int
+cls_kernel_arg(oclSys sys, cl_kernel kernel, cl_uint a, char *name, size_t name_s,
+               cl_kernel_arg_address_qualifier *aq)
 {
   cl_int err=0;
 
-  if((sys->main_arg_s!=arg_s)||(sys->main_arg_b==NULL))
+  err |= clGetKernelArgInfo(kernel, a, CL_KERNEL_ARG_NAME, name_s, name, NULL);
+  err |= clGetKernelArgInfo(kernel, a, CL_KERNEL_ARG_ADDRESS_QUALIFIER, sizeof(*aq), aq, NULL);
+  if((err>=0)||(sys->arg_info==NULL)) return err;
+
+  char kname[CLS_NAME_LEN], line_k[CLS_NAME_LEN], line_n[CLS_NAME_LEN+8];
+  cl_uint line_a, line_q;
+  err = clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(kname), kname, NULL);
+
+  for(char *line = sys->arg_info; (err>=0)&&(line!=NULL)&&(*line!='\0');)
   {
-    if(sys->main_arg_b!=NULL)
+    if((sscanf(line, "%63s %u %u %71s", line_k, &line_a, &line_q, line_n)==4)&&
+       (line_a==a)&&(strcmp(line_k, kname)==0)&&(strlen(line_n)<name_s))
     {
-      clReleaseMemObject(sys->main_arg_b);
-      sys->main_arg_b=NULL;
+      strcpy(name, line_n);
+      *aq = line_q;
+      return 0;
     }
-    sys->main_arg_s = arg_s;
-    sys->main_arg_b = clCreateBuffer(sys->context, CL_MEM_READ_ONLY, arg_s, NULL, &err);
+    line = strchr(line, '\n');
+    if(line) line++;
   }
-
-  sys->main_d = dims;
-  sys->main_local_s = local_s;
-
-  err |= clEnqueueWriteBuffer(sys->queue, sys->main_arg_b, CL_FALSE, 0, arg_s, arg, 0, NULL, NULL);
-  err |= clSetKernelArg(sys->main_k[0], 0, sizeof(cl_mem), &sys->states_b[1]);
-  err |= clSetKernelArg(sys->main_k[0], 1, sizeof(cl_mem), &sys->states_b[0]);
-  err |= clSetKernelArg(sys->main_k[0], 2, local_s, NULL);
-  err |= clSetKernelArg(sys->main_k[0], 3, sizeof(cl_mem), &sys->main_arg_b);
-
-  err |= clSetKernelArg(sys->main_k[1], 0, sizeof(cl_mem), &sys->states_b[0]);
-  err |= clSetKernelArg(sys->main_k[1], 1, sizeof(cl_mem), &sys->states_b[1]);
-  err |= clSetKernelArg(sys->main_k[1], 2, local_s, NULL);
-  err |= clSetKernelArg(sys->main_k[1], 3, sizeof(cl_mem), &sys->main_arg_b);
-
-  CHKERROR(err<0,"Coudn't create/configure update kernel");
+  return CL_KERNEL_ARG_INFO_NOT_AVAILABLE;
 }
 
-void
-cls_set_meas_arg(oclSys sys, void* arg, size_t arg_s, size_t local_s, size_t meas_s, dims_i dims)
+// Binds named buffers to the kernel arguments of the same name, par selects
+// the state parity the kernel reads, next enables the "_next" write side
+static cl_int
+cls_bind_kernel_bufs(oclSys sys, cl_kernel kernel, int par, int next)
 {
   cl_int err=0;
+  cl_uint args_n;
 
-  if((sys->meas_arg_s!=arg_s)||(sys->meas_arg_b==NULL))
+  if((kernel==NULL)||(sys->bufs_n==0)) return 0;
+  err = clGetKernelInfo(kernel, CL_KERNEL_NUM_ARGS, sizeof(cl_uint), &args_n, NULL);
+
+  for(cl_uint a = 0; (a < args_n)&&(err>=0); a++)
   {
-    if(sys->meas_arg_b!=NULL)
+    char arg_name[CLS_NAME_LEN+8];
+    cl_kernel_arg_address_qualifier aq;
+    if(cls_kernel_arg(sys, kernel, a, arg_name, sizeof(arg_name), &aq)<0)
     {
-      clReleaseMemObject(sys->meas_arg_b);
-      sys->meas_arg_b=NULL;
+      continue;
     }
-    sys->meas_arg_s = arg_s;
-    sys->meas_arg_b = clCreateBuffer(sys->context, CL_MEM_READ_ONLY, arg_s, NULL, &err);
-  }
 
-  if((sys->output_s!=meas_s)||(sys->output_b==NULL))
-  {
-    if(sys->output_b!=NULL)
+    for(size_t b = 0; b < sys->bufs_n; b++)
     {
-      clReleaseMemObject(sys->output_b);
-      sys->output_b=NULL;
+      struct cls_buffer *buf = &sys->bufs[b];
+      size_t len = strlen(buf->name);
+
+      if(strcmp(arg_name, buf->name)==0)
+      {
+        err |= clSetKernelArg(kernel, a, sizeof(cl_mem), &buf->mem[par]);
+      }
+      else if(next&&(strncmp(arg_name, buf->name, len)==0)&&(strcmp(arg_name+len, "_next")==0))
+      {
+        err |= clSetKernelArg(kernel, a, sizeof(cl_mem), &buf->mem[par^1]);
+      }
     }
-    sys->output_s = meas_s;
-    sys->output_b = clCreateBuffer(sys->context, CL_MEM_READ_WRITE, meas_s, NULL, &err);
   }
+  return err;
+}
 
-  sys->meas_d = dims;
-  sys->meas_local_s = local_s;
-
-  cl_char ozero = 0;
-
-  err |= clEnqueueWriteBuffer(sys->queue, sys->meas_arg_b, CL_FALSE, 0, arg_s, arg, 0, NULL, NULL);
-  err |= clEnqueueFillBuffer(sys->queue, sys->output_b, &ozero, 1, 0, meas_s, 0, NULL, NULL);
-
-  err |= clSetKernelArg(sys->meas_k[0], 0, sizeof(cl_mem), &sys->output_b);
-  err |= clSetKernelArg(sys->meas_k[0], 1, sizeof(cl_mem), &sys->states_b[0]);
-  err |= clSetKernelArg(sys->meas_k[0], 2, local_s, NULL);
-  err |= clSetKernelArg(sys->meas_k[0], 3, sizeof(cl_mem), &sys->meas_arg_b);
+static cl_int
+cls_bind_buffers(oclSys sys)
+{
+  cl_int err=0;
 
-  err |= clSetKernelArg(sys->meas_k[1], 0, sizeof(cl_mem), &sys->output_b);
-  err |= clSetKernelArg(sys->meas_k[1], 1, sizeof(cl_mem), &sys->states_b[1]);
-  err |= clSetKernelArg(sys->meas_k[1], 2, local_s, NULL);
-  err |= clSetKernelArg(sys->meas_k[1], 3, sizeof(cl_mem), &sys->meas_arg_b);
+  err |= cls_bind_kernel_bufs(sys, sys->init_k, 0, 0);
+  err |= cls_bind_kernel_bufs(sys, sys->main_k[0], 0, 1);
+  err |= cls_bind_kernel_bufs(sys, sys->main_k[1], 1, 1);
+  err |= cls_bind_kernel_bufs(sys, sys->meas_k[0], 0, 0);
+  err |= cls_bind_kernel_bufs(sys, sys->meas_k[1], 1, 0);
+  sys->bind_gen++;
 
-    err|=clFlush(sys->queue);
-    err|=clFinish(sys->queue);
-  CHKERROR(err<0,"Coudn't create/configure measure kernel");
+  return err;
 }
 
-void
-cls_run_init(oclSys sys)
+static struct cls_buffer*
+cls_find_buffer(oclSys sys, char *name)
 {
-  cl_int err=0;
-  clEnqueueNDRangeKernel(sys->queue, sys->init_k, sys->init_d.dim, NULL,
-    sys->init_d.global, sys->init_d.local, 0, NULL, NULL);
-  sys->state&=~0x01;
-  CHKERROR(err<0,"Coudn't enqueue init kernel");
+  for(size_t b = 0; b < sys->bufs_n; b++)
+  {
+    if(strcmp(sys->bufs[b].name, name)==0) return &sys->bufs[b];
+  }
+  PINFORM("No buffer named %s\n", name);
+  exit(1);
 }
 
 void
-cls_run_update(oclSys sys)
+cls_add_buffer(oclSys sys, char *name, cls_role role, size_t size, void *data)
 {
   cl_int err=0;
-  if(~sys->state&0x01)
+  cl_char ozero = 0;
+
+  CHKERROR(strlen(name)>=CLS_NAME_LEN, "Buffer name is too long");
+  CHKERROR(sys->native!=NULL, "Named buffers need an OpenCL system");
+  sys->bufs = (struct cls_buffer*)realloc(sys->bufs, (sys->bufs_n+1)*sizeof(struct cls_buffer));
+  struct cls_buffer *buf = &sys->bufs[sys->bufs_n++];
+
+  strcpy(buf->name, name);
+  buf->role = role;
+  buf->size = size;
+  buf->mem[0] = clCreateBuffer(sys->context, CL_MEM_READ_WRITE, size, NULL, &err);
+  buf->mem[1] = buf->mem[0];
+  if((role==CLS_BUF_STATE)&&(sys->mode!=CLS_MODE_INPLACE))
   {
-    err|=clEnqueueNDRangeKernel(sys->queue, sys->main_k[0], sys->main_d.dim, NULL,
-      sys->main_d.global, sys->main_d.local, 0, NULL, NULL);
+    buf->mem[1] = clCreateBuffer(sys->context, CL_MEM_READ_WRITE, size, NULL, &err);
   }
-  else
+  CHKERROR(err<0, "Couldn't create named buffer");
+
+  if(data!=NULL)
   {
-    err|=clEnqueueNDRangeKernel(sys->queue, sys->main_k[1], sys->main_d.dim, NULL,
-      sys->main_d.global, sys->main_d.local, 0, NULL, NULL);
+    err |= clEnqueueWriteBuffer(sys->queue, buf->mem[0], CL_FALSE, 0, size, data, 0, NULL,
+      cls_prof_ev(sys, CLS_Q_MAIN, NULL, "write buffer", size));
   }
-  sys->state^=1;
-  CHKERROR(err<0,"Coudn't enqueue main kernel");
-}
-
-void
-cls_run_meas(oclSys sys)
-{
-  cl_int err=0;
-  if(~sys->state&0x01)
+  else if(role==CLS_BUF_OUTPUT)
   {
-    err|=clEnqueueNDRangeKernel(sys->queue, sys->meas_k[0], sys->meas_d.dim, NULL,
-      sys->meas_d.global, sys->meas_d.local, 0, NULL, NULL);
+    err |= clEnqueueFillBuffer(sys->queue, buf->mem[0], &ozero, 1, 0, size, 0, NULL,
+      cls_prof_ev(sys, CLS_Q_MAIN, NULL, "fill buffer", size));
   }
-  else
+
+  if(sys->program!=NULL) // kernels already exist
   {
-    err|=clEnqueueNDRangeKernel(sys->queue, sys->meas_k[1], sys->meas_d.dim, NULL,
-      sys->meas_d.global, sys->meas_d.local, 0, NULL, NULL);
+    err |= cls_bind_buffers(sys);
   }
-  CHKERROR(err<0,"Coudn't enqueue measure kernel");
+  CHKERROR(err<0, "Couldn't configure named buffer");
+}
+
+void
+cls_write_buffer(oclSys sys, char *name, void *data)
+{
+  struct cls_buffer *buf = cls_find_buffer(sys, name);
+  cl_int err = clEnqueueWriteBuffer(sys->queue, buf->mem[sys->state&0x01], CL_FALSE, 0,
+    buf->size, data, 0, NULL, cls_prof_ev(sys, CLS_Q_MAIN, NULL, "write buffer", buf->size));
+  CHKERROR(err<0, "Couldn't write named buffer");
 }
 
 size_t
-cls_get_meas(oclSys sys, void *out)
+cls_read_buffer(oclSys sys, char *name, void *out)
 {
-  cl_int err=0;
+  struct cls_buffer *buf = cls_find_buffer(sys, name);
+  cl_int err = clEnqueueReadBuffer(sys->queue, buf->mem[sys->state&0x01], CL_TRUE, 0,
+    buf->size, out, 0, NULL, cls_prof_ev(sys, CLS_Q_MAIN, NULL, "read buffer", buf->size));
+  CHKERROR(err<0, "Couldn't read named buffer");
+  return buf->size;
+}
 
-  // if(out!=NULL)
-  // {
-    err|=clFlush(sys->queue);
-    err|=clFinish(sys->queue);
-    err|= clEnqueueReadBuffer(sys->queue, sys->output_b, CL_TRUE, 0,
-      sys->output_s, out, 0, NULL, NULL);
-  // }
+// FNV-1a, chained over every part of the cache key
+static cl_ulong
+cls_hash(cl_ulong h, const void *data, size_t size)
+{
+  const unsigned char *p = data;
+  for(size_t i = 0; i < size; i++) h = (h^p[i])*0x100000001b3ull;
+  return h;
+}
 
-  CHKERROR(err<0,"Coudn't read output data");
-  return sys->output_s;
+static cl_ulong
+cls_hash_str(cl_ulong h, const char *str)
+{
+  size_t len = strlen(str);
+  h = cls_hash(h, &len, sizeof(len));
+  return cls_hash(h, str, len);
 }
 
-void
-cls_release_sys(oclSys sys)
+static char*
+cls_read_file(const char *filename, size_t *size)
 {
-  if(sys->program) {clReleaseProgram(sys->program); sys->program=NULL;}
+  FILE *fh = fopen(filename, "rb");
+  if(fh==NULL) return NULL;
+
+  fseek(fh, 0, SEEK_END);
+  *size = ftell(fh);
+  rewind(fh);
+  char *buff = (char*)malloc(*size + 1);
+  *size = fread(buff, 1, *size, fh);
+  buff[*size] = '\0';
+  fclose(fh);
+  return buff;
+}
+
+// New temporary file next to path, opened for writing, its name left in
+// tmp_path. mkstemp gives every writer its own, threads of one process included.
+static FILE*
+cls_open_tmp(char *tmp_path, size_t tmp_s, const char *path)
+{
+  if(snprintf(tmp_path, tmp_s, "%s.XXXXXX", path)>=tmp_s) return NULL;
+  int fd = mkstemp(tmp_path);
+  if(fd<0) return NULL;
+
+  FILE *fh = fdopen(fd, "wb");
+  if(fh==NULL) {close(fd); remove(tmp_path);}
+  return fh;
+}
+
+// Hashes the files pulled in with #include "..." (relative to -I.), recursively
+static cl_ulong
+cls_hash_includes(cl_ulong h, const char *src, int depth)
+{
+  if(depth>=CLS_INCLUDE_DEPTH) return h;
+
+  for(const char *line = src; line!=NULL; line = strchr(line, '\n'))
+  {
+    char inc[256];
+    while(*line=='\n'||*line==' '||*line=='\t') line++;
+    if(sscanf(line, "#include \"%255[^\"]\"", inc)!=1) continue;
+
+    size_t inc_s;
+    char *inc_src = cls_read_file(inc, &inc_s);
+    h = cls_hash_str(h, inc);
+    if(inc_src==NULL) continue; // system or missing header, the name still counts
+    h = cls_hash(h, inc_src, inc_s);
+    h = cls_hash_includes(h, inc_src, depth+1);
+    free(inc_src);
+  }
+  return h;
+}
+
+static cl_ulong
+cls_cache_key(oclSys sys, const char *src, const char *opts)
+{
+  cl_ulong h = 0xcbf29ce484222325ull;
+  char info[256];
+
+  h = cls_hash_str(h, src);
+  h = cls_hash_includes(h, src, 0);
+  h = cls_hash_str(h, opts);
+
+  clGetPlatformInfo(sys->platform, CL_PLATFORM_NAME, sizeof(info), info, NULL);
+  h = cls_hash_str(h, info);
+  clGetPlatformInfo(sys->platform, CL_PLATFORM_VERSION, sizeof(info), info, NULL);
+  h = cls_hash_str(h, info);
+  clGetDeviceInfo(sys->device, CL_DEVICE_NAME, sizeof(info), info, NULL);
+  h = cls_hash_str(h, info);
+  clGetDeviceInfo(sys->device, CL_DEVICE_VERSION, sizeof(info), info, NULL);
+  h = cls_hash_str(h, info);
+  clGetDeviceInfo(sys->device, CL_DRIVER_VERSION, sizeof(info), info, NULL);
+  h = cls_hash_str(h, info);
+
+  return h;
+}
+
+// Cache file: magic, key, binary size, arg table size, binary, arg table
+struct cls_cache_hdr
+{
+  char magic[8];
+  cl_ulong key;
+  cl_ulong bin_s;
+  cl_ulong info_s;
+};
+
+static const char*
+cls_cache_dir(void)
+{
+  const char *dir = getenv("OCLSIM_CACHE");
+  if(dir==NULL) dir = CLS_CACHE_DIR;
+  if(*dir=='\0') return NULL;
+
+  mkdir(dir, 0755); // may already exist
+  return dir;
+}
+
+static int
+cls_cache_path(char *path, size_t path_s, cl_ulong key)
+{
+  const char *dir = cls_cache_dir();
+  if(dir==NULL) return 0;
+  return snprintf(path, path_s, "%s/%016llx.bin", dir, (unsigned long long)key)<path_s;
+}
+
+static cl_program
+cls_cache_load(oclSys sys, cl_ulong key, const char *opts)
+{
+  char path[512];
+  size_t file_s;
+  char *file;
+
+  if(!cls_cache_path(path, sizeof(path), key)) return NULL;
+  if((file = cls_read_file(path, &file_s))==NULL) return NULL;
+
+  struct cls_cache_hdr *hdr = (struct cls_cache_hdr*)file;
+  if((file_s<sizeof(*hdr))||memcmp(hdr->magic, CLS_CACHE_MAGIC, 8)||(hdr->key!=key)||
+     (sizeof(*hdr) + hdr->bin_s + hdr->info_s!=file_s))
+  {
+    free(file);
+    return NULL;
+  }
+
+  cl_int err=0, bin_err;
+  const unsigned char *bin = (unsigned char*)file + sizeof(*hdr);
+  size_t bin_s = hdr->bin_s;
+  cl_program program = clCreateProgramWithBinary(sys->context, 1, &sys->device,
+    &bin_s, &bin, &bin_err, &err);
+  if((err>=0)&&(bin_err>=0)) err = clBuildProgram(program, 0, NULL, opts, NULL, NULL);
+  if((err<0)||(bin_err<0))
+  {
+    if(program) clReleaseProgram(program);
+    free(file);
+    return NULL; // rebuilt from source and overwritten
+  }
+
+  free(sys->arg_info);
+  sys->arg_info = strndup(file + sizeof(*hdr) + hdr->bin_s, hdr->info_s);
+  free(file);
+  PINFORM("Loaded program binary from %s\n", path);
+  return program;
+}
+
+static void
+cls_cache_store(oclSys sys, cl_program program, cl_ulong key)
+{
+  char path[512], tmp_path[544];
+  size_t bin_s;
+  cl_uint kernels_n;
+
+  if(!cls_cache_path(path, sizeof(path), key)) return;
+  if(clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(bin_s), &bin_s, NULL)<0) return;
+  if(clCreateKernelsInProgram(program, 0, NULL, &kernels_n)<0) return;
+
+  unsigned char *bin = (unsigned char*)malloc(bin_s);
+  cl_kernel kernels[kernels_n];
+  size_t info_s = 0, info_cap = 1024;
+  char *info = (char*)malloc(info_cap);
+  cl_int err = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(bin), &bin, NULL);
+  err |= clCreateKernelsInProgram(program, kernels_n, kernels, NULL);
+
+  for(cl_uint k = 0; (k < kernels_n)&&(err>=0); k++)
+  {
+    char kname[CLS_NAME_LEN], arg_name[CLS_NAME_LEN+8];
+    cl_uint args_n;
+    cl_kernel_arg_address_qualifier aq;
+
+    err |= clGetKernelInfo(kernels[k], CL_KERNEL_FUNCTION_NAME, sizeof(kname), kname, NULL);
+    err |= clGetKernelInfo(kernels[k], CL_KERNEL_NUM_ARGS, sizeof(args_n), &args_n, NULL);
+    for(cl_uint a = 0; (a < args_n)&&(err>=0); a++)
+    {
+      err |= clGetKernelArgInfo(kernels[k], a, CL_KERNEL_ARG_NAME, sizeof(arg_name), arg_name, NULL);
+      err |= clGetKernelArgInfo(kernels[k], a, CL_KERNEL_ARG_ADDRESS_QUALIFIER, sizeof(aq), &aq, NULL);
+      if(info_cap-info_s<2*CLS_NAME_LEN+32) info = (char*)realloc(info, info_cap *= 2);
+      info_s += sprintf(info + info_s, "%s %u %u %s\n", kname, a, (cl_uint)aq, arg_name);
+    }
+  }
+  for(cl_uint k = 0; k < kernels_n; k++) clReleaseKernel(kernels[k]);
+
+  // Written under a temporary name and renamed, for concurrent runs
+  struct cls_cache_hdr hdr = {.magic = CLS_CACHE_MAGIC, .key = key, .bin_s = bin_s, .info_s = info_s};
+  FILE *fh = (err>=0) ? cls_open_tmp(tmp_path, sizeof(tmp_path), path) : NULL;
+  if(fh!=NULL)
+  {
+    int ok = (fwrite(&hdr, sizeof(hdr), 1, fh)==1)&&(fwrite(bin, 1, bin_s, fh)==bin_s)&&
+             (fwrite(info, 1, info_s, fh)==info_s);
+    ok &= fclose(fh)==0;
+    if(!ok||(rename(tmp_path, path)!=0)) remove(tmp_path);
+  }
+
+  free(info);
+  free(bin);
+}
+
+// Builds src for the system device, going through the binary cache
+static cl_program
+cls_build_program(oclSys sys, char *src_str, const char *opts)
+{
+  cl_int err=0;
+  size_t src_size = strlen(src_str);
+  cl_ulong key = cls_cache_key(sys, src_str, opts);
+  cl_program program = cls_cache_load(sys, key, opts);
+
+  sys->prog_key = key;
+
+  if(program!=NULL) return program;
+
+  program = clCreateProgramWithSource(sys->context, 1,(const char**)
+                                      &src_str, &src_size, &err);
+  CHKERROR(err<0, "Couldn't create program");
+
+  err = clBuildProgram(program, 0, NULL, opts, NULL, NULL);
+  if(err < 0) // Print compilation log if fails for debugging code
+  {
+    size_t log_size;
+    clGetProgramBuildInfo(program, sys->device,
+                          CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+    char *log_buff = (char*)malloc(log_size + 1);
+    log_buff[log_size] = '\0';
+    clGetProgramBuildInfo(program, sys->device,
+                          CL_PROGRAM_BUILD_LOG, log_size, log_buff, NULL);
+    printf("%s\n", log_buff);
+    free(log_buff);
+    exit(1);
+  }
+
+  cls_cache_store(sys, program, key);
+  return program;
+}
+
+// Native systems load their engine instead, the source is not used
+static void
+cls_load_native(oclSys sys, size_t states_size)
+{
+  CHKERROR(sys->native_eng!=NULL, "Native engine is already loaded");
+  sys->states_s = states_size;
+  sys->native_eng = sys->native->load(sys->defines ? sys->defines : "", states_size);
+  CHKERROR(sys->native_eng==NULL, "Couldn't load native engine");
+}
+
+void
+cls_load_sys_from_str(oclSys sys, char *src_str, size_t states_size)
+{
+  cl_int err=0;
+
+  if(sys->native) {cls_load_native(sys, states_size); return;}
+
+  size_t opts_s = strlen(CLS_BUILD_OPTS) + (sys->defines ? strlen(sys->defines) : 0) + 1;
+  char opts[opts_s];
+  snprintf(opts, opts_s, "%s%s", CLS_BUILD_OPTS, sys->defines ? sys->defines : "");
+  sys->program = cls_build_program(sys, src_str, opts);
+
+  sys->init_k = clCreateKernel(sys->program, INIT_K_NAME, &err);
+  sys->main_k[0] = clCreateKernel(sys->program, MAIN_K_NAME, &err);
+  sys->main_k[1] = clCreateKernel(sys->program, MAIN_K_NAME, &err);
+  sys->meas_k[0] = clCreateKernel(sys->program, MEASURE_K_NAME, &err);
+  sys->meas_k[1] = clCreateKernel(sys->program, MEASURE_K_NAME, &err);
+
+  sys->states_s = states_size;
+  sys->states_b[0] = clCreateBuffer(sys->context, CL_MEM_READ_WRITE, states_size, NULL, &err);
+  if(sys->mode==CLS_MODE_INPLACE) // both parities alias the single buffer
+  {
+    sys->states_b[1] = sys->states_b[0];
+    err |= clRetainMemObject(sys->states_b[1]);
+  }
+  else
+  {
+    sys->states_b[1] = clCreateBuffer(sys->context, CL_MEM_READ_WRITE, states_size, NULL, &err);
+  }
+  CHKERROR(err, "Couldn't load system kernels/state buffers");
+
+  err = cls_bind_buffers(sys);
+  CHKERROR(err<0, "Couldn't bind named buffers");
+}
+
+void
+cls_define(oclSys sys, char *name, long value)
+{
+  CHKERROR((sys->program!=NULL)||(sys->native_eng!=NULL), "Defines must be set before loading");
+
+  size_t old_s = sys->defines ? strlen(sys->defines) : 0;
+  size_t add_s = snprintf(NULL, 0, " -D %s=%ld", name, value);
+  sys->defines = (char*)realloc(sys->defines, old_s + add_s + 1);
+  snprintf(sys->defines + old_s, add_s + 1, " -D %s=%ld", name, value);
+}
+
+void
+cls_set_mode(oclSys sys, cls_mode mode)
+{
+  CHKERROR(sys->states_b[0]!=NULL, "Execution mode must be set before loading");
+  sys->mode = mode;
+}
+
+void
+cls_load_sys_from_file(oclSys sys, char *src_filename, size_t states_size)
+{
+  if(sys->native) {cls_load_native(sys, states_size); return;}
+
+  FILE *src_fh = fopen(src_filename, "r");
+  char *src_buff;
+  size_t src_size;
+
+  CHKERROR(src_fh==NULL, "Couldn't open .cl src file");
+  fseek(src_fh, 0, SEEK_END);
+  src_size = ftell(src_fh);
+  rewind(src_fh);
+  src_buff = (char*)malloc(src_size + 1);
+  src_buff[src_size] = '\0';
+  fread(src_buff, sizeof(char), src_size, src_fh); // Copy src to buffer
+  fclose(src_fh);
+  cls_load_sys_from_str(sys, src_buff, states_size);
+  free(src_buff);
+}
+
+// Writes an argument struct without blocking. The contents are copied first, so
+// the caller may reuse arg at once; unchanged arguments are not written again.
+static cl_int
+cls_upload_arg(oclSys sys, cl_mem arg_b, struct cls_arg *a, void *arg, size_t arg_s, int fresh)
+{
+  cl_int err=0;
+
+  if(!fresh&&(a->host!=NULL)&&!memcmp(a->host, arg, arg_s)) return 0;
+
+  if(a->ev) // previous write still reads from the copy
+  {
+    err |= clWaitForEvents(1, &a->ev);
+    clReleaseEvent(a->ev);
+    a->ev = NULL;
+  }
+  a->host = realloc(a->host, arg_s);
+  memcpy(a->host, arg, arg_s);
+  err |= clEnqueueWriteBuffer(sys->queue, arg_b, CL_FALSE, 0, arg_s, a->host, 0, NULL, &a->ev);
+  cls_prof_add(sys, CLS_Q_MAIN, NULL, "write arg", arg_s, a->ev);
+
+  return err;
+}
+
+static void
+cls_drop_arg(struct cls_arg *a)
+{
+  if(a->ev) {clWaitForEvents(1, &a->ev); clReleaseEvent(a->ev); a->ev=NULL;}
+  free(a->host);
+  a->host = NULL;
+}
+
+// Native systems hand the argument struct to the engine, the dims are only
+// kept for cls_autotune
+static void
+cls_native_arg(oclSys sys, cls_step step, void *arg, size_t arg_s, dims_i *d, dims_i dims)
+{
+  CHKERROR(sys->native_eng==NULL, "Native engine must be loaded before its arguments");
+  *d = dims;
+  sys->native->set_arg(sys->native_eng, step, arg, arg_s);
+}
+
+void
+cls_set_init_arg(oclSys sys, void* arg, size_t arg_s, dims_i dims)
+{
+  cl_int err=0;
+  char rebind = dims_differ(sys->init_d, dims);
+
+  if(sys->native) {cls_native_arg(sys, CLS_STEP_INIT, arg, arg_s, &sys->init_d, dims); return;}
+
+  if((sys->init_arg_s!=arg_s)||(sys->init_arg_b==NULL))
+  {
+    if(sys->init_arg_b!=NULL)
+    {
+      clReleaseMemObject(sys->init_arg_b);
+      sys->init_arg_b=NULL;
+    }
+    sys->init_arg_s = arg_s;
+    sys->init_arg_b = clCreateBuffer(sys->context, CL_MEM_READ_ONLY, arg_s, NULL, &err);
+    rebind = 1;
+  }
+
+  sys->bind_gen += rebind;
+  sys->init_d = dims;
+  err |= clSetKernelArg(sys->init_k, 0, sizeof(cl_mem), &sys->states_b[0]);
+  err |= clSetKernelArg(sys->init_k, 1, sizeof(cl_mem), &sys->init_arg_b);
+  err |= cls_upload_arg(sys, sys->init_arg_b, &sys->init_arg_h, arg, arg_s, rebind);
+
+  CHKERROR(err<0,"Coudn't configure init kernel");
+}
+
+void
+cls_set_init_kernel(oclSys sys, char *name)
+{
+  cl_int err=0;
+
+  CHKERROR(sys->native!=NULL, "Native systems run their engine's steps only");
+
+  if(sys->init_k) {clReleaseKernel(sys->init_k); sys->init_k=NULL;}
+  sys->init_k = clCreateKernel(sys->program, name, &err);
+  CHKERROR(err<0,"Couldn't create selected init kernel");
+
+  if(sys->init_arg_b!=NULL) // keep previously configured arguments
+  {
+    err |= clSetKernelArg(sys->init_k, 0, sizeof(cl_mem), &sys->states_b[0]);
+    err |= clSetKernelArg(sys->init_k, 1, sizeof(cl_mem), &sys->init_arg_b);
+  }
+  err |= cls_bind_buffers(sys);
+
+  CHKERROR(err<0,"Coudn't configure selected init kernel");
+}
+
+static cl_int
+cls_bind_main_args(oclSys sys)
+{
+  cl_int err=0;
+
+  err |= clSetKernelArg(sys->main_k[0], 0, sizeof(cl_mem), &sys->states_b[1]);
+  err |= clSetKernelArg(sys->main_k[0], 1, sizeof(cl_mem), &sys->states_b[0]);
+  err |= clSetKernelArg(sys->main_k[0], 2, sys->main_local_s, NULL);
+  err |= clSetKernelArg(sys->main_k[0], 3, sizeof(cl_mem), &sys->main_arg_b);
+
+  err |= clSetKernelArg(sys->main_k[1], 0, sizeof(cl_mem), &sys->states_b[0]);
+  err |= clSetKernelArg(sys->main_k[1], 1, sizeof(cl_mem), &sys->states_b[1]);
+  err |= clSetKernelArg(sys->main_k[1], 2, sys->main_local_s, NULL);
+  err |= clSetKernelArg(sys->main_k[1], 3, sizeof(cl_mem), &sys->main_arg_b);
+
+  if(sys->mode==CLS_MODE_INPLACE) // sublattice color follows the parity
+  {
+    cl_uint color[2] = {0, 1};
+    err |= clSetKernelArg(sys->main_k[0], 4, sizeof(cl_uint), &color[0]);
+    err |= clSetKernelArg(sys->main_k[1], 4, sizeof(cl_uint), &color[1]);
+  }
+
+  return err;
+}
+
+void
+cls_set_main_arg(oclSys sys, void* arg, size_t arg_s, size_t local_s, dims_i dims)
+{
+  cl_int err=0;
+
+  if(sys->native) {cls_native_arg(sys, CLS_STEP_UPDATE, arg, arg_s, &sys->main_d, dims); return;}
+  if(sys->mode==CLS_MODE_INPLACE) // only the active sublattice is launched
+  {
+    CHKERROR((dims.global[0]%2)||((dims.global[0]/2)%dims.local[0]),
+      "Sublattice range is not divisible by the local range");
+    dims.global[0] /= 2;
+  }
+
+  char rebind = dims_differ(sys->main_d, dims)||(sys->main_local_s!=local_s);
+
+  if((sys->main_arg_s!=arg_s)||(sys->main_arg_b==NULL))
+  {
+    if(sys->main_arg_b!=NULL)
+    {
+      clReleaseMemObject(sys->main_arg_b);
+      sys->main_arg_b=NULL;
+    }
+    sys->main_arg_s = arg_s;
+    sys->main_arg_b = clCreateBuffer(sys->context, CL_MEM_READ_ONLY, arg_s, NULL, &err);
+    rebind = 1;
+  }
+
+  sys->bind_gen += rebind;
+  sys->main_d = dims;
+  sys->main_local_s = local_s;
+
+  err |= cls_upload_arg(sys, sys->main_arg_b, &sys->main_arg_h, arg, arg_s, rebind);
+  err |= cls_bind_main_args(sys);
+
+  CHKERROR(err<0,"Coudn't create/configure update kernel");
+}
+
+void
+cls_set_main_kernel(oclSys sys, char *name)
+{
+  cl_int err=0;
+
+  CHKERROR(sys->native!=NULL, "Native systems run their engine's steps only");
+
+  if(sys->main_k[0]) {clReleaseKernel(sys->main_k[0]); sys->main_k[0]=NULL;}
+  if(sys->main_k[1]) {clReleaseKernel(sys->main_k[1]); sys->main_k[1]=NULL;}
+  sys->main_k[0] = clCreateKernel(sys->program, name, &err);
+  CHKERROR(err<0,"Couldn't create selected update kernel");
+  sys->main_k[1] = clCreateKernel(sys->program, name, &err);
+  CHKERROR(err<0,"Couldn't create selected update kernel");
+
+  if(sys->main_arg_b!=NULL) // keep previously configured arguments
+  {
+    err |= cls_bind_main_args(sys);
+  }
+  err |= cls_bind_buffers(sys);
+
+  CHKERROR(err<0,"Coudn't configure selected update kernel");
+}
+
+static cl_int
+cls_bind_meas_args(oclSys sys)
+{
+  cl_int err=0;
+
+  for(int p = 0; p < 2; p++)
+  {
+    err |= clSetKernelArg(sys->meas_k[p], 0, sizeof(cl_mem), &sys->output_b);
+    err |= clSetKernelArg(sys->meas_k[p], 1, sizeof(cl_mem), &sys->states_b[p]);
+    err |= clSetKernelArg(sys->meas_k[p], 2, sys->meas_local_s, NULL);
+    err |= clSetKernelArg(sys->meas_k[p], 3, sizeof(cl_mem), &sys->meas_arg_b);
+  }
+
+  return err;
+}
+
+void
+cls_set_meas_kernel(oclSys sys, char *name)
+{
+  cl_int err=0;
+
+  CHKERROR(sys->native!=NULL, "Native systems run their engine's steps only");
+
+  if(sys->meas_k[0]) {clReleaseKernel(sys->meas_k[0]); sys->meas_k[0]=NULL;}
+  if(sys->meas_k[1]) {clReleaseKernel(sys->meas_k[1]); sys->meas_k[1]=NULL;}
+  sys->meas_k[0] = clCreateKernel(sys->program, name, &err);
+  CHKERROR(err<0,"Couldn't create selected measure kernel");
+  sys->meas_k[1] = clCreateKernel(sys->program, name, &err);
+  CHKERROR(err<0,"Couldn't create selected measure kernel");
+
+  if(sys->meas_arg_b!=NULL) // keep previously configured arguments
+  {
+    err |= cls_bind_meas_args(sys);
+  }
+  err |= cls_bind_buffers(sys);
+
+  CHKERROR(err<0,"Coudn't configure selected measure kernel");
+}
+
+void
+cls_set_meas_arg(oclSys sys, void* arg, size_t arg_s, size_t local_s, size_t meas_s, dims_i dims)
+{
+  cl_int err=0;
+  char rebind = dims_differ(sys->meas_d, dims)||(sys->meas_local_s!=local_s);
+
+  if(sys->native)
+  {
+    sys->output_s = meas_s;
+    cls_native_arg(sys, CLS_STEP_MEAS, arg, arg_s, &sys->meas_d, dims);
+    return;
+  }
+
+  if((sys->meas_arg_s!=arg_s)||(sys->meas_arg_b==NULL))
+  {
+    if(sys->meas_arg_b!=NULL)
+    {
+      clReleaseMemObject(sys->meas_arg_b);
+      sys->meas_arg_b=NULL;
+    }
+    sys->meas_arg_s = arg_s;
+    sys->meas_arg_b = clCreateBuffer(sys->context, CL_MEM_READ_ONLY, arg_s, NULL, &err);
+    rebind = 1;
+  }
+
+  if((sys->output_s!=meas_s)||(sys->output_b==NULL))
+  {
+    CHKERROR(sys->stream_map!=NULL, "Output buffer resized while streaming");
+    if(sys->output_b!=NULL)
+    {
+      clReleaseMemObject(sys->output_b);
+      sys->output_b=NULL;
+    }
+    sys->output_s = meas_s;
+    sys->output_b = clCreateBuffer(sys->context, CL_MEM_READ_WRITE, meas_s, NULL, &err);
+    rebind = 1;
+  }
+
+  sys->bind_gen += rebind;
+  sys->meas_d = dims;
+  sys->meas_local_s = local_s;
+
+  cl_char ozero = 0;
+
+  err |= cls_upload_arg(sys, sys->meas_arg_b, &sys->meas_arg_h, arg, arg_s, rebind);
+  err |= clEnqueueFillBuffer(sys->queue, sys->output_b, &ozero, 1, 0, meas_s, 0, NULL,
+    cls_prof_ev(sys, CLS_Q_MAIN, NULL, "fill output", meas_s));
+
+  err |= cls_bind_meas_args(sys);
+
+  CHKERROR(err<0,"Coudn't create/configure measure kernel");
+}
+
+struct graph_node
+{
+  cl_kernel kernel[2]; // by parity, like main_k
+  dims_i dims;
+  size_t local_s;
+  int swap;
+  cl_ulong deps; // direct dependencies
+  cl_ulong anc; // all ancestors
+  cl_event ev;
+};
+
+struct oclsim_graph
+{
+  oclSys sys;
+  cl_command_queue queue; // out-of-order when supported, else sys->queue
+  struct graph_node nodes[CLS_GRAPH_MAX];
+  int nodes_n;
+  unsigned int bind_gen;
+};
+
+static cl_int
+cls_enq_init(oclSys sys)
+{
+  if(sys->native) {sys->native->run(sys->native_eng, CLS_STEP_INIT); return 0;}
+
+  cl_int err = clEnqueueNDRangeKernel(sys->queue, sys->init_k, sys->init_d.dim, NULL,
+    sys->init_d.global, sys->init_d.local, 0, NULL,
+    cls_prof_ev(sys, CLS_Q_MAIN, sys->init_k, NULL, 0));
+  sys->state&=~0x01;
+  return err;
+}
+
+static cl_int
+cls_enq_update(oclSys sys)
+{
+  if(sys->native) {sys->native->run(sys->native_eng, CLS_STEP_UPDATE); return 0;}
+
+  cl_kernel kernel = sys->main_k[sys->state&0x01];
+  cl_int err = clEnqueueNDRangeKernel(sys->queue, kernel, sys->main_d.dim, NULL,
+    sys->main_d.global, sys->main_d.local, 0, NULL, cls_prof_ev(sys, CLS_Q_MAIN, kernel, NULL, 0));
+  sys->state^=1;
+  return err;
+}
+
+static cl_int cls_stream_drain(oclSys sys, size_t frames);
+static void cls_open_xfer_queue(oclSys sys);
+
+static cl_int
+cls_enq_meas(oclSys sys)
+{
+  if(sys->native) {sys->native->run(sys->native_eng, CLS_STEP_MEAS); return 0;}
+  if(sys->stream_map==NULL)
+  {
+    return clEnqueueNDRangeKernel(sys->queue, sys->meas_k[sys->state&0x01],
+      sys->meas_d.dim, NULL, sys->meas_d.global, sys->meas_d.local, 0, NULL,
+      cls_prof_ev(sys, CLS_Q_MAIN, sys->meas_k[sys->state&0x01], NULL, 0));
+  }
+
+  // Streaming: the kernel gets its ring slot, and waits for the previous drain
+  // of that part of the ring before overwriting it
+  cl_int err=0;
+  cl_uint slot = sys->stream_frames%sys->stream_ring_n;
+  cl_event *drain_ev = &sys->stream_ev[slot/sys->stream_chunk_n];
+  cl_uint wait_n = (*drain_ev!=NULL)&&(slot%sys->stream_chunk_n==0);
+
+  err |= clSetKernelArg(sys->meas_k[sys->state&0x01], 4, sizeof(cl_uint), &slot);
+  err |= clEnqueueNDRangeKernel(sys->queue, sys->meas_k[sys->state&0x01],
+    sys->meas_d.dim, NULL, sys->meas_d.global, sys->meas_d.local,
+    wait_n, wait_n ? drain_ev : NULL,
+    cls_prof_ev(sys, CLS_Q_MAIN, sys->meas_k[sys->state&0x01], NULL, 0));
+  if(wait_n) {clReleaseEvent(*drain_ev); *drain_ev=NULL;}
+
+  sys->stream_frames++;
+  if(sys->stream_frames%sys->stream_chunk_n==0) err |= cls_stream_drain(sys, sys->stream_chunk_n);
+  return err;
+}
+
+void
+cls_run_init(oclSys sys)
+{
+  cl_int err = cls_enq_init(sys);
+  CHKERROR(err<0,"Coudn't enqueue init kernel");
+}
+
+void
+cls_run_update(oclSys sys)
+{
+  cl_int err = cls_enq_update(sys);
+  CHKERROR(err<0,"Coudn't enqueue main kernel");
+}
+
+void
+cls_run_meas(oclSys sys)
+{
+  cl_int err = cls_enq_meas(sys);
+  CHKERROR(err<0,"Coudn't enqueue measure kernel");
+}
+
+void
+cls_run_update_n(oclSys sys, size_t n)
+{
+  cl_int err=0;
+  for(size_t i = 0; i < n; i++)
+  {
+    err|=cls_enq_update(sys);
+  }
+  CHKERROR(err<0,"Coudn't enqueue main kernel");
+}
+
+void
+cls_finish(oclSys sys)
+{
+  if(sys->native) return; // every step ran before its call returned
+
+  cl_int err = clFinish(sys->queue);
+  if(sys->xfer_queue!=NULL) err |= clFinish(sys->xfer_queue);
+  CHKERROR(err<0,"Couldn't finish queued work");
+}
+
+// Work-group size autotuning. Results are kept in the cache directory, one
+// "key l0 l1 l2" line per kernel configuration, keyed by the program (source,
+// options and device), the kernel name, the step, the global range and the
+// local memory size.
+static cl_ulong
+cls_tune_key(oclSys sys, cl_kernel kernel, cls_step step, dims_i *d, size_t local_s)
+{
+  char kname[CLS_NAME_LEN] = "";
+  cl_ulong h = sys->prog_key;
+
+  clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(kname), kname, NULL);
+  h = cls_hash_str(h, kname);
+  h = cls_hash(h, &step, sizeof(step));
+  h = cls_hash(h, &sys->mode, sizeof(sys->mode));
+  h = cls_hash(h, &d->dim, sizeof(d->dim));
+  h = cls_hash(h, d->global, sizeof(d->global));
+  return cls_hash(h, &local_s, sizeof(local_s));
+}
+
+static int
+cls_tune_path(char *path, size_t path_s)
+{
+  const char *dir = cls_cache_dir();
+  if(dir==NULL) return 0;
+  return snprintf(path, path_s, "%s/%s", dir, CLS_TUNE_FILE)<path_s;
+}
+
+static int
+cls_tune_load(cl_ulong key, size_t *local)
+{
+  char path[512], line[128];
+  unsigned long long line_k;
+  size_t l[3];
+  int found = 0;
+
+  if(!cls_tune_path(path, sizeof(path))) return 0;
+  FILE *fh = fopen(path, "r");
+  if(fh==NULL) return 0;
+
+  while(fgets(line, sizeof(line), fh)!=NULL) // later entries win
+  {
+    if((sscanf(line, "%llx %zu %zu %zu", &line_k, &l[0], &l[1], &l[2])==4)&&(line_k==key))
+    {
+      memcpy(local, l, sizeof(l));
+      found = 1;
+    }
+  }
+  fclose(fh);
+  return found;
+}
+
+static void
+cls_tune_store(cl_ulong key, size_t *local)
+{
+  char path[512];
+
+  if(!cls_tune_path(path, sizeof(path))) return;
+  FILE *fh = fopen(path, "a"); // one short append per entry, safe for concurrent runs
+  if(fh==NULL) return;
+  fprintf(fh, "%016llx %zu %zu %zu\n", (unsigned long long)key, local[0], local[1], local[2]);
+  fclose(fh);
+}
+
+// Device time of CLS_TUNE_LAUNCHES launches with the local range l, or 0 if
+// the shape is rejected. The launch count is even, so the parity is kept.
+static cl_ulong
+cls_tune_time(oclSys sys, cls_step step, dims_i *d, size_t *l)
+{
+  cl_event ev[2] = {NULL, NULL};
+  cl_ulong start = 0, end = 0;
+  cl_int err=0;
+
+  for(int i = 0; (i < CLS_TUNE_LAUNCHES)&&(err>=0); i++)
+  {
+    cl_kernel kernel = (step==CLS_STEP_INIT) ? sys->init_k : sys->main_k[(sys->state^i)&0x01];
+    err |= clEnqueueNDRangeKernel(sys->queue, kernel, d->dim, NULL, d->global, l, 0, NULL,
+      (i==0) ? &ev[0] : (i==CLS_TUNE_LAUNCHES-1) ? &ev[1] : NULL);
+  }
+  err |= clFinish(sys->queue);
+  if((err>=0)&&(ev[1]!=NULL))
+  {
+    err |= clGetEventProfilingInfo(ev[0], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+    err |= clGetEventProfilingInfo(ev[1], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+  }
+  if(ev[0]) clReleaseEvent(ev[0]);
+  if(ev[1]) clReleaseEvent(ev[1]);
+
+  return ((err<0)||(end<=start)) ? 0 : end - start;
+}
+
+// Powers of two along the first two dimensions that divide the global range
+// and fit the device and kernel limits. Groups smaller than the preferred multiple are skipped,
+// the configured shape is always a candidate.
+static int
+cls_tune_shapes(oclSys sys, cl_kernel kernel, dims_i *d, size_t shapes[][3])
+{
+  size_t item_max[3] = {1, 1, 1}, group_max = 1, pref = 1;
+  int n = 0;
+  cl_int err=0;
+
+  err |= clGetDeviceInfo(sys->device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(item_max), item_max, NULL);
+  err |= clGetKernelWorkGroupInfo(kernel, sys->device, CL_KERNEL_WORK_GROUP_SIZE,
+    sizeof(group_max), &group_max, NULL);
+  err |= clGetKernelWorkGroupInfo(kernel, sys->device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+    sizeof(pref), &pref, NULL);
+  CHKERROR(err<0, "Couldn't query work-group limits");
+
+  memcpy(shapes[n++], d->local, sizeof(d->local));
+  for(size_t l0 = 1; (l0 <= d->global[0])&&(l0 <= item_max[0]); l0 *= 2)
+  {
+    for(size_t l1 = 1; (l1 <= (d->dim>1 ? d->global[1] : 1))&&(l1 <= item_max[1]); l1 *= 2)
+    {
+      size_t group = l0*l1;
+      if((d->global[0]%l0)||((d->dim>1)&&(d->global[1]%l1))||(group>group_max)) continue;
+      if((group<((pref<group_max) ? pref : group_max))||(n==CLS_TUNE_MAX)) continue;
+      if((l0==d->local[0])&&(l1==(d->dim>1 ? d->local[1] : 1))) continue;
+      shapes[n][0] = l0;
+      shapes[n][1] = (d->dim>1) ? l1 : 0;
+      shapes[n][2] = (d->dim>2) ? 1 : 0;
+      n++;
+    }
+  }
+  return n;
+}
+
+dims_i
+cls_autotune(oclSys sys, cls_step step)
+{
+  CHKERROR(step==CLS_STEP_MEAS, "Measurement kernels can't be autotuned");
+  if(sys->native) return (step==CLS_STEP_INIT) ? sys->init_d : sys->main_d; // no local range
+  cl_kernel kernel = (step==CLS_STEP_INIT) ? sys->init_k : sys->main_k[sys->state&0x01];
+  dims_i *d = (step==CLS_STEP_INIT) ? &sys->init_d : &sys->main_d;
+  size_t local_s = (step==CLS_STEP_INIT) ? 0 : sys->main_local_s;
+  cl_ulong key = cls_tune_key(sys, kernel, step, d, local_s);
+  size_t best[3];
+
+  CHKERROR(d->dim==0, "Kernel arguments must be set before autotuning");
+
+  // A reqd_work_group_size attribute fixes the shape, other ones would be
+  // rejected or, for kernels that only assume it, compute wrong results
+  size_t reqd[3] = {0, 0, 0};
+  clGetKernelWorkGroupInfo(kernel, sys->device, CL_KERNEL_COMPILE_WORK_GROUP_SIZE,
+    sizeof(reqd), reqd, NULL);
+  if(reqd[0]|reqd[1]|reqd[2])
+  {
+    PINFORM("Kernel requires local range %zu %zu %zu, not tuned\n", reqd[0], reqd[1], reqd[2]);
+    memcpy(best, d->local, sizeof(best));
+    for(int k = 0; k < d->dim; k++) best[k] = reqd[k];
+  }
+  else if(!cls_tune_load(key, best))
+  {
+    size_t shapes[CLS_TUNE_MAX][3];
+    cl_ulong best_t = 0;
+    int shapes_n = cls_tune_shapes(sys, kernel, d, shapes);
+
+    memcpy(best, d->local, sizeof(best));
+    for(int c = 0; c < shapes_n; c++)
+    {
+      cls_tune_time(sys, step, d, shapes[c]); // warm up
+      cl_ulong t = cls_tune_time(sys, step, d, shapes[c]);
+      if(t&&((best_t==0)||(t<best_t))) {best_t = t; memcpy(best, shapes[c], sizeof(best));}
+    }
+    CHKERROR(best_t==0, "No work-group shape could be launched");
+    cls_tune_store(key, best);
+    PINFORM("Tuned local range %zu %zu %zu out of %d shapes\n", best[0], best[1], best[2], shapes_n);
+  }
+
+  if(memcmp(d->local, best, sizeof(best)))
+  {
+    memcpy(d->local, best, sizeof(best));
+    sys->bind_gen++; // recorded schedules use the old range
+  }
+
+  dims_i ret = *d;
+  if((step==CLS_STEP_UPDATE)&&(sys->mode==CLS_MODE_INPLACE)) ret.global[0] *= 2;
+  return ret;
+}
+
+oclSched
+cls_new_sched(oclSys sys)
+{
+  oclSched sched = (oclSched)calloc(1,sizeof(struct oclsim_sched));
+  sched->sys = sys;
+  return sched;
+}
+
+static void
+cls_sched_drop(oclSched sched)
+{
+#ifdef cl_khr_command_buffer
+  for(int p = 0; p < 2; p++)
+  {
+    if(sched->cmdbuf_ev[p])
+    {
+      clWaitForEvents(1, &sched->cmdbuf_ev[p]);
+      clReleaseEvent(sched->cmdbuf_ev[p]);
+      sched->cmdbuf_ev[p]=NULL;
+    }
+    if(sched->cmdbuf[p])
+    {
+      sched->sys->cb_release(sched->cmdbuf[p]);
+      sched->cmdbuf[p]=NULL;
+    }
+  }
+#endif
+}
+
+void
+cls_sched_add(oclSched sched, cls_step step, size_t count)
+{
+  if(count==0) return;
+  cls_sched_drop(sched);
+
+  if((sched->steps_n>0)&&(sched->steps[sched->steps_n-1].step==step))
+  {
+    sched->steps[sched->steps_n-1].count += count; // merge repeated steps
+    return;
+  }
+
+  if(sched->steps_n==sched->steps_cap)
+  {
+    sched->steps_cap = sched->steps_cap ? 2*sched->steps_cap : 8;
+    sched->steps = (struct sched_step*)realloc(sched->steps,
+      sched->steps_cap*sizeof(struct sched_step));
+  }
+  sched->steps[sched->steps_n++] = (struct sched_step){.step=step, .count=count};
+}
+
+// Parity of the state buffers after one pass of the schedule
+static int
+cls_sched_parity(oclSched sched, int par)
+{
+  for(size_t s = 0; s < sched->steps_n; s++)
+  {
+    switch(sched->steps[s].step)
+    {
+      case CLS_STEP_INIT: par = 0; break;
+      case CLS_STEP_UPDATE: par ^= sched->steps[s].count&0x01; break;
+      case CLS_STEP_MEAS: break;
+    }
+  }
+  return par;
+}
+
+#ifdef cl_khr_command_buffer
+static cl_command_buffer_khr
+cls_record_sched(oclSched sched, int par, size_t repeat)
+{
+  oclSys sys = sched->sys;
+  cl_int err=0;
+  cl_sync_point_khr prev_sp, next_sp;
+  cl_uint wait_n = 0;
+
+  cl_command_buffer_khr cmdbuf = sys->cb_create(1, &sys->queue, NULL, &err);
+  CHKERROR(err<0,"Couldn't create command buffer");
+
+  for(size_t r = 0; r < repeat; r++)
+  {
+    for(size_t s = 0; s < sched->steps_n; s++)
+    {
+      for(size_t c = 0; c < sched->steps[s].count; c++)
+      {
+        cl_kernel kernel;
+        dims_i *d;
+        switch(sched->steps[s].step)
+        {
+          case CLS_STEP_INIT:
+            kernel = sys->init_k; d = &sys->init_d; par = 0; break;
+          case CLS_STEP_UPDATE:
+            kernel = sys->main_k[par]; d = &sys->main_d; par ^= 1; break;
+          default:
+            kernel = sys->meas_k[par]; d = &sys->meas_d; break;
+        }
+        // Chain sync points so the recorded steps keep queue order
+        err|=sys->cb_ndrange(cmdbuf, NULL, NULL, kernel, d->dim, NULL, d->global,
+          d->local, wait_n, wait_n ? &prev_sp : NULL, &next_sp, NULL);
+        prev_sp = next_sp;
+        wait_n = 1;
+      }
+    }
+  }
+
+  err|=sys->cb_finalize(cmdbuf);
+  CHKERROR(err<0,"Couldn't record command buffer");
+  return cmdbuf;
+}
+#endif
+
+void
+cls_run_sched(oclSched sched, size_t repeat)
+{
+  oclSys sys = sched->sys;
+  cl_int err=0;
+  int par = sys->state&0x01, end_par = par;
+
+  for(size_t r = 0; r < repeat; r++) end_par = cls_sched_parity(sched, end_par);
+
+#ifdef cl_khr_command_buffer
+  // Drains go between launches, and profiling times each launch
+  if((sys->cb_create!=NULL)&&(sys->stream_map==NULL)&&(sys->prof==NULL))
+  {
+    if((sched->cmdbuf[par]!=NULL)&&((sched->cmdbuf_gen[par]!=sys->bind_gen)||
+      (sched->cmdbuf_repeat[par]!=repeat)))
+    {
+      cls_sched_drop(sched); // recorded bindings are stale
+    }
+    if(sched->cmdbuf[par]==NULL)
+    {
+      sched->cmdbuf[par] = cls_record_sched(sched, par, repeat);
+      sched->cmdbuf_gen[par] = sys->bind_gen;
+      sched->cmdbuf_repeat[par] = repeat;
+    }
+    if(sched->cmdbuf_ev[par]) // previous replay must retire before reuse
+    {
+      err|=clWaitForEvents(1, &sched->cmdbuf_ev[par]);
+      clReleaseEvent(sched->cmdbuf_ev[par]);
+      sched->cmdbuf_ev[par]=NULL;
+    }
+    err|=sys->cb_enqueue(1, &sys->queue, sched->cmdbuf[par], 0, NULL,
+      &sched->cmdbuf_ev[par]);
+    sys->state = (sys->state&~0x01)|end_par;
+    CHKERROR(err<0,"Coudn't enqueue command buffer");
+    return;
+  }
+#endif
+
+  for(size_t r = 0; r < repeat; r++)
+  {
+    for(size_t s = 0; s < sched->steps_n; s++)
+    {
+      for(size_t c = 0; c < sched->steps[s].count; c++)
+      {
+        switch(sched->steps[s].step)
+        {
+          case CLS_STEP_INIT: err|=cls_enq_init(sys); break;
+          case CLS_STEP_UPDATE: err|=cls_enq_update(sys); break;
+          case CLS_STEP_MEAS: err|=cls_enq_meas(sys); break;
+        }
+      }
+    }
+  }
+  CHKERROR(err<0,"Coudn't enqueue schedule");
+}
+
+void
+cls_release_sched(oclSched sched)
+{
+  cls_sched_drop(sched);
+  free(sched->steps);
+  free(sched);
+}
+
+oclGraph
+cls_new_graph(oclSys sys)
+{
+  cl_int err=0;
+  CHKERROR(sys->native!=NULL, "Kernel graphs need an OpenCL system");
+  cl_command_queue_properties props=0;
+  oclGraph graph = (oclGraph)calloc(1,sizeof(struct oclsim_graph));
+  graph->sys = sys;
+  graph->queue = sys->queue;
+
+  clGetDeviceInfo(sys->device, CL_DEVICE_QUEUE_ON_HOST_PROPERTIES, sizeof(props), &props, NULL);
+  if(props&CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
+  {
+    graph->queue = clCreateCommandQueueWithProperties(sys->context, sys->device,
+      (cl_queue_properties[]){CL_QUEUE_PROPERTIES,
+      CL_QUEUE_PROFILING_ENABLE|CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE,0}, &err);
+    CHKERROR(err<0, "Couldn't create out-of-order queue");
+  }
+  return graph;
+}
+
+static cl_int
+cls_bind_graph_node(oclGraph graph, struct graph_node *node)
+{
+  cl_int err=0;
+  cl_uint args_n;
+
+  for(int p = 0; p < 2; p++)
+  {
+    err |= cls_bind_kernel_bufs(graph->sys, node->kernel[p], p, 1);
+    err |= clGetKernelInfo(node->kernel[p], CL_KERNEL_NUM_ARGS, sizeof(cl_uint), &args_n, NULL);
+    for(cl_uint a = 0; (a < args_n)&&(err>=0); a++)
+    {
+      char arg_name[CLS_NAME_LEN+8];
+      cl_kernel_arg_address_qualifier aq;
+      if(cls_kernel_arg(graph->sys, node->kernel[p], a, arg_name, sizeof(arg_name), &aq)<0) continue;
+      if(aq==CL_KERNEL_ARG_ADDRESS_LOCAL)
+      {
+        err |= clSetKernelArg(node->kernel[p], a, node->local_s, NULL);
+      }
+      else if(strcmp(arg_name, "input")==0) // main state, named as in update_k
+      {
+        err |= clSetKernelArg(node->kernel[p], a, sizeof(cl_mem), &graph->sys->states_b[p]);
+      }
+      else if(strcmp(arg_name, "output")==0)
+      {
+        err |= clSetKernelArg(node->kernel[p], a, sizeof(cl_mem), &graph->sys->states_b[p^1]);
+      }
+    }
+  }
+  return err;
+}
+
+int
+cls_graph_node(oclGraph graph, char *kernel_name, dims_i dims, size_t local_s, int swap)
+{
+  cl_int err=0;
+  CHKERROR(graph->nodes_n>=CLS_GRAPH_MAX, "Too many graph nodes");
+
+  struct graph_node *node = &graph->nodes[graph->nodes_n];
+  memset(node, 0, sizeof(struct graph_node));
+  node->dims = dims;
+  node->local_s = local_s;
+  node->swap = swap;
+  node->kernel[0] = clCreateKernel(graph->sys->program, kernel_name, &err);
+  CHKERROR(err<0, "Couldn't create graph kernel");
+  node->kernel[1] = clCreateKernel(graph->sys->program, kernel_name, &err);
+  CHKERROR(err<0, "Couldn't create graph kernel");
+
+  err = cls_bind_graph_node(graph, node);
+  CHKERROR(err<0, "Couldn't bind graph kernel arguments");
+  return graph->nodes_n++;
+}
+
+void
+cls_graph_dep(oclGraph graph, int node, int dep)
+{
+  CHKERROR((node>=graph->nodes_n)||(dep>=node)||(dep<0),
+    "Graph dependencies must point to earlier nodes");
+  graph->nodes[node].deps |= (cl_ulong)1<<dep;
+  graph->nodes[node].anc |= graph->nodes[dep].anc|((cl_ulong)1<<dep);
+}
+
+void
+cls_run_graph(oclGraph graph, size_t repeat)
+{
+  oclSys sys = graph->sys;
+  cl_int err=0;
+  cl_event wait_ev;
+  cl_ulong swaps = 0;
+  int par = sys->state&0x01;
+
+  if(graph->bind_gen!=sys->bind_gen) // named buffers changed
+  {
+    for(int n = 0; n < graph->nodes_n; n++) err |= cls_bind_graph_node(graph, &graph->nodes[n]);
+    graph->bind_gen = sys->bind_gen;
+  }
+  for(int n = 0; n < graph->nodes_n; n++)
+  {
+    if(graph->nodes[n].swap) swaps |= (cl_ulong)1<<n;
+  }
+
+  if(graph->queue!=sys->queue) // start after the work already on the main queue
+  {
+    err |= clEnqueueMarkerWithWaitList(sys->queue, 0, NULL, &wait_ev);
+    err |= clFlush(sys->queue); // the marker must be submitted for graph->queue to see it
+    err |= clEnqueueBarrierWithWaitList(graph->queue, 1, &wait_ev, NULL);
+    clReleaseEvent(wait_ev);
+  }
+
+  for(size_t r = 0; r < repeat; r++)
+  {
+    if(r>0) err |= clEnqueueBarrierWithWaitList(graph->queue, 0, NULL, NULL);
+
+    for(int n = 0; n < graph->nodes_n; n++)
+    {
+      struct graph_node *node = &graph->nodes[n];
+      cl_event deps_ev[CLS_GRAPH_MAX];
+      cl_uint deps_n = 0;
+      int node_par = par^(__builtin_popcountll(node->anc&swaps)&0x01);
+
+      for(int d = 0; d < n; d++)
+      {
+        if(node->deps&((cl_ulong)1<<d)) deps_ev[deps_n++] = graph->nodes[d].ev;
+      }
+      cl_event ev;
+      err |= clEnqueueNDRangeKernel(graph->queue, node->kernel[node_par], node->dims.dim,
+        NULL, node->dims.global, node->dims.local, deps_n, deps_n ? deps_ev : NULL, &ev);
+      if(node->ev) clReleaseEvent(node->ev);
+      node->ev = ev;
+      cls_prof_add(sys, (graph->queue!=sys->queue) ? CLS_Q_GRAPH : CLS_Q_MAIN,
+        node->kernel[node_par], NULL, 0, ev);
+    }
+    par ^= __builtin_popcountll(swaps)&0x01;
+  }
+
+  if(graph->queue!=sys->queue) // main queue continues after the graph
+  {
+    err |= clEnqueueMarkerWithWaitList(graph->queue, 0, NULL, &wait_ev);
+    err |= clEnqueueBarrierWithWaitList(sys->queue, 1, &wait_ev, NULL);
+    clReleaseEvent(wait_ev);
+    err |= clFlush(graph->queue);
+  }
+
+  sys->state = (sys->state&~0x01)|par;
+  CHKERROR(err<0, "Couldn't enqueue graph");
+}
+
+void
+cls_release_graph(oclGraph graph)
+{
+  for(int n = 0; n < graph->nodes_n; n++)
+  {
+    if(graph->nodes[n].ev) clReleaseEvent(graph->nodes[n].ev);
+    clReleaseKernel(graph->nodes[n].kernel[0]);
+    clReleaseKernel(graph->nodes[n].kernel[1]);
+  }
+  if(graph->queue!=graph->sys->queue)
+  {
+    clFinish(graph->queue);
+    clReleaseCommandQueue(graph->queue);
+  }
+  free(graph);
+}
+
+// Multi-device slabs. Every part is a system over its own slab, whose state
+// buffer starts with halo rows, then the owned rows, then halo rows again. Rows
+// are dimension 0 of the update range, launched with an offset past the halo.
+struct multi_part
+{
+  oclSys sys;
+  size_t rows;
+  cl_event halo_ev[2]; // incoming copies into the top and bottom halo
+};
+
+struct oclsim_multi
+{
+  struct multi_part *parts;
+  int parts_n;
+  cl_device_id *subdevs; // from clCreateSubDevices, released with the parts
+  size_t row_s;
+  size_t halo;
+  size_t depth;
+};
+
+static oclMulti
+cls_new_multi_devs(cl_platform_id platform, cl_device_id *devices, int devs_n)
+{
+  cl_int err=0;
+  oclMulti multi = (oclMulti)calloc(1,sizeof(struct oclsim_multi));
+
+  cl_context context = clCreateContext(NULL, devs_n, devices, NULL, NULL, &err);
+  CHKERROR(err<0, "Couldn't create multi-device context");
+
+  multi->parts_n = devs_n;
+  multi->parts = (struct multi_part*)calloc(devs_n, sizeof(struct multi_part));
+  for(int p = 0; p < devs_n; p++)
+  {
+    multi->parts[p].sys = cls_new_sys_ctx(platform, devices[p], context);
+  }
+  clReleaseContext(context);
+  return multi;
+}
+
+oclMulti
+cls_new_multi(int plat_i, int *dev_i, int devs_n)
+{
+  cl_platform_id platform = cls_get_platform(plat_i);
+  cl_device_id devices[devs_n];
+
+  CHKERROR(devs_n<1, "No devices selected");
+  for(int d = 0; d < devs_n; d++) devices[d] = cls_get_device(platform, dev_i[d]);
+  return cls_new_multi_devs(platform, devices, devs_n);
+}
+
+oclMulti
+cls_new_multi_sub(int plat_i, int dev_i, int parts)
+{
+  cl_int err=0;
+  cl_uint units, subs_n;
+  cl_platform_id platform = cls_get_platform(plat_i);
+  cl_device_id device = cls_get_device(platform, dev_i);
+
+  err |= clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL);
+  CHKERROR((err<0)||(parts<1)||(units<parts), "Not enough compute units for the sub-devices");
+
+  cl_device_partition_property props[] = {CL_DEVICE_PARTITION_EQUALLY, units/parts, 0};
+  err |= clCreateSubDevices(device, props, 0, NULL, &subs_n);
+  CHKERROR((err<0)||(subs_n<parts), "Couldn't partition the device");
+  cl_device_id *subs = (cl_device_id*)malloc(subs_n*sizeof(cl_device_id));
+  err |= clCreateSubDevices(device, props, subs_n, subs, NULL);
+  CHKERROR(err<0, "Couldn't create sub-devices");
+  for(cl_uint d = parts; d < subs_n; d++) clReleaseDevice(subs[d]); // leftover units
+
+  PINFORM("Split into %d sub-devices of %u compute units\n", parts, units/parts);
+  oclMulti multi = cls_new_multi_devs(platform, subs, parts);
+  multi->subdevs = subs;
+  return multi;
+}
+
+int
+cls_multi_parts(oclMulti multi)
+{
+  return multi->parts_n;
+}
+
+oclSys
+cls_multi_part(oclMulti multi, int p)
+{
+  CHKERROR((p<0)||(p>=multi->parts_n), "Part is out of range");
+  return multi->parts[p].sys;
+}
+
+void
+cls_multi_layout(oclMulti multi, size_t row_s, size_t halo, size_t depth, size_t *rows)
+{
+  CHKERROR((depth<1)||(depth>halo), "Exchange depth must be between 1 and the halo");
+  multi->row_s = row_s;
+  multi->halo = halo;
+  multi->depth = depth;
+  for(int p = 0; p < multi->parts_n; p++)
+  {
+    CHKERROR(rows[p]<depth, "Slab is thinner than the exchanged rows");
+    multi->parts[p].rows = rows[p];
+  }
+}
+
+// Copies the first and last depth owned rows of every part into the halos of
+// its neighbours (periodically), on the source part's transfer queue once
+// top_ev/bot_ev are done. buf selects the state buffer, the same on all parts.
+static cl_int
+cls_multi_exchange(oclMulti multi, int buf, cl_event *top_ev, cl_event *bot_ev)
+{
+  cl_int err=0;
+  int n = multi->parts_n;
+  size_t halo = multi->halo, row_s = multi->row_s, copy_s = multi->depth*row_s;
+
+  for(int p = 0; p < n; p++)
+  {
+    struct multi_part *src = &multi->parts[p];
+    struct multi_part *prev = &multi->parts[(p+n-1)%n], *next = &multi->parts[(p+1)%n];
+    oclSys sys = src->sys;
+
+    cls_open_xfer_queue(sys);
+    if(prev->halo_ev[1]) clReleaseEvent(prev->halo_ev[1]);
+    if(next->halo_ev[0]) clReleaseEvent(next->halo_ev[0]);
+
+    err |= clEnqueueCopyBuffer(sys->xfer_queue, sys->states_b[buf], prev->sys->states_b[buf],
+      halo*row_s, (halo + prev->rows)*row_s, copy_s, 1, &top_ev[p], &prev->halo_ev[1]);
+    cls_prof_add(sys, CLS_Q_XFER, NULL, "halo copy", copy_s, prev->halo_ev[1]);
+    err |= clEnqueueCopyBuffer(sys->xfer_queue, sys->states_b[buf], next->sys->states_b[buf],
+      (halo + src->rows)*row_s - copy_s, halo*row_s - copy_s, copy_s, 1, &bot_ev[p],
+      &next->halo_ev[0]);
+    cls_prof_add(sys, CLS_Q_XFER, NULL, "halo copy", copy_s, next->halo_ev[0]);
+    err |= clFlush(sys->xfer_queue);
+  }
+  return err;
+}
+
+// Launch over rows [row0, row0+rows) of dimension 0
+static cl_int
+cls_enq_rows(oclSys sys, cl_kernel kernel, dims_i *d, size_t row0, size_t rows,
+             cl_uint wait_n, cl_event *wait_ev, cl_event *ev)
+{
+  size_t offset[3] = {row0, 0, 0}, global[3] = {rows, d->global[1], d->global[2]};
+  return clEnqueueNDRangeKernel(sys->queue, kernel, d->dim, offset, global, d->local,
+    wait_n, wait_n ? wait_ev : NULL, ev);
+}
+
+void
+cls_multi_run_init(oclMulti multi)
+{
+  cl_int err=0;
+  cl_event ev[multi->parts_n];
+
+  CHKERROR(multi->row_s==0, "Slab layout is not set");
+  for(int p = 0; p < multi->parts_n; p++)
+  {
+    oclSys sys = multi->parts[p].sys;
+    err |= cls_enq_init(sys);
+    err |= clEnqueueMarkerWithWaitList(sys->queue, 0, NULL, &ev[p]);
+  }
+  err |= cls_multi_exchange(multi, 0, ev, ev);
+  for(int p = 0; p < multi->parts_n; p++) clReleaseEvent(ev[p]);
+  CHKERROR(err<0, "Couldn't enqueue slab init");
+}
+
+// Each update launches the bands of rows next to the halos first. Their rows
+// are copied to the neighbours while the interior rows are updated, and only
+// the next boundary launch waits for the incoming halos.
+void
+cls_multi_run_update_n(oclMulti multi, size_t n)
+{
+  cl_int err=0;
+  int parts_n = multi->parts_n;
+  cl_event top_ev[parts_n], bot_ev[parts_n];
+
+  CHKERROR(multi->row_s==0, "Slab layout is not set");
+  for(size_t s = 0; s < n; s++)
+  {
+    int par = multi->parts[0].sys->state&0x01;
+
+    for(int p = 0; p < parts_n; p++)
+    {
+      struct multi_part *part = &multi->parts[p];
+      oclSys sys = part->sys;
+      dims_i *d = &sys->main_d;
+      size_t band = (multi->depth + d->local[0] - 1)/d->local[0]*d->local[0];
+      cl_event wait_ev[2];
+      cl_uint wait_n = 0;
+
+      CHKERROR((sys->mode!=CLS_MODE_PINGPONG)||(d->global[0]!=part->rows)||
+        ((sys->state&0x01)!=par), "Slab update range doesn't match the layout");
+      for(int h = 0; h < 2; h++) if(part->halo_ev[h]) wait_ev[wait_n++] = part->halo_ev[h];
+
+      if(part->rows<3*band) // too thin to split
+      {
+        err |= cls_enq_rows(sys, sys->main_k[par], d, multi->halo, part->rows,
+          wait_n, wait_ev, &top_ev[p]);
+        bot_ev[p] = top_ev[p];
+        clRetainEvent(bot_ev[p]);
+      }
+      else
+      {
+        err |= cls_enq_rows(sys, sys->main_k[par], d, multi->halo, band,
+          wait_n, wait_ev, &top_ev[p]);
+        err |= cls_enq_rows(sys, sys->main_k[par], d, multi->halo + part->rows - band, band,
+          wait_n, wait_ev, &bot_ev[p]);
+      }
+      cls_prof_add(sys, CLS_Q_MAIN, sys->main_k[par], NULL, 0, top_ev[p]);
+      if(bot_ev[p]!=top_ev[p]) cls_prof_add(sys, CLS_Q_MAIN, sys->main_k[par], NULL, 0, bot_ev[p]);
+      err |= clFlush(sys->queue);
+    }
+
+    err |= cls_multi_exchange(multi, par^1, top_ev, bot_ev);
+
+    for(int p = 0; p < parts_n; p++)
+    {
+      struct multi_part *part = &multi->parts[p];
+      oclSys sys = part->sys;
+      dims_i *d = &sys->main_d;
+      size_t band = (multi->depth + d->local[0] - 1)/d->local[0]*d->local[0];
+
+      if(part->rows>=3*band)
+      {
+        err |= cls_enq_rows(sys, sys->main_k[par], d, multi->halo + band, part->rows - 2*band,
+          0, NULL, cls_prof_ev(sys, CLS_Q_MAIN, sys->main_k[par], NULL, 0));
+      }
+      sys->state ^= 1;
+      clReleaseEvent(top_ev[p]);
+      clReleaseEvent(bot_ev[p]);
+    }
+  }
+  CHKERROR(err<0, "Couldn't enqueue slab update");
+}
+
+void
+cls_multi_run_meas(oclMulti multi)
+{
+  cl_int err=0;
+  for(int p = 0; p < multi->parts_n; p++) err |= cls_enq_meas(multi->parts[p].sys);
+  CHKERROR(err<0, "Couldn't enqueue slab measurement");
+}
+
+void
+cls_multi_finish(oclMulti multi)
+{
+  for(int p = 0; p < multi->parts_n; p++) cls_finish(multi->parts[p].sys);
+}
+
+void
+cls_release_multi(oclMulti multi)
+{
+  cls_multi_finish(multi);
+  for(int p = 0; p < multi->parts_n; p++)
+  {
+    struct multi_part *part = &multi->parts[p];
+    if(part->halo_ev[0]) clReleaseEvent(part->halo_ev[0]);
+    if(part->halo_ev[1]) clReleaseEvent(part->halo_ev[1]);
+    cls_release_sys(part->sys);
+    if(multi->subdevs) clReleaseDevice(multi->subdevs[p]);
+  }
+  free(multi->subdevs);
+  free(multi->parts);
+  free(multi);
+}
+
+// Job pools. Every system gets a worker thread and a deque of jobs, dealt out
+// round-robin so results come back roughly in order. A worker pops from the
+// head of its own deque and, once empty, steals from the tail of the fullest
+// one. Results are copied and handed to done strictly in job order.
+struct pool_worker
+{
+  oclPool pool;
+  oclSys sys;
+  pthread_t thread;
+  pthread_mutex_t lock; // guards head and tail, which thieves also read atomically
+  int *jobs;
+  int head, tail;
+};
+
+struct oclsim_pool
+{
+  struct pool_worker *workers;
+  int workers_n;
+  // Current run
+  int jobs_n, next_done;
+  cls_job_fn run;
+  cls_done_fn done;
+  void *user;
+  void **results; // finished jobs waiting for the ones before them
+  pthread_mutex_t done_lock;
+};
+
+oclPool
+cls_new_pool(int plat_i, int *dev_i, int devs_n, int queues)
+{
+  cl_int err=0;
+  cl_platform_id platform = cls_get_platform(plat_i);
+  oclPool pool = (oclPool)calloc(1,sizeof(struct oclsim_pool));
+
+  if(dev_i==NULL) // every device of the platform
+  {
+    cl_uint n;
+    err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, NULL, &n);
+    CHKERROR(err<0, "Couldn't count devices");
+    devs_n = n;
+  }
+  CHKERROR((devs_n<1)||(queues<1), "A pool needs at least one device and one queue");
+
+  pool->workers_n = devs_n*queues;
+  pool->workers = (struct pool_worker*)calloc(pool->workers_n, sizeof(struct pool_worker));
+  pthread_mutex_init(&pool->done_lock, NULL);
+
+  for(int d = 0; d < devs_n; d++) // queues of a device share its context
+  {
+    cl_device_id device = cls_get_device(platform, dev_i ? dev_i[d] : d);
+    cl_context context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+    CHKERROR(err<0, "Couldn't create context");
+
+    for(int q = 0; q < queues; q++)
+    {
+      struct pool_worker *wk = &pool->workers[d*queues + q];
+      wk->pool = pool;
+      wk->sys = cls_new_sys_ctx(platform, device, context);
+      pthread_mutex_init(&wk->lock, NULL);
+    }
+    clReleaseContext(context);
+  }
+  return pool;
+}
+
+int
+cls_pool_size(oclPool pool)
+{
+  return pool->workers_n;
+}
+
+oclSys
+cls_pool_sys(oclPool pool, int i)
+{
+  CHKERROR((i<0)||(i>=pool->workers_n), "Pool system out of range");
+  return pool->workers[i].sys;
+}
+
+// Jobs left in a deque, read without its lock. Only picks a victim, which is
+// rechecked under the lock.
+static int
+cls_pool_left(struct pool_worker *wk)
+{
+  return __atomic_load_n(&wk->tail, __ATOMIC_RELAXED) - __atomic_load_n(&wk->head, __ATOMIC_RELAXED);
+}
+
+static int
+cls_pool_next(oclPool pool, struct pool_worker *own)
+{
+  int job = -1;
+
+  pthread_mutex_lock(&own->lock);
+  if(own->head<own->tail)
+  {
+    job = own->jobs[own->head];
+    __atomic_store_n(&own->head, own->head+1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&own->lock);
+
+  while(job<0)
+  {
+    struct pool_worker *victim = NULL;
+    int most = 0;
+    for(int w = 0; w < pool->workers_n; w++)
+    {
+      struct pool_worker *wk = &pool->workers[w];
+      int left = (wk!=own) ? cls_pool_left(wk) : 0;
+      if(left>most) {most = left; victim = wk;}
+    }
+    if(victim==NULL) return -1;
+
+    pthread_mutex_lock(&victim->lock);
+    if(victim->head<victim->tail)
+    {
+      job = victim->jobs[victim->tail-1];
+      __atomic_store_n(&victim->tail, victim->tail-1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+  return job;
+}
+
+static void
+cls_pool_deliver(oclPool pool, int job, void *meas, size_t meas_s)
+{
+  void *copy = malloc(meas_s);
+  CHKERROR(copy==NULL, "Couldn't keep job result");
+  memcpy(copy, meas, meas_s);
+
+  pthread_mutex_lock(&pool->done_lock);
+  pool->results[job] = copy;
+  while((pool->next_done<pool->jobs_n)&&(pool->results[pool->next_done]!=NULL))
+  {
+    int j = pool->next_done++;
+    pool->done(j, pool->results[j], pool->user);
+    free(pool->results[j]);
+    pool->results[j] = NULL;
+  }
+  pthread_mutex_unlock(&pool->done_lock);
+}
+
+// The next job is set up and enqueued before the previous one is read back, so
+// host setup, device work and the readback of consecutive jobs overlap
+static void*
+cls_pool_worker(void *arg)
+{
+  struct pool_worker *wk = arg;
+  oclPool pool = wk->pool;
+  int prev_job = -1, prev_slot = -1;
+
+  for(;;)
+  {
+    int job = cls_pool_next(pool, wk), slot = -1;
+    if(job>=0)
+    {
+      pool->run(wk->sys, job, pool->user);
+      slot = cls_get_meas_async(wk->sys, NULL, NULL);
+    }
+    if(prev_job>=0)
+    {
+      cls_pool_deliver(pool, prev_job, cls_wait_meas(wk->sys, prev_slot), wk->sys->output_s);
+      cls_release_meas(wk->sys, prev_slot);
+    }
+    if(job<0) return NULL;
+    prev_job = job;
+    prev_slot = slot;
+  }
+}
+
+void
+cls_run_pool(oclPool pool, int jobs_n, cls_job_fn run, cls_done_fn done, void *user)
+{
+  pool->jobs_n = jobs_n;
+  pool->next_done = 0;
+  pool->run = run;
+  pool->done = done;
+  pool->user = user;
+  pool->results = (void**)calloc(jobs_n, sizeof(void*));
+
+  for(int w = 0; w < pool->workers_n; w++)
+  {
+    struct pool_worker *wk = &pool->workers[w];
+    wk->jobs = (int*)realloc(wk->jobs, sizeof(int)*(jobs_n/pool->workers_n + 1));
+    wk->head = wk->tail = 0;
+    for(int j = w; j < jobs_n; j += pool->workers_n) wk->jobs[wk->tail++] = j;
+  }
+  for(int w = 0; w < pool->workers_n; w++)
+  {
+    int err = pthread_create(&pool->workers[w].thread, NULL, cls_pool_worker, &pool->workers[w]);
+    CHKERROR(err, "Couldn't start pool worker");
+  }
+  for(int w = 0; w < pool->workers_n; w++) pthread_join(pool->workers[w].thread, NULL);
+
+  free(pool->results);
+  pool->results = NULL;
+}
+
+void
+cls_release_pool(oclPool pool)
+{
+  for(int w = 0; w < pool->workers_n; w++)
+  {
+    cls_release_sys(pool->workers[w].sys);
+    pthread_mutex_destroy(&pool->workers[w].lock);
+    free(pool->workers[w].jobs);
+  }
+  pthread_mutex_destroy(&pool->done_lock);
+  free(pool->workers);
+  free(pool);
+}
+
+// State files: header, the caller's user block, the active side of the main
+// state, then the active side of every CLS_BUF_STATE named buffer by name.
+// Counters and seeds kept in the state by the kernels are saved with it.
+struct cls_state_hdr
+{
+  char magic[8];
+  cl_uint version;
+  cl_uint bufs_n;
+  cl_ulong states_s;
+  cl_ulong user_s;
+};
+
+struct cls_state_buf
+{
+  char name[CLS_NAME_LEN];
+  cl_ulong size;
+};
+
+void
+cls_save_state(oclSys sys, char *filename, void *user, size_t user_s)
+{
+  CHKERROR(sys->native!=NULL, "Checkpoints need an OpenCL system");
+  int par = sys->state&0x01;
+  char tmp_path[strlen(filename)+8];
+  struct cls_state_hdr hdr = {.magic = CLS_STATE_MAGIC, .version = CLS_STATE_VERSION,
+                              .states_s = sys->states_s, .user_s = user_s};
+  cl_int err=0;
+
+  for(size_t b = 0; b < sys->bufs_n; b++) hdr.bufs_n += sys->bufs[b].role==CLS_BUF_STATE;
+
+  // Written under a temporary name and renamed, an interrupted save keeps the old file
+  FILE *fh = cls_open_tmp(tmp_path, sizeof(tmp_path), filename);
+  CHKERROR(fh==NULL, "Couldn't open state file");
+
+  // in-order queue: the blocking reads wait for the queued updates
+  void *data = malloc(sys->states_s);
+  err |= clEnqueueReadBuffer(sys->queue, sys->states_b[par], CL_TRUE, 0, sys->states_s, data,
+    0, NULL, cls_prof_ev(sys, CLS_Q_MAIN, NULL, "read state", sys->states_s));
+  int ok = (fwrite(&hdr, sizeof(hdr), 1, fh)==1)&&(fwrite(user, 1, user_s, fh)==user_s)&&
+           (fwrite(data, 1, sys->states_s, fh)==sys->states_s);
+  free(data);
+
+  for(size_t b = 0; (b < sys->bufs_n)&&(err>=0); b++)
+  {
+    struct cls_buffer *buf = &sys->bufs[b];
+    if(buf->role!=CLS_BUF_STATE) continue;
+
+    struct cls_state_buf buf_hdr = {.size = buf->size};
+    strcpy(buf_hdr.name, buf->name);
+    data = malloc(buf->size);
+    err |= clEnqueueReadBuffer(sys->queue, buf->mem[par], CL_TRUE, 0, buf->size, data,
+      0, NULL, cls_prof_ev(sys, CLS_Q_MAIN, NULL, "read state", buf->size));
+    ok &= (fwrite(&buf_hdr, sizeof(buf_hdr), 1, fh)==1)&&(fwrite(data, 1, buf->size, fh)==buf->size);
+    free(data);
+  }
+  ok &= fclose(fh)==0;
+
+  if((err<0)||!ok||(rename(tmp_path, filename)!=0))
+  {
+    remove(tmp_path);
+    CHKERROR(1, "Couldn't write state file");
+  }
+}
+
+size_t
+cls_load_state(oclSys sys, char *filename, void *user, size_t user_s)
+{
+  CHKERROR(sys->native!=NULL, "Checkpoints need an OpenCL system");
+  size_t file_s;
+  char *file = cls_read_file(filename, &file_s);
+  CHKERROR(file==NULL, "Couldn't read state file");
+
+  struct cls_state_hdr *hdr = (struct cls_state_hdr*)file;
+  char *pos = file + sizeof(*hdr), *end = file + file_s;
+  cl_int err=0;
+
+  CHKERROR((file_s<sizeof(*hdr))||memcmp(hdr->magic, CLS_STATE_MAGIC, 8), "Not a state file");
+  CHKERROR(hdr->version!=CLS_STATE_VERSION, "Unsupported state file version");
+  CHKERROR(hdr->states_s!=sys->states_s, "State file is for another state size");
+  CHKERROR(hdr->user_s>user_s, "State file user block doesn't fit");
+  CHKERROR(end-pos<hdr->user_s+hdr->states_s, "Truncated state file");
+
+  user_s = hdr->user_s;
+  memcpy(user, pos, user_s);
+  pos += user_s;
+  err |= clEnqueueWriteBuffer(sys->queue, sys->states_b[0], CL_TRUE, 0, sys->states_s, pos,
+    0, NULL, cls_prof_ev(sys, CLS_Q_MAIN, NULL, "write state", sys->states_s));
+  pos += sys->states_s;
+
+  for(cl_uint b = 0; (b < hdr->bufs_n)&&(err>=0); b++)
+  {
+    struct cls_state_buf buf_hdr;
+    CHKERROR(end-pos<sizeof(buf_hdr), "Truncated state file");
+    memcpy(&buf_hdr, pos, sizeof(buf_hdr));
+    pos += sizeof(buf_hdr);
+    buf_hdr.name[CLS_NAME_LEN-1] = 0;
+
+    struct cls_buffer *buf = cls_find_buffer(sys, buf_hdr.name);
+    CHKERROR((buf->role!=CLS_BUF_STATE)||(buf_hdr.size!=buf->size)||(end-pos<buf->size),
+      "State file buffer doesn't match the system");
+    err |= clEnqueueWriteBuffer(sys->queue, buf->mem[0], CL_TRUE, 0, buf->size, pos,
+      0, NULL, cls_prof_ev(sys, CLS_Q_MAIN, NULL, "write state", buf->size));
+    pos += buf->size;
+  }
+  free(file);
+  CHKERROR(err<0, "Couldn't write state");
+
+  sys->state &= ~0x01; // like after init, the state is in buffer 0
+  return user_s;
+}
+
+// One buffer from src's queue position to dst's. Within a context it is copied
+// on dst's queue after the work queued on src, and src waits for the copy before
+// going on; otherwise it goes through the host.
+static cl_int
+cls_copy_mem(oclSys dst, cl_mem dst_b, oclSys src, cl_mem src_b, size_t size)
+{
+  cl_int err=0;
+
+  if(dst->context==src->context)
+  {
+    cl_event ready, copied;
+    err |= clEnqueueMarkerWithWaitList(src->queue, 0, NULL, &ready);
+    err |= clFlush(src->queue);
+    err |= clEnqueueCopyBuffer(dst->queue, src_b, dst_b, 0, 0, size, 1, &ready, &copied);
+    err |= clFlush(dst->queue); // submitted before src->queue waits on it
+    cls_prof_add(dst, CLS_Q_MAIN, NULL, "copy state", size, copied);
+    err |= clEnqueueBarrierWithWaitList(src->queue, 1, &copied, NULL);
+    clReleaseEvent(ready);
+    clReleaseEvent(copied);
+    return err;
+  }
+
+  void *data = malloc(size);
+  err |= clEnqueueReadBuffer(src->queue, src_b, CL_TRUE, 0, size, data, 0, NULL,
+    cls_prof_ev(src, CLS_Q_MAIN, NULL, "read state", size));
+  err |= clEnqueueWriteBuffer(dst->queue, dst_b, CL_TRUE, 0, size, data, 0, NULL,
+    cls_prof_ev(dst, CLS_Q_MAIN, NULL, "write state", size));
+  free(data);
+  return err;
+}
+
+void
+cls_copy_state(oclSys dst, oclSys src)
+{
+  int par = src->state&0x01;
+  cl_int err=0;
+
+  if(dst==src) return;
+  CHKERROR((dst->native!=NULL)||(src->native!=NULL), "State copies need OpenCL systems");
+  CHKERROR(dst->states_s!=src->states_s, "Systems have different state sizes");
+
+  err |= cls_copy_mem(dst, dst->states_b[0], src, src->states_b[par], src->states_s);
+  for(size_t b = 0; b < src->bufs_n; b++)
+  {
+    struct cls_buffer *buf = &src->bufs[b];
+    if(buf->role!=CLS_BUF_STATE) continue;
+
+    struct cls_buffer *dst_buf = cls_find_buffer(dst, buf->name);
+    CHKERROR(dst_buf->size!=buf->size, "Systems have different state buffers");
+    err |= cls_copy_mem(dst, dst_buf->mem[0], src, buf->mem[par], buf->size);
+  }
+  CHKERROR(err<0, "Couldn't copy state");
+
+  dst->state &= ~0x01;
+}
+
+size_t
+cls_get_meas(oclSys sys, void *out)
+{
+  cl_int err=0;
+
+  if(sys->native)
+  {
+    sys->native->get_meas(sys->native_eng, out, sys->output_s, 0);
+    return sys->output_s;
+  }
+
+  // in-order queue: the blocking read waits for the queued measurements
+  err|= clEnqueueReadBuffer(sys->queue, sys->output_b, CL_TRUE, 0,
+    sys->output_s, out, 0, NULL, cls_prof_ev(sys, CLS_Q_MAIN, NULL, "read output", sys->output_s));
+
+  CHKERROR(err<0,"Coudn't read output data");
+  return sys->output_s;
+}
+
+static void
+cls_free_meas_slots(oclSys sys)
+{
+  for(int m = 0; m < CLS_MEAS_SLOTS; m++)
+  {
+    struct meas_slot *slot = &sys->meas_slot[m];
+    if(slot->ev)
+    {
+      clWaitForEvents(1, &slot->ev);
+      while(slot->busy&&slot->cb); // callback still running
+      clReleaseEvent(slot->ev);
+    }
+    if(slot->host_b)
+    {
+      clEnqueueUnmapMemObject(sys->xfer_queue, slot->host_b, slot->host_p, 0, NULL, NULL);
+      clFinish(sys->xfer_queue);
+      clReleaseMemObject(slot->host_b);
+    }
+    if(slot->dev_b) clReleaseMemObject(slot->dev_b);
+    if(sys->native) free(slot->host_p);
+    memset(slot, 0, sizeof(struct meas_slot));
+  }
+  sys->meas_slot_s = 0;
+  sys->meas_next = 0;
+}
+
+static void
+cls_alloc_meas_slots(oclSys sys)
+{
+  cl_int err=0;
+
+  cls_free_meas_slots(sys);
+  for(int m = 0; m < sys->meas_slots; m++)
+  {
+    struct meas_slot *slot = &sys->meas_slot[m];
+    slot->sys = sys;
+    if(sys->native) // plain host copies
+    {
+      slot->host_p = malloc(sys->output_s);
+      CHKERROR(slot->host_p==NULL, "Couldn't create measurement slot");
+      continue;
+    }
+    slot->dev_b = clCreateBuffer(sys->context, CL_MEM_READ_WRITE|CL_MEM_HOST_READ_ONLY,
+      sys->output_s, NULL, &err);
+    CHKERROR(err<0, "Couldn't create measurement slot");
+    slot->host_b = clCreateBuffer(sys->context, CL_MEM_READ_WRITE|CL_MEM_ALLOC_HOST_PTR,
+      sys->output_s, NULL, &err);
+    CHKERROR(err<0, "Couldn't create measurement staging buffer");
+    slot->host_p = clEnqueueMapBuffer(sys->xfer_queue, slot->host_b, CL_TRUE,
+      CL_MAP_READ|CL_MAP_WRITE, 0, sys->output_s, 0, NULL, NULL, &err);
+    CHKERROR(err<0, "Couldn't map measurement staging buffer");
+  }
+  sys->meas_slot_s = sys->output_s;
+}
+
+// Second in-order queue for readbacks that overlap the simulation
+static void
+cls_open_xfer_queue(oclSys sys)
+{
+  cl_int err=0;
+
+  if(sys->xfer_queue!=NULL) return;
+  sys->xfer_queue = clCreateCommandQueueWithProperties(sys->context,
+    sys->device, (cl_queue_properties[])
+    {CL_QUEUE_PROPERTIES,CL_QUEUE_PROFILING_ENABLE,0}, &err);
+  CHKERROR(err<0, "Couldn't create transfer queue");
+}
+
+void
+cls_set_meas_slots(oclSys sys, int slots)
+{
+  CHKERROR((slots<1)||(slots>CLS_MEAS_SLOTS), "Measurement slots out of range");
+
+  if(!sys->native) cls_open_xfer_queue(sys);
+  cls_free_meas_slots(sys);
+  sys->meas_slots = slots;
+}
+
+static void CL_CALLBACK
+cls_meas_done(cl_event ev, cl_int status, void *data)
+{
+  struct meas_slot *slot = data;
+
+  if(status==CL_COMPLETE) slot->cb(slot->host_p, slot->sys->meas_slot_s, slot->user);
+  __atomic_store_n(&slot->busy, 0, __ATOMIC_RELEASE);
+}
+
+int
+cls_get_meas_async(oclSys sys, cls_meas_cb cb, void *user)
+{
+  cl_int err=0;
+  cl_event copy_ev;
+  cl_char ozero = 0;
+
+  if(sys->meas_slots==0) cls_set_meas_slots(sys, 2);
+  if(sys->meas_slot_s!=sys->output_s) cls_alloc_meas_slots(sys);
+
+  int id = sys->meas_next;
+  struct meas_slot *slot = &sys->meas_slot[id];
+
+  if(__atomic_load_n(&slot->busy, __ATOMIC_ACQUIRE))
+  {
+    CHKERROR(slot->cb==NULL, "Measurement slot reused before cls_release_meas");
+    err |= clWaitForEvents(1, &slot->ev);
+    while(__atomic_load_n(&slot->busy, __ATOMIC_ACQUIRE)); // callback still running
+  }
+  if(slot->ev) {clReleaseEvent(slot->ev); slot->ev=NULL;}
+
+  if(sys->native) // read at once, a callback runs before this returns
+  {
+    sys->native->get_meas(sys->native_eng, slot->host_p, sys->output_s, 1);
+    slot->busy = (cb==NULL);
+    slot->cb = cb;
+    slot->user = user;
+    if(cb) cb(slot->host_p, sys->meas_slot_s, user);
+    sys->meas_next = (id+1)%sys->meas_slots;
+    return id;
+  }
+
+  // Device side copy, then the output restarts from zero; the readback itself
+  // runs on the transfer queue while the main queue keeps simulating
+  err |= clEnqueueCopyBuffer(sys->queue, sys->output_b, slot->dev_b, 0, 0,
+    sys->output_s, 0, NULL, &copy_ev);
+  cls_prof_add(sys, CLS_Q_MAIN, NULL, "copy output", sys->output_s, copy_ev);
+  err |= clEnqueueFillBuffer(sys->queue, sys->output_b, &ozero, 1, 0, sys->output_s, 0, NULL,
+    cls_prof_ev(sys, CLS_Q_MAIN, NULL, "fill output", sys->output_s));
+  err |= clEnqueueReadBuffer(sys->xfer_queue, slot->dev_b, CL_FALSE, 0, sys->output_s,
+    slot->host_p, 1, &copy_ev, &slot->ev);
+  cls_prof_add(sys, CLS_Q_XFER, NULL, "read meas", sys->output_s, slot->ev);
+  clReleaseEvent(copy_ev);
+
+  slot->busy = 1;
+  slot->cb = cb;
+  slot->user = user;
+  if(cb) err |= clSetEventCallback(slot->ev, CL_COMPLETE, cls_meas_done, slot);
+
+  err |= clFlush(sys->queue);
+  err |= clFlush(sys->xfer_queue);
+  sys->meas_next = (id+1)%sys->meas_slots;
+
+  CHKERROR(err<0, "Couldn't enqueue measurement readback");
+  return id;
+}
+
+int
+cls_poll_meas(oclSys sys, int id)
+{
+  if(sys->native) return 1;
+
+  cl_int status;
+  cl_int err = clGetEventInfo(sys->meas_slot[id].ev, CL_EVENT_COMMAND_EXECUTION_STATUS,
+    sizeof(cl_int), &status, NULL);
+
+  CHKERROR((err<0)||(status<0), "Measurement readback failed");
+  return status==CL_COMPLETE;
+}
+
+void*
+cls_wait_meas(oclSys sys, int id)
+{
+  struct meas_slot *slot = &sys->meas_slot[id];
+  CHKERROR(slot->cb!=NULL, "Measurement slot is handled by its callback");
+  if(sys->native) return slot->host_p;
+
+  cl_int err = clWaitForEvents(1, &slot->ev);
+  CHKERROR(err<0, "Measurement readback failed");
+  return slot->host_p;
+}
+
+void
+cls_release_meas(oclSys sys, int id)
+{
+  __atomic_store_n(&sys->meas_slot[id].busy, 0, __ATOMIC_RELEASE);
+}
+
+void
+cls_open_stream(oclSys sys, char *filename, cls_stream_hdr *hdr, size_t chunk_n)
+{
+  CHKERROR(sys->native!=NULL, "Streams need an OpenCL system");
+  CHKERROR(sys->stream_map!=NULL, "A stream is already open");
+  CHKERROR((sys->output_b==NULL)||(hdr->frame_s==0)||(sys->output_s%hdr->frame_s),
+    "Output buffer is not a whole number of frames");
+  size_t ring_n = sys->output_s/hdr->frame_s;
+  CHKERROR((chunk_n==0)||(ring_n%chunk_n)||(ring_n/chunk_n<2),
+    "Ring must hold two or more whole chunks");
+
+  cls_open_xfer_queue(sys);
+
+  int fd = open(filename, O_RDWR|O_CREAT|O_TRUNC, 0644);
+  CHKERROR(fd<0, "Couldn't open stream file");
+  size_t map_s = sizeof(cls_stream_hdr) + ring_n*hdr->frame_s;
+  CHKERROR(ftruncate(fd, map_s)<0, "Couldn't size stream file");
+  void *map = mmap(NULL, map_s, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  CHKERROR(map==MAP_FAILED, "Couldn't map stream file");
+
+  sys->stream_fd = fd;
+  sys->stream_map = map;
+  sys->stream_map_s = map_s;
+  sys->stream_ring_n = ring_n;
+  sys->stream_chunk_n = chunk_n;
+  sys->stream_frame_s = hdr->frame_s;
+  sys->stream_frames = 0;
+  sys->stream_ev = (cl_event*)calloc(ring_n/chunk_n, sizeof(cl_event));
+
+  *sys->stream_map = *hdr;
+  memcpy(sys->stream_map->magic, CLS_STREAM_MAGIC, sizeof(sys->stream_map->magic));
+  sys->stream_map->version = CLS_STREAM_VERSION;
+  sys->stream_map->frames = 0;
+  sys->stream_map->data_offset = sizeof(cls_stream_hdr);
+}
+
+// Doubles the file until it holds need bytes. Drains in flight write through
+// the old mapping, so they are finished first.
+static cl_int
+cls_stream_grow(oclSys sys, size_t need)
+{
+  cl_int err = clFinish(sys->xfer_queue);
+  size_t map_s = sys->stream_map_s;
+
+  while(map_s<need) map_s *= 2;
+  munmap(sys->stream_map, sys->stream_map_s);
+  CHKERROR(ftruncate(sys->stream_fd, map_s)<0, "Couldn't grow stream file");
+  void *map = mmap(NULL, map_s, PROT_READ|PROT_WRITE, MAP_SHARED, sys->stream_fd, 0);
+  CHKERROR(map==MAP_FAILED, "Couldn't map stream file");
+
+  sys->stream_map = map;
+  sys->stream_map_s = map_s;
+  return err;
+}
+
+// Reads the last frames enqueued (a whole chunk, or the tail on close) from the
+// ring into the file, on the transfer queue once the measurements are done
+static cl_int
+cls_stream_drain(oclSys sys, size_t frames)
+{
+  cl_int err=0;
+  cl_event meas_ev;
+  cl_ulong first = sys->stream_frames - frames;
+  size_t slot = first%sys->stream_ring_n;
+  size_t need = sizeof(cls_stream_hdr) + sys->stream_frames*sys->stream_frame_s;
+  cl_event *drain_ev = &sys->stream_ev[slot/sys->stream_chunk_n];
+
+  if(need>sys->stream_map_s) err |= cls_stream_grow(sys, need);
+  if(*drain_ev) {clReleaseEvent(*drain_ev); *drain_ev=NULL;}
+
+  char *dst = (char*)sys->stream_map + sizeof(cls_stream_hdr) + first*sys->stream_frame_s;
+  err |= clEnqueueMarkerWithWaitList(sys->queue, 0, NULL, &meas_ev);
+  err |= clEnqueueReadBuffer(sys->xfer_queue, sys->output_b, CL_FALSE,
+    slot*sys->stream_frame_s, frames*sys->stream_frame_s, dst, 1, &meas_ev, drain_ev);
+  cls_prof_add(sys, CLS_Q_XFER, NULL, "stream drain", frames*sys->stream_frame_s, *drain_ev);
+  clReleaseEvent(meas_ev);
+
+  err |= clFlush(sys->queue);
+  err |= clFlush(sys->xfer_queue);
+  return err;
+}
+
+void
+cls_close_stream(oclSys sys)
+{
+  cl_int err=0;
+
+  if(sys->stream_map==NULL) return;
+
+  size_t tail = sys->stream_frames%sys->stream_chunk_n;
+  if(tail) err |= cls_stream_drain(sys, tail);
+  err |= clFinish(sys->xfer_queue);
+
+  for(size_t c = 0; c < sys->stream_ring_n/sys->stream_chunk_n; c++)
+  {
+    if(sys->stream_ev[c]) clReleaseEvent(sys->stream_ev[c]);
+  }
+  free(sys->stream_ev);
+  sys->stream_ev = NULL;
+
+  sys->stream_map->frames = sys->stream_frames;
+  munmap(sys->stream_map, sys->stream_map_s);
+  sys->stream_map = NULL;
+  err |= ftruncate(sys->stream_fd,
+    sizeof(cls_stream_hdr) + sys->stream_frames*sys->stream_frame_s);
+  close(sys->stream_fd);
+
+  CHKERROR(err<0, "Couldn't finish stream file");
+}
+
+cls_stream_hdr*
+cls_map_stream(char *filename)
+{
+  int fd = open(filename, O_RDONLY);
+  CHKERROR(fd<0, "Couldn't open stream file");
+  off_t file_s = lseek(fd, 0, SEEK_END);
+  CHKERROR(file_s<(off_t)sizeof(cls_stream_hdr), "Stream file is too short");
+
+  cls_stream_hdr *hdr = mmap(NULL, file_s, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  CHKERROR(hdr==MAP_FAILED, "Couldn't map stream file");
+  CHKERROR(memcmp(hdr->magic, CLS_STREAM_MAGIC, sizeof(hdr->magic))||
+    (hdr->version!=CLS_STREAM_VERSION), "Not an oclsim stream file");
+  CHKERROR(hdr->data_offset + hdr->frames*hdr->frame_s>file_s, "Stream file is truncated");
+
+  return hdr;
+}
+
+void
+cls_unmap_stream(cls_stream_hdr *hdr)
+{
+  munmap(hdr, hdr->data_offset + hdr->frames*hdr->frame_s);
+}
+
+void
+cls_set_profiling(oclSys sys, int enable)
+{
+  if(sys->prof!=NULL) // drop what was recorded
+  {
+    cls_prof_collect(sys->prof, 1);
+    free(sys->prof->trace);
+    free(sys->prof);
+    sys->prof = NULL;
+  }
+  if(enable) sys->prof = (struct cls_prof*)calloc(1, sizeof(struct cls_prof));
+}
+
+void
+cls_prof_report(oclSys sys, FILE *out)
+{
+  struct cls_prof *prof = sys->prof;
+  if(prof==NULL) return;
+
+  cls_prof_collect(prof, 1);
+
+  fprintf(out, "%-24s %8s %12s %10s %10s %10s %10s %12s\n",
+    "command", "count", "total_ms", "min_us", "mean_us", "p99_us", "max_us", "MB/s");
+  for(int n = 0; n < prof->names_n; n++)
+  {
+    struct prof_agg *agg = &prof->aggs[n];
+    size_t rank = (agg->count*99)/100, below = 0;
+    int b = 0;
+
+    if(agg->count==0) continue;
+    for(; (b < CLS_PROF_BINS-1)&&(below+agg->hist[b]<=rank); b++) below += agg->hist[b];
+    cl_ulong p99 = cls_prof_bin_top(b); // upper edge of the bin, within min..max
+    if(p99>agg->max) p99 = agg->max;
+    if(p99<agg->min) p99 = agg->min;
+
+    fprintf(out, "%-24s %8zu %12.3f %10.2f %10.2f %10.2f %10.2f", prof->names[n], agg->count,
+      agg->total*1e-6, agg->min*1e-3, (double)agg->total/agg->count*1e-3, p99*1e-3, agg->max*1e-3);
+    if(agg->bytes) fprintf(out, " %12.1f\n", agg->total ? agg->bytes*1e3/agg->total : 0.0); // bytes/ns*1e3
+    else fprintf(out, " %12s\n", "-");
+  }
+}
+
+// Chrome trace event format, loadable in chrome://tracing and Perfetto. One
+// track per queue; times in microseconds from the first queued command.
+void
+cls_prof_trace(oclSys sys, char *filename)
+{
+  struct cls_prof *prof = sys->prof;
+  const char *queues[] = {"main queue", "transfer queue", "graph queue"};
+  if(prof==NULL) return;
+
+  cls_prof_collect(prof, 1);
+  FILE *fh = fopen(filename, "w");
+  CHKERROR(fh==NULL, "Couldn't open trace file");
+
+  cl_ulong t0 = (cl_ulong)-1;
+  for(size_t r = 0; r < prof->trace_n; r++)
+  {
+    if(prof->trace[r].t[0]<t0) t0 = prof->trace[r].t[0];
+  }
+  if(prof->trace_dropped) fprintf(stderr, "Trace holds the first %zu commands, %zu more left out\n",
+    prof->trace_n, prof->trace_dropped);
+
+  fprintf(fh, "{\"traceEvents\":[\n");
+  for(int q = 0; q < 3; q++)
+  {
+    fprintf(fh, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,"
+      "\"args\":{\"name\":\"%s\"}},\n", q, queues[q]);
+  }
+  for(size_t r = 0; r < prof->trace_n; r++)
+  {
+    struct prof_rec *rec = &prof->trace[r];
+    fprintf(fh, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+      "\"args\":{\"queued_us\":%.3f,\"submit_us\":%.3f,\"bytes\":%zu}},\n",
+      prof->names[rec->name], rec->queue, (rec->t[2]-t0)*1e-3, (rec->t[3]-rec->t[2])*1e-3,
+      (rec->t[0]-t0)*1e-3, (rec->t[1]-t0)*1e-3, rec->bytes);
+  }
+  fprintf(fh, "{\"name\":\"end\",\"ph\":\"i\",\"pid\":0,\"tid\":0,\"ts\":0,\"s\":\"g\"}\n]}\n");
+  fclose(fh);
+}
+
+void
+cls_release_sys(oclSys sys)
+{
+  cls_close_stream(sys);
+  if(sys->prof!=NULL)
+  {
+    char *trace = getenv("OCLSIM_PROFILE");
+    cls_prof_report(sys, stderr);
+    if((trace!=NULL)&&(*trace!='\0')) cls_prof_trace(sys, trace);
+    cls_set_profiling(sys, 0);
+  }
+  free(sys->arg_info);
+  free(sys->defines);
+  cls_free_meas_slots(sys);
+  cls_drop_arg(&sys->init_arg_h);
+  cls_drop_arg(&sys->main_arg_h);
+  cls_drop_arg(&sys->meas_arg_h);
+  if(sys->native_eng) {sys->native->release(sys->native_eng); sys->native_eng=NULL;}
+  if(sys->xfer_queue) {clReleaseCommandQueue(sys->xfer_queue); sys->xfer_queue=NULL;}
+  if(sys->program) {clReleaseProgram(sys->program); sys->program=NULL;}
   if(sys->queue) {clReleaseCommandQueue(sys->queue); sys->queue=NULL;}
   if(sys->context) {clReleaseContext(sys->context); sys->context=NULL;}
   if(sys->states_b[0]) {clReleaseMemObject(sys->states_b[0]); sys->states_b[0]=NULL;}
@@ -347,6 +2927,12 @@ cls_release_sys(oclSys sys)
   if(sys->meas_k[1]) {clReleaseKernel(sys->meas_k[1]); sys->meas_k[1]=NULL;}
   if(sys->meas_arg_b) {clReleaseMemObject(sys->meas_arg_b); sys->meas_arg_b=NULL;}
   if(sys->output_b) {clReleaseMemObject(sys->output_b); sys->output_b=NULL;}
+  for(size_t b = 0; b < sys->bufs_n; b++)
+  {
+    if(sys->bufs[b].mem[1]!=sys->bufs[b].mem[0]) clReleaseMemObject(sys->bufs[b].mem[1]);
+    clReleaseMemObject(sys->bufs[b].mem[0]);
+  }
+  free(sys->bufs);
   free(sys);
 }
 
@@ -16,6 +16,8 @@ GNU General Public License for more details.
 #ifndef OCLSIM_HEADER_BLOCK
 #define OCLSIM_HEADER_BLOCK
 
+#include <stdio.h>
+
 #define CL_TARGET_OPENCL_VERSION 200
 #include <CL/cl.h>
 
@@ -24,6 +26,59 @@ GNU General Public License for more details.
 #define MEASURE_K_NAME "measure_k"
 
 typedef struct oclsim_sys* oclSys;
+typedef struct oclsim_sched* oclSched;
+typedef struct oclsim_graph* oclGraph;
+typedef struct oclsim_multi* oclMulti;
+typedef struct oclsim_pool* oclPool;
+
+typedef enum _cls_step
+{
+  CLS_STEP_INIT,
+  CLS_STEP_UPDATE,
+  CLS_STEP_MEAS
+} cls_step;
+
+typedef enum _cls_mode
+{
+  CLS_MODE_PINGPONG, // update_k(out, in, ...) over the whole range, two state buffers
+  CLS_MODE_INPLACE   // update_k(state, state, ..., color) over one sublattice, one buffer
+} cls_mode;
+
+typedef enum _cls_role
+{
+  CLS_BUF_STATE,   // evolves with the updates, double buffered like the main state
+  CLS_BUF_STATIC,  // single buffer, written by the host or init_k, read-only after
+  CLS_BUF_SCRATCH, // single device-only work buffer
+  CLS_BUF_OUTPUT   // single buffer, zeroed on creation, read back by the host
+} cls_role;
+
+typedef enum _cls_dtype
+{
+  CLS_DTYPE_I8,
+  CLS_DTYPE_U8,
+  CLS_DTYPE_I32,
+  CLS_DTYPE_U32,
+  CLS_DTYPE_F32,
+  CLS_DTYPE_F64
+} cls_dtype;
+
+#define CLS_STREAM_MAGIC "OCLSSTRM"
+#define CLS_STREAM_VERSION 1
+
+// Stream file header, frames start at data_offset
+typedef struct _cls_stream_hdr
+{
+  char magic[8];
+  cl_uint version;
+  cl_uint dtype; // cls_dtype of the frame elements
+  cl_uint dim; // frame shape, dims[0] varies fastest
+  cl_uint dims[3];
+  cl_uint stride; // simulation steps between frames
+  cl_uint pad;
+  cl_ulong frame_s; // bytes per frame
+  cl_ulong frames; // frames in the file, set on close
+  cl_ulong data_offset;
+} cls_stream_hdr;
 
 typedef struct _dims_i
 {
@@ -32,22 +87,154 @@ typedef struct _dims_i
   size_t local[3]; // local range
 } dims_i;
 
+// Native engines: host code in place of a program's init, update and measure
+// kernels, run synchronously behind the same calls. load gets the -D options
+// given to cls_define and the state size, set_arg the structs passed to
+// cls_set_*_arg, and get_meas copies the output (out_s bytes, as set by
+// cls_set_meas_arg), restarting it from zero if clear is set. Named buffers,
+// kernel selection, graphs, streams, checkpoints and profiling need a device.
+typedef struct _cls_native
+{
+  void* (*load)(const char* defines, size_t states_s);
+  void (*set_arg)(void* eng, cls_step step, void* arg, size_t arg_s);
+  void (*run)(void* eng, cls_step step);
+  void (*get_meas)(void* eng, void* out, size_t out_s, int clear);
+  void (*release)(void* eng);
+} cls_native;
+
 // void ocls_print_devices(void);
 oclSys cls_new_sys(int plat_i, int dev_i);
+oclSys cls_new_sys_native(const cls_native* native); // no OpenCL calls are made
+oclSys cls_new_sys_shared(oclSys sys); // same device and context, own queue
+void cls_set_mode(oclSys sys, cls_mode mode); // before cls_load_sys_*
+void cls_define(oclSys sys, char* name, long value); // -D name=value, before cls_load_sys_*
 
 void cls_load_sys_from_file(oclSys sys, char* src_filename, size_t states_s);
 void cls_load_sys_from_str(oclSys sys, char* src_str, size_t states_s);
 
+// Extra named buffers, bound to every kernel argument with the same name. In
+// update_k a CLS_BUF_STATE buffer "x" is read through "x" and written through
+// "x_next". data may be NULL.
+void cls_add_buffer(oclSys sys, char* name, cls_role role, size_t size, void* data);
+void cls_write_buffer(oclSys sys, char* name, void* data);
+size_t cls_read_buffer(oclSys sys, char* name, void* out);
+
 void cls_set_init_arg(oclSys sys, void* arg, size_t arg_s, dims_i dims);
 void cls_set_main_arg(oclSys sys, void* arg, size_t arg_s, size_t local_s, dims_i dims);
+void cls_set_init_kernel(oclSys sys, char* name); // replaces INIT_K_NAME
+void cls_set_main_kernel(oclSys sys, char* name); // replaces MAIN_K_NAME
+void cls_set_meas_kernel(oclSys sys, char* name); // replaces MEASURE_K_NAME
 void cls_set_meas_arg(oclSys sys, void* arg, size_t arg_s, size_t local_s, size_t meas_s, dims_i dims);
 
 void cls_run_init(oclSys sys);
 void cls_run_update(oclSys sys);
 void cls_run_meas(oclSys sys);
+void cls_run_update_n(oclSys sys, size_t n);
+void cls_finish(oclSys sys); // waits for everything enqueued so far
+
+// Picks the fastest local range for the init or update kernel as configured by
+// the last cls_set_*_arg, timing the candidate shapes on the device, and applies
+// it. Winners are cached per device and kernel configuration, so later runs only
+// look them up. The timed launches advance the state: tune after one
+// cls_run_init and run it again before simulating.
+// Kernels declared with reqd_work_group_size keep that range untimed; others
+// must work with any local range. Returns the dims to pass to later
+// cls_set_*_arg calls.
+dims_i cls_autotune(oclSys sys, cls_step step);
+
+// Recorded init/update/measure schedules, replayed with a single call
+oclSched cls_new_sched(oclSys sys);
+void cls_sched_add(oclSched sched, cls_step step, size_t count);
+void cls_run_sched(oclSched sched, size_t repeat);
+void cls_release_sched(oclSched sched);
+
+// Kernel graphs: any kernels of the program, arguments bound by name to the
+// named buffers (local arguments get local_s bytes, "input" and "output" the
+// main state as in update_k), dependencies enforced with events on an
+// out-of-order queue when available. Nodes with swap set flip the state parity
+// seen by the nodes depending on them. Nodes must be added in dependency order.
+oclGraph cls_new_graph(oclSys sys);
+int cls_graph_node(oclGraph graph, char* kernel_name, dims_i dims, size_t local_s, int swap);
+void cls_graph_dep(oclGraph graph, int node, int dep);
+void cls_run_graph(oclGraph graph, size_t repeat);
+void cls_release_graph(oclGraph graph);
+
+// Multi-device domain decomposition: one part per device of a platform, or per
+// sub-device of one device (clCreateSubDevices), all in one context. Each part
+// is configured like a system over its own slab, its state buffer laid out as
+// halo rows of row_s bytes, the part's owned rows, and halo rows again. The
+// update range of each part covers its owned rows (dimension 0) and is launched
+// past the top halo; the depth rows next to each halo are copied to the
+// neighbours (periodically) after every update, overlapping the interior rows.
+// Init and measure kernels run over the whole slab; init halos are refreshed by
+// an exchange, and measurements must skip the halo rows themselves.
+oclMulti cls_new_multi(int plat_i, int* dev_i, int devs_n);
+oclMulti cls_new_multi_sub(int plat_i, int dev_i, int parts);
+int cls_multi_parts(oclMulti multi);
+oclSys cls_multi_part(oclMulti multi, int p);
+void cls_multi_layout(oclMulti multi, size_t row_s, size_t halo, size_t depth, size_t* rows);
+void cls_multi_run_init(oclMulti multi);
+void cls_multi_run_update_n(oclMulti multi, size_t n);
+void cls_multi_run_meas(oclMulti multi);
+void cls_multi_finish(oclMulti multi);
+void cls_release_multi(oclMulti multi);
+
+// Job pools for parameter sweeps: queues systems per device of a platform (all
+// devices when dev_i is NULL), each configured by the caller like any system
+// (load, buffers, arguments). cls_run_pool runs jobs 0..jobs_n-1 with one host
+// thread per system: run sets the job's arguments and enqueues its steps, its
+// measurements are read back while the next job is enqueued, and done gets
+// them in job order. Idle systems steal jobs queued for the others.
+typedef void (*cls_job_fn)(oclSys sys, int job, void *user);
+typedef void (*cls_done_fn)(int job, void *meas, void *user);
+oclPool cls_new_pool(int plat_i, int* dev_i, int devs_n, int queues);
+int cls_pool_size(oclPool pool);
+oclSys cls_pool_sys(oclPool pool, int i);
+void cls_run_pool(oclPool pool, int jobs_n, cls_job_fn run, cls_done_fn done, void* user);
+void cls_release_pool(oclPool pool);
+
+// Checkpoints: cls_save_state writes the active side (by parity) of the main
+// state and of the CLS_BUF_STATE buffers, plus user_s bytes of the caller's, to
+// a versioned file; cls_load_state reads them back into a system of the same
+// sizes and returns the user block size. cls_copy_state copies one system's
+// current state into another, on the device when they share a context (made
+// with cls_new_sys_shared). Both leave the state in buffer 0 as after init, so a swapped in
+// init kernel can reseed it.
+void cls_save_state(oclSys sys, char* filename, void* user, size_t user_s);
+size_t cls_load_state(oclSys sys, char* filename, void* user, size_t user_s);
+void cls_copy_state(oclSys dst, oclSys src);
 
 size_t cls_get_meas(oclSys sys, void *out);
 
+// Non-blocking readback: cls_get_meas_async takes the measurements gathered so
+// far (the device output restarts from zero) and returns the slot they are read
+// into. Up to slots readbacks (2 by default) can be in flight; a slot is reused
+// after cls_release_meas, or after its callback returns. Callbacks run on a
+// driver thread and must not enqueue on the system.
+typedef void (*cls_meas_cb)(void *data, size_t size, void *user);
+void cls_set_meas_slots(oclSys sys, int slots);
+int cls_get_meas_async(oclSys sys, cls_meas_cb cb, void *user);
+int cls_poll_meas(oclSys sys, int slot); // 1 once the data is on the host
+void* cls_wait_meas(oclSys sys, int slot); // pinned copy, valid until released
+void cls_release_meas(oclSys sys, int slot);
+
+// Snapshot streaming: the output buffer (set by cls_set_meas_arg) becomes a ring
+// of hdr->frame_s sized frames. Each measurement gets its ring slot as a fifth
+// uint argument; every chunk_n frames are appended to filename without
+// blocking. Schedules run without command buffers while a stream is open.
+void cls_open_stream(oclSys sys, char* filename, cls_stream_hdr* hdr, size_t chunk_n);
+void cls_close_stream(oclSys sys); // writes the remaining frames
+cls_stream_hdr* cls_map_stream(char* filename); // read-only, for replay
+void cls_unmap_stream(cls_stream_hdr* hdr);
+
+// Profiling: with profiling on, every launch and transfer keeps its event and
+// the queued/submit/start/end times are collected. Setting $OCLSIM_PROFILE turns
+// it on in cls_new_sys, and cls_release_sys then prints the report on stderr and,
+// if the value is a file name, writes the trace there.
+void cls_set_profiling(oclSys sys, int enable); // drops what was recorded
+void cls_prof_report(oclSys sys, FILE* out); // per command count, min/mean/p99/max, MB/s
+void cls_prof_trace(oclSys sys, char* filename); // Chrome trace/Perfetto JSON
+
 void cls_release_sys(oclSys sys);
 
 #endif
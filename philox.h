@@ -0,0 +1,73 @@
+/*
+Copyright (C) 2022 Franco Sauvisky
+philox.h is part of oclsim
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+// Philox4x32-10 counter-based RNG (Salmon et al., "Parallel random numbers:
+// as easy as 1, 2, 3", SC11). Stateless: every call maps (key, counter) to four
+// independent 32-bit words, so kernels need no per-site seed storage.
+// Usable from OpenCL kernels and from host C code.
+
+#ifndef PHILOX_HEADER
+#define PHILOX_HEADER
+
+#ifdef __OPENCL_VERSION__
+typedef uint philox_uint;
+#define PHILOX_FN inline
+#define PHILOX_MULHI(a,b) mul_hi((uint)(a),(uint)(b))
+#else
+#include <stdint.h>
+typedef uint32_t philox_uint;
+#define PHILOX_FN static inline
+#define PHILOX_MULHI(a,b) ((uint32_t)(((uint64_t)(a)*(uint64_t)(b))>>32))
+#endif
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+#define PHILOX_K1 0x5eed0c15u // second key word, fixed
+
+typedef struct philox4x32_s
+{
+  philox_uint v[4];
+} philox4x32_t;
+
+PHILOX_FN philox4x32_t
+philox4x32(philox4x32_t ctr, philox_uint k0, philox_uint k1)
+{
+  for(int r = 0; r < PHILOX_ROUNDS; r++)
+  {
+    philox_uint hi0 = PHILOX_MULHI(PHILOX_M0, ctr.v[0]), lo0 = PHILOX_M0*ctr.v[0];
+    philox_uint hi1 = PHILOX_MULHI(PHILOX_M1, ctr.v[2]), lo1 = PHILOX_M1*ctr.v[2];
+    ctr.v[0] = hi1^ctr.v[1]^k0;
+    ctr.v[1] = lo1;
+    ctr.v[2] = hi0^ctr.v[3]^k1;
+    ctr.v[3] = lo0;
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+  return ctr;
+}
+
+// Four random words for a site at a given step; sub selects further blocks
+// of four when a site needs more than four numbers per step
+PHILOX_FN philox4x32_t
+philox_rand4(philox_uint seed, philox_uint site, philox_uint step, philox_uint sub)
+{
+  philox4x32_t ctr = {{site, step, sub, 0}};
+  return philox4x32(ctr, seed, PHILOX_K1);
+}
+
+#endif
@@ -0,0 +1,107 @@
+/*
+Copyright (C) 2022 Franco Sauvisky
+rngtest.c is part of oclsim
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "oclsim.h"
+#include "rngtest.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <math.h>
+
+#define SAMPLES ((double)RT_STEPS*RT_SITES)
+#define UNIF(x) ((x)/4294967296.0)
+
+// Statistics of a [RT_STEPS][RT_SITES] block of random words, all expressed as
+// z-scores that should stay within a few units for a good generator
+void
+print_stats(char *name, uint_t samples[RT_STEPS][RT_SITES])
+{
+  double sum = 0.0, bins[RT_BINS] = {0}, bits[32] = {0};
+  double t_xy = 0.0, t_n = 0.0, s_xy = 0.0, s_n = 0.0;
+
+  for(int t = 0; t < RT_STEPS; t++)
+  {
+    for(int i = 0; i < RT_SITES; i++)
+    {
+      uint_t x = samples[t][i];
+      double u = UNIF(x) - 0.5;
+
+      sum += u;
+      bins[x >> 24] += 1;
+      for(int b = 0; b < 32; b++) bits[b] += (x >> b)&1;
+
+      if(t+1 < RT_STEPS) // same site, next step
+      {
+        t_xy += u*(UNIF(samples[t+1][i]) - 0.5);
+        t_n += 1;
+      }
+      if(i+1 < RT_SITES) // neighbouring site, same step
+      {
+        s_xy += u*(UNIF(samples[t][i+1]) - 0.5);
+        s_n += 1;
+      }
+    }
+  }
+
+  double chi2 = 0.0, bit_z = 0.0;
+  for(int k = 0; k < RT_BINS; k++)
+  {
+    chi2 += pow(bins[k] - SAMPLES/RT_BINS, 2)/(SAMPLES/RT_BINS);
+  }
+  for(int b = 0; b < 32; b++)
+  {
+    bit_z = fmax(bit_z, fabs(bits[b] - SAMPLES/2)/sqrt(SAMPLES/4));
+  }
+
+  printf("%-8s %9.3f %9.3f %9.3f %9.3f %9.3f\n", name,
+    sum/sqrt(SAMPLES/12.0),                 // mean
+    (chi2 - (RT_BINS-1))/sqrt(2.0*(RT_BINS-1)), // top-byte histogram
+    bit_z,                                  // worst single-bit bias
+    12.0*t_xy/sqrt(t_n),                    // lag-1 correlation in time
+    12.0*s_xy/sqrt(s_n));                   // lag-1 correlation in space
+}
+
+void
+main(void)
+{
+  oclSys rngsys = cls_new_sys(0,0);
+  cls_load_sys_from_file(rngsys, "./rngtest.cl", sizeof(struct state_s));
+
+  struct init_arg_s init_arg = {.rseed = (uint_t)time(NULL)};
+  struct main_arg_s main_arg;
+  struct meas_arg_s meas_arg;
+
+  cls_set_init_arg(rngsys, &init_arg, sizeof(init_arg), RT_DIMS);
+  cls_set_main_arg(rngsys, &main_arg, sizeof(main_arg), 1, RT_DIMS);
+  cls_set_meas_arg(rngsys, &meas_arg, sizeof(meas_arg), 1, sizeof(struct output_s), RT_DIMS);
+
+  oclSched sched = cls_new_sched(rngsys);
+  cls_sched_add(sched, CLS_STEP_MEAS, 1);
+  cls_sched_add(sched, CLS_STEP_UPDATE, 1);
+
+  cls_run_init(rngsys);
+  cls_run_sched(sched, RT_STEPS);
+
+  struct output_s *out = malloc(sizeof(struct output_s));
+  cls_get_meas(rngsys, out);
+  cls_release_sched(sched);
+  cls_release_sys(rngsys);
+
+  printf("%-8s %9s %9s %9s %9s %9s\n", "z-score", "mean", "chi2", "bits", "time", "space");
+  print_stats("wang", out->wang);
+  print_stats("philox", out->philox);
+
+  free(out);
+}
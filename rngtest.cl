@@ -0,0 +1,59 @@
+#include "rngtest.h"
+#include "philox.h"
+
+// Per-site hash chain formerly used by ising.cl
+// Based on "4-byte Integer Hashing" by Thomas Wang
+// http://www.burtleburtle.net/bob/hash/integer.html
+inline uint
+randomize_seed(uint a)
+{
+  a = (a ^ 61) ^ (a >> 16);
+  a = a + (a << 3);
+  a = a ^ (a >> 4);
+  a = a * 0x27d4eb2d;
+  a = a ^ (a >> 15);
+  return a;
+}
+
+kernel void
+init_k(global struct state_s *output,
+       constant struct init_arg_s *arg)
+{
+  size_t i = get_global_id(0);
+
+  output->wang[i] = randomize_seed(arg->rseed + 98473*i);
+  if(i==0)
+  {
+    output->counter = 0;
+    output->rseed = arg->rseed;
+  }
+}
+
+kernel void
+update_k(global struct state_s *output,
+         global struct state_s *input,
+         local void *lc_skpd,
+         constant struct main_arg_s *arg)
+{
+  size_t i = get_global_id(0);
+
+  output->wang[i] = randomize_seed(input->wang[i] + 42013*i);
+  if(i==0)
+  {
+    output->counter = input->counter+1;
+    output->rseed = input->rseed;
+  }
+}
+
+kernel void
+measure_k(global struct output_s *output,
+          global struct state_s *input,
+          local void* lc_skpd,
+          constant struct meas_arg_s *arg)
+{
+  size_t i = get_global_id(0);
+  uint iter = input->counter;
+
+  output->wang[iter][i] = input->wang[i];
+  output->philox[iter][i] = philox_rand4(input->rseed, i, iter, 0).v[0];
+}
@@ -0,0 +1,65 @@
+/*
+Copyright (C) 2022 Franco Sauvisky
+rngtest.h is part of oclsim
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef RNGTEST_HEADER
+#define RNGTEST_HEADER
+
+// Parameters:
+#define RT_SITES 4096
+#define RT_STEPS 64
+#define RT_BINS 256
+
+#define LOCAL_1D_LENGTH 256
+#define RT_DIMS ((dims_i){.dim=1,.global={RT_SITES,0,0},.local={LOCAL_1D_LENGTH,0,0}})
+
+// Typedefs:
+#ifdef __OPENCL_VERSION__
+typedef int int_t;
+typedef uint uint_t;
+#else
+typedef cl_int int_t;
+typedef cl_uint uint_t;
+#endif
+
+// Structs:
+struct output_s
+{
+  uint_t wang[RT_STEPS][RT_SITES];
+  uint_t philox[RT_STEPS][RT_SITES];
+};
+
+struct state_s
+{
+  uint_t wang[RT_SITES]; // per-site seeds of the hash-chain generator
+  int_t counter;
+  uint_t rseed;
+} __attribute__((__packed__));
+
+struct init_arg_s
+{
+  uint_t rseed;
+} __attribute__((__packed__));
+
+struct main_arg_s
+{
+  int_t und;
+};
+
+struct meas_arg_s
+{
+  int_t und;
+};
+
+#endif
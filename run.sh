@@ -1,8 +1,9 @@
 #!/bin/bash
 
-if [[ $1 == "mandel" ]]; then
-	make -E "PGR=$1" && "./build/$1" > ./build/mandel.dat
-	octave ./mandel_plot.m
+if [[ $1 == mandelpng ]]; then
+	make -E "PGR=$1" && "./build/$1"
+elif [[ $1 == mandel* ]]; then
+	make -E "PGR=$1" && "./build/$1" && make -E "PGR=mandelpng" && ./build/mandelpng
 else
 	make -E "PGR=$1" && "./build/$1"
 fi